@@ -0,0 +1,15 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+#include <glm/glm.hpp>
+
+/* Pushed to shader.comp as PushConstants, so the layout has to match it */
+struct Camera {
+    alignas(16) glm::vec3 position = glm::vec3(0, 0, 10.0);
+    alignas(16) glm::vec3 forward = glm::vec3(0, 1, 0);
+    alignas(16) glm::vec3 up = glm::vec3(0, 0, 1);
+    alignas(16) glm::vec3 right = glm::vec3(1, 0, 0);
+    alignas(4) float cur_time = 0.0f;
+    alignas(16) glm::vec3 sunDirection = glm::vec3(-1, -1, -1);
+};
+
+#endif // CAMERA_H
@@ -0,0 +1,131 @@
+#include "cpuprofiler.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef ENABLE_PROFILER
+
+namespace {
+
+/* Fields are atomic so the trace writer can read a slot its thread is overwriting.
+sequence is odd while event number n is being written and 2 * n + 2 once it is complete. */
+struct Event {
+    std::atomic<uint64_t> sequence {0};
+    std::atomic<const char*> name {nullptr};
+    std::atomic<uint64_t> start {0};
+    std::atomic<uint64_t> duration {0};
+};
+
+/* Written only by its own thread. head counts every event ever recorded. */
+struct ThreadBuffer {
+    std::unique_ptr<Event[]> events = std::make_unique<Event[]>(CPUProfiler::eventsPerThread);
+    std::atomic<uint64_t> head {0};
+    std::atomic<const char*> name {nullptr};
+    int id = 0;
+};
+
+/* Buffers stay alive after their thread exits so their events still get written */
+std::mutex buffersMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+uint64_t nowNs() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+}
+
+ThreadBuffer& threadBuffer() {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffers.push_back(std::make_unique<ThreadBuffer>());
+        buffer = buffers.back().get();
+        buffer->id = int(buffers.size());
+    }
+    return *buffer;
+}
+
+}
+
+CPUProfiler::Zone::Zone(const char* _name) : name(_name), start(nowNs()) {}
+
+CPUProfiler::Zone::~Zone() {
+    const uint64_t end = nowNs();
+    ThreadBuffer& buffer = threadBuffer();
+    const uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    Event& event = buffer.events[head % eventsPerThread];
+    event.sequence.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.duration.store(end - start, std::memory_order_relaxed);
+    event.sequence.store(2 * head + 2, std::memory_order_release);
+    buffer.head.store(head + 1, std::memory_order_release);
+}
+
+void CPUProfiler::setThreadName(const char* name) {
+    threadBuffer().name.store(name, std::memory_order_relaxed);
+}
+
+size_t CPUProfiler::writeChromeTrace(const std::string& filename) {
+    std::ofstream file(filename);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open " + filename + " for writing!");
+    }
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    size_t written = 0;
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (const std::unique_ptr<ThreadBuffer>& buffer : buffers) {
+        const char* threadName = buffer->name.load(std::memory_order_relaxed);
+        if (threadName != nullptr) {
+            file << (written > 0 ? ",\n" : "") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->id
+                 << ",\"args\":{\"name\":\"" << threadName << "\"}}";
+            written++;
+        }
+        const uint64_t head = buffer->head.load(std::memory_order_acquire);
+        const uint64_t first = head > eventsPerThread ? head - eventsPerThread : 0;
+        for (uint64_t i = first; i < head; i++) {
+            const Event& event = buffer->events[i % eventsPerThread];
+            /* Skip events the thread has lapped, whether before or while copying them */
+            const uint64_t sequence = 2 * i + 2;
+            if (event.sequence.load(std::memory_order_acquire) != sequence) {
+                continue;
+            }
+            const char* name = event.name.load(std::memory_order_relaxed);
+            const uint64_t start = event.start.load(std::memory_order_relaxed);
+            const uint64_t duration = event.duration.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (event.sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;
+            }
+            /* Chrome wants microseconds, fractions are fine */
+            file << (written > 0 ? ",\n" : "") << "{\"ph\":\"X\",\"name\":\"" << name << "\",\"pid\":1,\"tid\":" << buffer->id
+                 << ",\"ts\":" << double(start) / 1000.0 << ",\"dur\":" << double(duration) / 1000.0 << "}";
+            written++;
+        }
+    }
+    file << "\n]}\n";
+    return written;
+}
+
+#else
+
+CPUProfiler::Zone::Zone(const char* _name) : name(_name), start(0) {}
+
+CPUProfiler::Zone::~Zone() {}
+
+void CPUProfiler::setThreadName(const char* name) {}
+
+size_t CPUProfiler::writeChromeTrace(const std::string& filename) {
+    return 0;
+}
+
+#endif // ENABLE_PROFILER
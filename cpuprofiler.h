@@ -0,0 +1,62 @@
+#ifndef CPUPROFILER_H
+#define CPUPROFILER_H
+#include <string>
+#include <cstdint>
+
+/*
+Scoped CPU zones, exported as a Chrome trace (chrome://tracing or Perfetto).
+
+Build with -DENABLE_PROFILER to turn them on. Without it PROFILE_ZONE
+expands to nothing, so instrumented code compiles exactly as if it wasn't.
+
+Each thread records into its own fixed size ring buffer, so recording never
+takes a lock: a zone just reads the clock when it starts and writes one
+event when it ends. Only the newest eventsPerThread events of each thread
+are kept. Writing the trace reads every buffer without stopping their
+threads; events they overwrite while it runs are left out rather than torn.
+*/
+class CPUProfiler
+{
+public:
+    class Zone
+    {
+    public:
+        /* name must outlive the profiler, in practice a string literal */
+        explicit Zone(const char* name);
+        ~Zone();
+
+        Zone(const Zone&) = delete;
+        Zone& operator=(const Zone&) = delete;
+
+    private:
+        const char* name;
+        uint64_t start;
+    };
+
+#ifdef ENABLE_PROFILER
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    /* Shown instead of the thread id in the trace */
+    static void setThreadName(const char* name);
+    /* Returns the number of events written, 0 if profiling is compiled out */
+    static size_t writeChromeTrace(const std::string& filename);
+
+    static constexpr size_t eventsPerThread = 1 << 16;
+};
+
+#ifdef ENABLE_PROFILER
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) CPUProfiler::Zone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_ZONE(__func__)
+#define PROFILE_THREAD_NAME(name) CPUProfiler::setThreadName(name)
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_FUNCTION()
+#define PROFILE_THREAD_NAME(name)
+#endif
+
+#endif // CPUPROFILER_H
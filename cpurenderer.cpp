@@ -0,0 +1,798 @@
+#include "cpurenderer.h"
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include "sdf/simd.h"
+#include "cpuprofiler.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr size_t lanes = simd::width;
+static_assert(CPURenderer::tileSize % lanes == 0, "Tile rows have to split into whole packets");
+
+/* Constants from shader.comp */
+constexpr float max_dist = 10000.0f;
+constexpr float max_indirect_dist = 2.0f;
+constexpr float shadow_offset = 0.0001f;
+/* Only for Traversal::PlaneSteps, as they were in shader.comp. The bias is a float there too, so exactly 1.0. */
+constexpr float eps = 0.1f;
+constexpr float next_plane_bias = 0.999999999f;
+
+/* random() in shader.comp, returns [0.0, 1.0) */
+float random(float x, float y) {
+    const float v = std::sin(x * 12.9898f + y * 78.233f) * 43758.5453123f;
+    return v - std::floor(v);
+}
+
+glm::vec3 voxelColor(Material id) {
+    switch (id) {
+    case Stone:
+        return glm::vec3(50.0f, 54.0f, 38.0f) / 255.0f;
+    case Dirt:
+        return glm::vec3(188.0f, 108.0f, 37.0f) / 255.0f;
+    case Grass:
+        return glm::vec3(96.0f, 108.0f, 56.0f) / 255.0f;
+    case Bark:
+        return glm::vec3(122.0f, 119.0f, 110.0f) / 255.0f;
+    case Wood:
+        return glm::vec3(224.0f, 201.0f, 137.0f) / 255.0f;
+    case Glass:
+        return glm::vec3(0.9f);
+    default:
+        return glm::vec3(1.0f, 0.0f, 0.0f);
+    }
+}
+
+float voxelColorVariance(Material id) {
+    switch (id) {
+    case Stone:
+        return 0.01f;
+    case Dirt:
+        return 0.05f;
+    case Grass:
+    case Bark:
+    case Wood:
+        return 0.1f;
+    default:
+        return 0.01f;
+    }
+}
+
+uint8_t toUnorm8(float c) {
+    return uint8_t(std::lround(std::min(std::max(c, 0.0f), 1.0f) * 255.0f));
+}
+
+/*
+L1 data cache read misses and last level cache misses of the calling
+thread, through perf_event_open. Elsewhere, or where the kernel or a VM
+doesn't expose the counters, they read as -1.
+*/
+class CacheCounters {
+public:
+    static constexpr int count = 2;
+
+    CacheCounters() {
+#ifdef __linux__
+        const uint64_t configs[count][2] = {
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}
+        };
+        for (int c = 0; c < count; c++) {
+            perf_event_attr attr {};
+            attr.size = sizeof(attr);
+            attr.type = uint32_t(configs[c][0]);
+            attr.config = configs[c][1];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[c] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+    ~CacheCounters() {
+#ifdef __linux__
+        for (int c = 0; c < count; c++) {
+            if (fds[c] >= 0) {
+                close(fds[c]);
+            }
+        }
+#endif
+    }
+    void start() {
+#ifdef __linux__
+        for (int c = 0; c < count; c++) {
+            if (fds[c] >= 0) {
+                ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+    /* Misses since start, -1 for counters that aren't available */
+    void stop(int64_t* misses) {
+        for (int c = 0; c < count; c++) {
+            misses[c] = -1;
+#ifdef __linux__
+            uint64_t value;
+            if (fds[c] >= 0 && ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0) == 0 && read(fds[c], &value, sizeof(value)) == sizeof(value)) {
+                misses[c] = int64_t(value);
+            }
+#endif
+        }
+    }
+
+private:
+    int fds[count] = {-1, -1};
+};
+
+/* Misses per unit of work, e.g. ray or frame */
+void printMisses(const int64_t* misses, double per, const char* unit) {
+    const char* names[CacheCounters::count] = {"L1D misses", "LLC misses"};
+    for (int c = 0; c < CacheCounters::count; c++) {
+        std::cout << ", ";
+        if (misses[c] < 0) {
+            std::cout << names[c] << " unavailable";
+        } else {
+            std::cout << double(misses[c]) / per << " " << names[c] << "/" << unit;
+        }
+    }
+}
+
+}
+
+/* Structure of arrays, one lane per ray. Inactive lanes are carried along but never looked at. */
+struct CPURenderer::Packet {
+    float origin[3][lanes] = {};
+    float direction[3][lanes] = {};
+    bool active[lanes] = {};
+};
+
+/* VoxelIntersection in shader.comp */
+struct CPURenderer::PacketHits {
+    /* In meters, negative if nothing was hit */
+    float dist[lanes];
+    float normal[3][lanes];
+    Material id[lanes];
+    int idx[3][lanes];
+    /* Only glass sets it, always to vec3(0.1), so one channel is enough */
+    float accumulatedColor[lanes];
+};
+
+/*
+distanceToVoxelAlongRay for every active lane. Crossing into the next cell
+and skipping empty space is done for the whole packet at once, lanes that
+have finished keep their state. What's in the cell a lane entered is
+looked up one lane at a time.
+*/
+int CPURenderer::tracePacket(const Packet& rays, float maxlen, PacketHits& hits) const {
+    if (settings.traversal == Traversal::PlaneSteps) {
+        return tracePacketPlaneSteps(rays, maxlen, hits);
+    }
+    const bool leap = settings.traversal == Traversal::Leaping;
+    const simd::Float zero = simd::set(0.0f);
+    const simd::Float one = simd::set(1.0f);
+    simd::Float start[3];
+    simd::Float direction[3];
+    simd::Float stepDirection[3];
+    simd::Float invDirection[3];
+    simd::Float tDelta[3];
+    simd::Float boundaryOffset[3];
+    /* Cells are kept as floats, they're whole numbers well inside float precision */
+    simd::Float cell[3];
+    simd::Float tMax[3];
+    for (int a = 0; a < 3; a++) {
+        start[a] = simd::load(rays.origin[a]) * simd::set(float(VOXELS_PER_METER));
+        direction[a] = simd::load(rays.direction[a]);
+        stepDirection[a] = simd::sign(direction[a]);
+        invDirection[a] = one / direction[a];
+        tDelta[a] = simd::abs(invDirection[a]);
+        boundaryOffset[a] = simd::select(direction[a] < zero, zero, one);
+        cell[a] = simd::floor(start[a]);
+        tMax[a] = simd::abs((cell[a] + boundaryOffset[a] - start[a]) * invDirection[a]);
+    }
+    simd::Float totalDist = zero;
+
+    /* 1.0 while the lane is still tracing, so it can be loaded as a mask */
+    float live[lanes];
+    int liveCount = 0;
+    for (size_t i = 0; i < lanes; i++) {
+        live[i] = rays.active[i] ? 1.0f : 0.0f;
+        liveCount += rays.active[i] ? 1 : 0;
+        hits.dist[i] = -1.0f;
+        hits.id[i] = 0;
+        hits.accumulatedColor[i] = 0.0f;
+        for (int a = 0; a < 3; a++) {
+            hits.normal[a][i] = 0.0f;
+            hits.idx[a][i] = -1;
+        }
+    }
+
+    float cells[3][lanes];
+    float axes[lanes];
+    float totals[lanes];
+    /* Where a lane jumps to, 0 if it doesn't, and which cells it may land in */
+    float skipTo[lanes];
+    float clampMin[3][lanes];
+    float clampMax[3][lanes];
+    auto unclamp = [&]() {
+        for (int a = 0; a < 3; a++) {
+            std::fill_n(clampMin[a], lanes, -std::numeric_limits<float>::infinity());
+            std::fill_n(clampMax[a], lanes, std::numeric_limits<float>::infinity());
+        }
+    };
+    unclamp();
+    int lookups = 0;
+    for (int step = 0; step < settings.maxSteps && liveCount > 0; step++) {
+        lookups += liveCount;
+        /* Cross whichever boundary is closest, x first on ties */
+        const simd::Mask alive = zero < simd::load(live);
+        const simd::Mask xFirst = tMax[0] <= tMax[1] && tMax[0] <= tMax[2];
+        const simd::Mask yFirst = tMax[1] <= tMax[2];
+        const simd::Mask crossing[3] = {alive && xFirst, alive && !xFirst && yFirst, alive && !xFirst && !yFirst};
+        for (int a = 0; a < 3; a++) {
+            totalDist = simd::select(crossing[a], tMax[a], totalDist);
+            cell[a] = simd::select(crossing[a], cell[a] + stepDirection[a], cell[a]);
+            tMax[a] = simd::select(crossing[a], tMax[a] + tDelta[a], tMax[a]);
+            simd::store(cells[a], cell[a]);
+        }
+        simd::store(axes, simd::select(xFirst, zero, simd::select(yFirst, one, simd::set(2.0f))));
+        simd::store(totals, totalDist);
+
+        bool leaping = false;
+        for (size_t i = 0; i < lanes; i++) {
+            skipTo[i] = 0.0f;
+            if (live[i] == 0.0f) {
+                continue;
+            }
+            const int axis = int(axes[i]);
+            const int voxel[3] = {int(cells[0][i]), int(cells[1][i]), int(cells[2][i])};
+
+            const int v = chunks.getWorldVoxel(voxel[0], voxel[1], voxel[2]);
+            bool finished = false;
+            if (v == OUTSIDE_WORLD) {
+                finished = true;
+            } else if (v >= 0) {
+                /* Nothing within v - 1 voxels, or in the largest empty occupancy cell, skip ahead */
+                float target = totals[i] + float(std::max(v - 1, 0));
+                int cellMin[3];
+                int cellSize;
+                if (leap && (v == 0 || v == 127) && largestEmptyCell(voxel, cellMin, cellSize)) {
+                    float exits[3];
+                    for (int a = 0; a < 3; a++) {
+                        const float boundary = float(cellMin[a]) + (rays.direction[a][i] < 0.0f ? 0.0f : float(cellSize));
+                        exits[a] = std::fabs((boundary - rays.origin[a][i] * float(VOXELS_PER_METER)) * (1.0f / rays.direction[a][i]));
+                    }
+                    const float exit = std::min(exits[0], std::min(exits[1], exits[2]));
+                    if (exit > target) {
+                        target = exit;
+                        leaping = true;
+                        for (int a = 0; a < 3; a++) {
+                            clampMin[a][i] = float(cellMin[a]);
+                            clampMax[a][i] = float(cellMin[a] + cellSize - 1);
+                        }
+                    }
+                }
+                if (target > totals[i]) {
+                    skipTo[i] = target;
+                }
+            } else {
+                if (v == -Glass) {
+                    hits.accumulatedColor[i] = 0.1f;
+                } else {
+                    hits.dist[i] = totals[i] / float(VOXELS_PER_METER);
+                    hits.normal[axis][i] = rays.direction[axis][i] > 0.0f ? -1.0f : 1.0f;
+                    hits.id[i] = Material(-v);
+                    for (int a = 0; a < 3; a++) {
+                        hits.idx[a][i] = voxel[a];
+                    }
+                    finished = true;
+                }
+            }
+            if (!finished && !(std::max(totals[i], skipTo[i]) < maxlen)) {
+                finished = true;
+            }
+            if (finished) {
+                live[i] = 0.0f;
+                liveCount--;
+            }
+        }
+
+        /* Start the walk again from wherever the skip lands */
+        const simd::Float target = simd::load(skipTo);
+        const simd::Mask skipping = zero < target;
+        totalDist = simd::select(skipping, target, totalDist);
+        for (int a = 0; a < 3; a++) {
+            const simd::Float landed = start[a] + totalDist * direction[a];
+            const simd::Float landedCell = simd::clamp(simd::floor(landed), simd::load(clampMin[a]), simd::load(clampMax[a]));
+            cell[a] = simd::select(skipping, landedCell, cell[a]);
+            tMax[a] = simd::select(skipping, totalDist + simd::abs((landedCell + boundaryOffset[a] - landed) * invDirection[a]), tMax[a]);
+        }
+        if (leaping) {
+            unclamp();
+        }
+    }
+    return lookups;
+}
+
+/*
+The walk tracePacket replaced: step to whichever plane is closest along the
+ray, then guess which voxel was entered from the position, nudged by eps.
+Kept to measure the DDA against.
+*/
+int CPURenderer::tracePacketPlaneSteps(const Packet& rays, float maxlen, PacketHits& hits) const {
+    const simd::Float zero = simd::set(0.0f);
+    const simd::Float bias = simd::set(next_plane_bias);
+    simd::Float position[3];
+    simd::Float direction[3];
+    simd::Float axisDirection[3];
+    for (int a = 0; a < 3; a++) {
+        position[a] = simd::load(rays.origin[a]) * simd::set(float(VOXELS_PER_METER));
+        direction[a] = simd::load(rays.direction[a]);
+        axisDirection[a] = simd::sign(direction[a]);
+    }
+    simd::Float totalDist = zero;
+
+    float live[lanes];
+    int liveCount = 0;
+    for (size_t i = 0; i < lanes; i++) {
+        live[i] = rays.active[i] ? 1.0f : 0.0f;
+        liveCount += rays.active[i] ? 1 : 0;
+        hits.dist[i] = -1.0f;
+        hits.id[i] = 0;
+        hits.accumulatedColor[i] = 0.0f;
+        for (int a = 0; a < 3; a++) {
+            hits.normal[a][i] = 0.0f;
+            hits.idx[a][i] = -1;
+        }
+    }
+
+    float positions[3][lanes];
+    float planeDistances[3][lanes];
+    float traveled[lanes];
+    float totals[lanes];
+    float skip[lanes];
+    int lookups = 0;
+    for (int step = 0; step < settings.maxSteps && liveCount > 0; step++) {
+        lookups += liveCount;
+        /* Travel just far enough to reach the next plane on any axis, ceil(p - bias) is -floor(bias - p) */
+        simd::Float nextPlaneDistances[3];
+        for (int a = 0; a < 3; a++) {
+            const simd::Float nextPlane = simd::select(axisDirection[a] < zero,
+                                                       -simd::floor(bias - position[a]),
+                                                       simd::floor(position[a] + bias));
+            nextPlaneDistances[a] = simd::abs((nextPlane - position[a]) / direction[a]);
+        }
+        simd::Float minPlaneDistance = simd::min(nextPlaneDistances[0], simd::min(nextPlaneDistances[1], nextPlaneDistances[2]));
+        minPlaneDistance = simd::select(zero < simd::load(live), minPlaneDistance, zero);
+        totalDist = totalDist + minPlaneDistance;
+        for (int a = 0; a < 3; a++) {
+            position[a] = position[a] + minPlaneDistance * direction[a];
+            simd::store(positions[a], position[a]);
+            simd::store(planeDistances[a], nextPlaneDistances[a]);
+        }
+        simd::store(traveled, minPlaneDistance);
+        simd::store(totals, totalDist);
+
+        for (size_t i = 0; i < lanes; i++) {
+            skip[i] = 0.0f;
+            if (live[i] == 0.0f) {
+                continue;
+            }
+            const int axis = planeDistances[0][i] == traveled[i] ? 0 : planeDistances[1][i] == traveled[i] ? 1 : 2;
+            int voxel[3];
+            for (int a = 0; a < 3; a++) {
+                voxel[a] = int(std::floor(positions[a][i]));
+            }
+            voxel[axis] = int(rays.direction[axis][i] < 0.0f ? std::floor(positions[axis][i] - eps) : std::round(positions[axis][i]));
+
+            const int v = chunks.getWorldVoxel(voxel[0], voxel[1], voxel[2]);
+            bool finished = false;
+            if (v == OUTSIDE_WORLD) {
+                finished = true;
+            } else if (v > 1) {
+                skip[i] = float(v - 1);
+            } else if (v < 0) {
+                if (v == -Glass) {
+                    hits.accumulatedColor[i] = 0.1f;
+                } else {
+                    hits.dist[i] = totals[i] / float(VOXELS_PER_METER);
+                    hits.normal[axis][i] = rays.direction[axis][i] > 0.0f ? -1.0f : 1.0f;
+                    hits.id[i] = Material(-v);
+                    for (int a = 0; a < 3; a++) {
+                        hits.idx[a][i] = voxel[a];
+                    }
+                    finished = true;
+                }
+            }
+            if (!finished && !(totals[i] + skip[i] < maxlen)) {
+                finished = true;
+            }
+            if (finished) {
+                live[i] = 0.0f;
+                liveCount--;
+            }
+        }
+
+        const simd::Float skipped = simd::load(skip);
+        totalDist = totalDist + skipped;
+        for (int a = 0; a < 3; a++) {
+            position[a] = position[a] + skipped * direction[a];
+        }
+    }
+    return lookups;
+}
+
+bool CPURenderer::largestEmptyCell(const int* voxel, int* cellMin, int& cellSize) const {
+    int level = 0;
+    while (level < OCCUPANCY_LEVELS && !chunks.isWorldCellOccupied(level, voxel[0], voxel[1], voxel[2])) {
+        level++;
+    }
+    if (level == 0) {
+        return false;
+    }
+    cellSize = occupancyCellSize(level - 1);
+    for (int a = 0; a < 3; a++) {
+        cellMin[a] = voxel[a] & ~(cellSize - 1);
+    }
+    return true;
+}
+
+void CPURenderer::indirectLighting(const bool* active, const glm::vec3* points, const glm::vec3* normals, float* lighting) const {
+    glm::vec3 point[lanes];
+    glm::vec3 normal[lanes];
+    glm::vec3 bounceDirection[lanes];
+    bool bouncing[lanes];
+    for (size_t i = 0; i < lanes; i++) {
+        point[i] = points[i];
+        normal[i] = normals[i];
+        bouncing[i] = active[i];
+        /* Still bouncing after maxBounces means no light */
+        lighting[i] = 0.0f;
+    }
+
+    for (int bounce = 0; bounce < settings.maxBounces; bounce++) {
+        Packet rays;
+        bool any = false;
+        for (size_t i = 0; i < lanes; i++) {
+            if (!bouncing[i]) {
+                continue;
+            }
+            const float diffuse = 1.0f;
+            const glm::vec3 dirMask(normal[i].x != 0.0f ? 0.0f : diffuse,
+                                    normal[i].y != 0.0f ? 0.0f : diffuse,
+                                    normal[i].z != 0.0f ? 0.0f : diffuse);
+            const glm::vec3& p = point[i];
+            const glm::vec3 randomOffset = glm::vec3(random(p.z + p.x, p.y - p.x) - 0.5f,
+                                                     random(p.x - p.z, p.z + p.y) - 0.5f,
+                                                     random(p.y + p.z, p.x - p.y) - 0.5f) * dirMask;
+            bounceDirection[i] = glm::normalize(normal[i] + randomOffset);
+            for (int a = 0; a < 3; a++) {
+                rays.origin[a][i] = p[a];
+                rays.direction[a][i] = bounceDirection[i][a];
+            }
+            rays.active[i] = true;
+            any = true;
+        }
+        if (!any) {
+            break;
+        }
+
+        PacketHits hits;
+        tracePacket(rays, max_indirect_dist, hits);
+        for (size_t i = 0; i < lanes; i++) {
+            if (!bouncing[i]) {
+                continue;
+            }
+            if (hits.dist[i] >= 0.0f) {
+                point[i] += hits.dist[i] * bounceDirection[i];
+                normal[i] = glm::vec3(hits.normal[0][i], hits.normal[1][i], hits.normal[2][i]);
+            } else {
+                lighting[i] = 1.0f / float(bounce + 2);
+                bouncing[i] = false;
+            }
+        }
+    }
+}
+
+/* main() in shader.comp for one tile, a packet is lanes pixels next to each other in a row */
+void CPURenderer::renderTile(const Camera& camera, uint32_t width, uint32_t height, int tileX, int tileY, uint8_t* pixels) const {
+    const float focalLength = 1.0f;
+    const float lensX = 1.0f;
+    const float lensY = (float(height) / float(width)) * lensX;
+    const float pixelSize = lensX / float(width);
+
+    for (int row = 0; row < tileSize; row++) {
+        const uint32_t py = uint32_t(tileY * tileSize + row);
+        if (py >= height) {
+            break;
+        }
+        for (int column = 0; column < tileSize; column += int(lanes)) {
+            glm::vec3 rayDirection[lanes];
+            glm::vec3 outputColor[lanes];
+            Packet primary;
+            for (size_t i = 0; i < lanes; i++) {
+                const uint32_t px = uint32_t(tileX * tileSize + column) + uint32_t(i);
+                primary.active[i] = px < width;
+                const glm::vec2 pixel = glm::vec2(float(px), float(py));
+                rayDirection[i] = camera.position + camera.forward * focalLength;
+                rayDirection[i] += camera.up * (lensY / 2.0f);
+                rayDirection[i] -= camera.right * (lensX / 2.0f);
+                rayDirection[i] += (pixel.x / float(width)) * camera.right * lensX;
+                rayDirection[i] -= (pixel.y / float(height)) * camera.up * lensY;
+                outputColor[i] = glm::vec3(0.0f);
+            }
+
+            for (int sample = 0; sample < settings.samples; sample++) {
+                glm::vec3 sampleDirection[lanes];
+                for (size_t i = 0; i < lanes; i++) {
+                    const float px = float(uint32_t(tileX * tileSize + column) + uint32_t(i));
+                    const glm::vec3 randomOffset = camera.right * random(px + float(sample), float(py)) -
+                                                   camera.up * random(px, float(py) + float(sample));
+                    sampleDirection[i] = glm::normalize(rayDirection[i] + randomOffset * pixelSize - camera.position);
+                    for (int a = 0; a < 3; a++) {
+                        primary.origin[a][i] = camera.position[a];
+                        primary.direction[a][i] = sampleDirection[i][a];
+                    }
+                }
+                PacketHits hits;
+                tracePacket(primary, max_dist, hits);
+
+                /* Everything that hit a voxel gets a shadow ray and indirect bounces */
+                Packet shadow;
+                bool lit[lanes];
+                glm::vec3 points[lanes];
+                glm::vec3 normals[lanes];
+                for (size_t i = 0; i < lanes; i++) {
+                    lit[i] = primary.active[i] && hits.dist[i] > 0.0f;
+                    points[i] = camera.position + sampleDirection[i] * hits.dist[i];
+                    normals[i] = glm::vec3(hits.normal[0][i], hits.normal[1][i], hits.normal[2][i]);
+                    const glm::vec3 shadowOrigin = points[i] + normals[i] * shadow_offset;
+                    for (int a = 0; a < 3; a++) {
+                        shadow.origin[a][i] = shadowOrigin[a];
+                        shadow.direction[a][i] = -camera.sunDirection[a];
+                    }
+                    shadow.active[i] = lit[i];
+                }
+                PacketHits shadowHits;
+                tracePacket(shadow, max_dist, shadowHits);
+                float indirect[lanes];
+                indirectLighting(lit, points, normals, indirect);
+
+                for (size_t i = 0; i < lanes; i++) {
+                    if (!primary.active[i]) {
+                        continue;
+                    }
+                    const glm::vec3 accumulatedColor(hits.accumulatedColor[i]);
+                    if (lit[i]) {
+                        const float direct = shadowHits.dist[i] >= 0.0f ? 0.0f : 0.3f;
+                        const int x = hits.idx[0][i];
+                        const int y = hits.idx[1][i];
+                        const int z = hits.idx[2][i];
+                        const float variance = random(float(x + z * x), float(y + z * y)) - 0.5f;
+                        outputColor[i] += (accumulatedColor + voxelColor(hits.id[i])) *
+                                          (1.0f + variance * voxelColorVariance(hits.id[i])) *
+                                          (direct * 0.5f + indirect[i] * 0.5f);
+                    } else {
+                        /* The skybox is black */
+                        outputColor[i] += accumulatedColor;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < lanes; i++) {
+                if (!primary.active[i]) {
+                    continue;
+                }
+                const uint32_t px = uint32_t(tileX * tileSize + column) + uint32_t(i);
+                const glm::vec3 color = outputColor[i] / float(settings.samples);
+                uint8_t* out = pixels + (size_t(py) * width + px) * 4;
+                out[0] = toUnorm8(color.x);
+                out[1] = toUnorm8(color.y);
+                out[2] = toUnorm8(color.z);
+                out[3] = 255;
+            }
+        }
+    }
+}
+
+void CPURenderer::render(const Camera& camera, uint32_t width, uint32_t height, uint8_t* pixels, ThreadPool* pool) const {
+    PROFILE_FUNCTION();
+    const int tilesX = int((width + tileSize - 1) / tileSize);
+    const int tilesY = int((height + tileSize - 1) / tileSize);
+    auto tile = [&](int t) {
+        renderTile(camera, width, height, t % tilesX, t / tilesX, pixels);
+    };
+    if (pool != nullptr) {
+        pool->parallelFor(tilesX * tilesY, tile);
+    } else {
+        for (int t = 0; t < tilesX * tilesY; t++) {
+            tile(t);
+        }
+    }
+}
+
+CPURenderer::Difference CPURenderer::compareImages(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height, int tolerance) {
+    Difference difference {0.0, 0, size_t(width) * height};
+    uint64_t totalError = 0;
+    for (size_t p = 0; p < difference.pixels; p++) {
+        int worst = 0;
+        for (int c = 0; c < 3; c++) {
+            const int error = std::abs(int(a[p * 4 + c]) - int(b[p * 4 + c]));
+            totalError += uint64_t(error);
+            worst = std::max(worst, error);
+        }
+        if (worst > tolerance) {
+            difference.pixelsOver++;
+        }
+    }
+    difference.meanError = difference.pixels > 0 ? double(totalError) / double(difference.pixels * 3) : 0.0;
+    return difference;
+}
+
+void CPURenderer::benchmarkTraversal(const LoadedChunks& chunks, const glm::vec3& origin, int numRays, uint32_t seed) {
+    using Clock = std::chrono::high_resolution_clock;
+    const Traversal traversals[] = {Traversal::PlaneSteps, Traversal::DDA, Traversal::Leaping};
+    const char* names[] = {"plane steps", "DDA", "DDA + leaps"};
+    constexpr int numTraversals = 3;
+
+    /* Start in the air around origin, so most rays end on the ground or a tree */
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> across(-float(CHUNK_WIDTH_METERS), float(CHUNK_WIDTH_METERS));
+    std::uniform_real_distribution<float> below(-2.0f, 0.0f);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::vector<Packet> packets((std::max(numRays, 1) + lanes - 1) / lanes);
+    for (Packet& packet : packets) {
+        for (size_t i = 0; i < lanes; i++) {
+            const glm::vec3 start = origin + glm::vec3(across(rng), across(rng), below(rng));
+            glm::vec3 direction;
+            do {
+                direction = glm::vec3(unit(rng), unit(rng), unit(rng));
+            } while (glm::length(direction) < 0.01f);
+            direction = glm::normalize(direction);
+            for (int a = 0; a < 3; a++) {
+                packet.origin[a][i] = start[a];
+                packet.direction[a][i] = direction[a];
+            }
+            packet.active[i] = true;
+        }
+    }
+    const double rays = double(packets.size() * lanes);
+
+    std::vector<PacketHits> hits[numTraversals];
+    for (int t = 0; t < numTraversals; t++) {
+        Settings settings;
+        settings.traversal = traversals[t];
+        const CPURenderer renderer(chunks, settings);
+        hits[t].resize(packets.size());
+        /* Once to warm the caches up, then the best of a few timed runs */
+        double lookups = 0.0;
+        for (size_t p = 0; p < packets.size(); p++) {
+            lookups += renderer.tracePacket(packets[p], max_dist, hits[t][p]);
+        }
+        double ms = std::numeric_limits<double>::infinity();
+        for (int run = 0; run < 3; run++) {
+            const auto start = Clock::now();
+            for (size_t p = 0; p < packets.size(); p++) {
+                renderer.tracePacket(packets[p], max_dist, hits[t][p]);
+            }
+            ms = std::min(ms, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+        std::cout << names[t] << ": " << ms << " ms, " << rays / ms / 1000.0 << " Mrays/s, " << lookups / rays
+                  << " voxels/ray, " << ms * 1e6 / lookups << " ns/voxel" << std::endl;
+    }
+
+    /* Against Leaping, the last one */
+    for (int t = 0; t < numTraversals - 1; t++) {
+        int differ = 0;
+        for (size_t p = 0; p < packets.size(); p++) {
+            const PacketHits& a = hits[t][p];
+            const PacketHits& b = hits[numTraversals - 1][p];
+            for (size_t i = 0; i < lanes; i++) {
+                const bool same = (a.dist[i] < 0.0f) == (b.dist[i] < 0.0f) &&
+                                  a.idx[0][i] == b.idx[0][i] && a.idx[1][i] == b.idx[1][i] && a.idx[2][i] == b.idx[2][i];
+                differ += same ? 0 : 1;
+            }
+        }
+        std::cout << names[t] << " hits a different voxel than " << names[numTraversals - 1] << " for "
+                  << differ << " / " << rays << " rays" << std::endl;
+    }
+}
+
+void CPURenderer::benchmarkDirections(const LoadedChunks& chunks, const glm::vec3& origin, int numRays, uint32_t seed,
+                                      uint32_t width, uint32_t height) {
+    using Clock = std::chrono::high_resolution_clock;
+    struct Sweep {
+        const char* name;
+        /* Zero for random directions */
+        glm::vec3 axis;
+    };
+    const Sweep sweeps[] = {{"+x", glm::vec3(1, 0, 0)}, {"-x", glm::vec3(-1, 0, 0)}, {"+y", glm::vec3(0, 1, 0)},
+                            {"-y", glm::vec3(0, -1, 0)}, {"down", glm::vec3(0, 0, -1)}, {"random", glm::vec3(0.0f)}};
+    std::cout << "Bricks in " << (MORTON_ORDER ? "Morton" : "[x][y][z]") << " order" << std::endl;
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> across(-float(CHUNK_WIDTH_METERS), float(CHUNK_WIDTH_METERS));
+    std::uniform_real_distribution<float> below(-2.0f, 0.0f);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    const CPURenderer renderer(chunks, Settings());
+    CacheCounters counters;
+    std::vector<Packet> packets((std::max(numRays, 1) + lanes - 1) / lanes);
+    std::vector<PacketHits> hits(packets.size());
+    std::vector<uint8_t> pixels(size_t(width) * height * 4);
+    for (const Sweep& sweep : sweeps) {
+        const bool random = sweep.axis == glm::vec3(0.0f);
+        /* Within about 15 degrees of the axis, so rays still cross a few voxels sideways */
+        for (Packet& packet : packets) {
+            for (size_t i = 0; i < lanes; i++) {
+                const glm::vec3 start = origin + glm::vec3(across(rng), across(rng), below(rng));
+                glm::vec3 direction;
+                do {
+                    const glm::vec3 jitter(unit(rng), unit(rng), unit(rng));
+                    direction = random ? jitter : sweep.axis + 0.25f * jitter;
+                } while (glm::length(direction) < 0.01f);
+                direction = glm::normalize(direction);
+                for (int a = 0; a < 3; a++) {
+                    packet.origin[a][i] = start[a];
+                    packet.direction[a][i] = direction[a];
+                }
+                packet.active[i] = true;
+            }
+        }
+        const double rays = double(packets.size() * lanes);
+
+        /* Once to warm the caches up, then the best of a few timed runs */
+        double lookups = 0.0;
+        for (size_t p = 0; p < packets.size(); p++) {
+            lookups += renderer.tracePacket(packets[p], max_dist, hits[p]);
+        }
+        double ms = std::numeric_limits<double>::infinity();
+        int64_t misses[CacheCounters::count];
+        for (int run = 0; run < 3; run++) {
+            const auto start = Clock::now();
+            counters.start();
+            for (size_t p = 0; p < packets.size(); p++) {
+                renderer.tracePacket(packets[p], max_dist, hits[p]);
+            }
+            int64_t runMisses[CacheCounters::count];
+            counters.stop(runMisses);
+            const double runMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            if (runMs < ms) {
+                ms = runMs;
+                std::copy(runMisses, runMisses + CacheCounters::count, misses);
+            }
+        }
+        std::cout << sweep.name << " rays: " << ms << " ms, " << lookups / rays << " voxels/ray, "
+                  << ms * 1e6 / lookups << " ns/voxel";
+        printMisses(misses, rays, "ray");
+        std::cout << std::endl;
+
+        if (random) {
+            continue;
+        }
+        Camera camera;
+        camera.position = origin;
+        camera.forward = sweep.axis;
+        camera.up = sweep.axis.z != 0.0f ? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1);
+        camera.right = glm::cross(camera.forward, camera.up);
+        /* A warm-up frame, then a timed one, frames take long enough that one is plenty */
+        renderer.render(camera, width, height, pixels.data());
+        const auto start = Clock::now();
+        counters.start();
+        renderer.render(camera, width, height, pixels.data());
+        counters.stop(misses);
+        ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        std::cout << sweep.name << " frame: " << ms << " ms";
+        printMisses(misses, double(width) * height, "pixel");
+        std::cout << std::endl;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef CPURENDERER_H
+#define CPURENDERER_H
+#include <cstdint>
+#include <cstddef>
+#include "camera.h"
+#include "worldgenerator.h"
+#include "threadpool.h"
+
+/*
+shader.comp ported to the CPU, rendering straight from LoadedChunks, for
+machines without a GPU and to check the shader against.
+
+Rays are traced through the same traversal as distanceToVoxelAlongRay in
+packets of simd::width (8 with AVX2, 4 with SSE2 or NEON), stepping every
+ray in the packet at once and only looking voxels up one ray at a time.
+Shading follows the shader line by line. The image is split into tiles
+that are spread over a thread pool.
+
+GPUs round division, normalize and sin differently, and random() feeds sin
+large arguments, so a pixel's indirect lighting can come out differently
+even when the traversal agrees. Compare images with a tolerance, see
+compareImages.
+*/
+class CPURenderer
+{
+public:
+    /* How rays walk through the voxels. Anything but Leaping is only there for benchmarkTraversal to compare against. */
+    enum class Traversal {
+        /* Float steps from plane to plane with the voxel worked out from epsilons, how shader.comp walked before its DDA */
+        PlaneSteps,
+        /* Integer DDA, skipping ahead by distances */
+        DDA,
+        /* DDA that also leaps over empty occupancy cells, what shader.comp does */
+        Leaping
+    };
+
+    /* Same meaning as the specialization constants of the same names in shader.comp */
+    struct Settings {
+        int samples = 1;
+        int maxSteps = 10000;
+        int maxBounces = 10;
+        Traversal traversal = Traversal::Leaping;
+    };
+
+    CPURenderer(const LoadedChunks& chunks, const Settings& settings) : chunks(chunks), settings(settings) {}
+
+    /* Writes tightly packed RGBA8 pixels, like the GPU's render image. chunks mustn't change until it returns. */
+    void render(const Camera& camera, uint32_t width, uint32_t height, uint8_t* pixels, ThreadPool* pool = nullptr) const;
+
+    struct Difference {
+        /* Mean absolute difference over all RGB channels, in 0-255 */
+        double meanError;
+        /* Pixels with a channel more than tolerance apart */
+        size_t pixelsOver;
+        size_t pixels;
+    };
+    static Difference compareImages(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height, int tolerance);
+
+    /* Trace numRays random rays starting in the air around origin (in meters) with every
+       Traversal on the calling thread, timing them and counting the voxels looked up per
+       ray, and how many rays hit a different voxel than with Leaping. A few always do
+       where a ray grazes an edge and rounding decides which voxel comes first. Results
+       are on stdout. */
+    static void benchmarkTraversal(const LoadedChunks& chunks, const glm::vec3& origin, int numRays, uint32_t seed);
+    /* Trace numRays rays from around origin along +x, -x, +y, -y, down and in random
+       directions with the shader's traversal, then render a width x height frame looking
+       each way but random, all on the calling thread. Prints the time, voxels looked up
+       and, where perf_event_open allows it, L1 data and last level cache misses for each,
+       to compare brick orders (MORTON_ORDER) across ray directions. */
+    static void benchmarkDirections(const LoadedChunks& chunks, const glm::vec3& origin, int numRays, uint32_t seed,
+                                    uint32_t width, uint32_t height);
+
+    /* Pixels per side of a tile, a tile row is a whole number of packets */
+    static constexpr int tileSize = 16;
+
+private:
+    struct Packet;
+    struct PacketHits;
+    /* Both return how many voxels they looked up, over all lanes */
+    int tracePacket(const Packet& rays, float maxlen, PacketHits& hits) const;
+    /* Traversal::PlaneSteps */
+    int tracePacketPlaneSteps(const Packet& rays, float maxlen, PacketHits& hits) const;
+    /* largestEmptyCell in shader.comp, voxel and cellMin are xyz */
+    bool largestEmptyCell(const int* voxel, int* cellMin, int& cellSize) const;
+    /* indirectLightingAtPoint for a packet's worth of points, arrays are simd::width long */
+    void indirectLighting(const bool* active, const glm::vec3* points, const glm::vec3* normals, float* lighting) const;
+    void renderTile(const Camera& camera, uint32_t width, uint32_t height, int tileX, int tileY, uint8_t* pixels) const;
+
+    const LoadedChunks& chunks;
+    const Settings settings;
+};
+
+#endif // CPURENDERER_H
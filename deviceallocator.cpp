@@ -0,0 +1,223 @@
+#include "deviceallocator.h"
+#include <algorithm>
+#include <stdexcept>
+
+/* orders[k] holds the offsets of free ranges of minAllocation << k bytes */
+struct DeviceBlock {
+    VkDeviceMemory memory;
+    uint8_t* mapped;
+    size_t pool;
+    size_t liveAllocations;
+    std::vector<std::set<VkDeviceSize>> orders;
+};
+
+static int orderFor(VkDeviceSize size) {
+    int order = 0;
+    while ((DeviceAllocator::minAllocation << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+static const int blockOrder = orderFor(DeviceAllocator::blockSize);
+
+DeviceAllocator::DeviceAllocator() {}
+
+DeviceAllocator::~DeviceAllocator() {
+    destroy();
+}
+
+void DeviceAllocator::init(VkPhysicalDevice physicalDevice, VkDevice _device) {
+    device = _device;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+}
+
+void DeviceAllocator::destroy() {
+    for (Pool& pool : pools) {
+        for (std::unique_ptr<DeviceBlock>& block : pool.blocks) {
+            freeMemory(block->memory, block->mapped != nullptr);
+        }
+    }
+    pools.clear();
+}
+
+uint32_t DeviceAllocator::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+        if ((typeFilter & (1 << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return i;
+        }
+    }
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+bool DeviceAllocator::isHostVisible(uint32_t memoryType) const {
+    return (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+}
+
+VkDeviceMemory DeviceAllocator::allocateMemory(VkDeviceSize size, uint32_t memoryType, void** mapped) {
+    VkMemoryAllocateInfo allocInfo {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate device memory!");
+    }
+
+    *mapped = nullptr;
+    if (isHostVisible(memoryType)) {
+        if (vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, mapped) != VK_SUCCESS) {
+            throw std::runtime_error("failed to map device memory!");
+        }
+    }
+    return memory;
+}
+
+void DeviceAllocator::freeMemory(VkDeviceMemory memory, bool mapped) {
+    if (mapped) {
+        vkUnmapMemory(device, memory);
+    }
+    vkFreeMemory(device, memory, nullptr);
+}
+
+DeviceAllocator::Pool& DeviceAllocator::poolFor(uint32_t memoryType, bool image) {
+    for (Pool& pool : pools) {
+        if (pool.memoryType == memoryType && pool.image == image) {
+            return pool;
+        }
+    }
+    pools.push_back({memoryType, image, {}});
+    return pools.back();
+}
+
+DeviceAllocation DeviceAllocator::allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, bool image) {
+    DeviceAllocation allocation;
+    allocation.memoryType = memoryType;
+    allocation.requestedSize = requirements.size;
+
+    const int order = orderFor(std::max(requirements.size, requirements.alignment));
+    if (order >= blockOrder) {
+        /* Too big to share a block, rounding it up would waste too much */
+        void* mapped;
+        allocation.memory = allocateMemory(requirements.size, memoryType, &mapped);
+        allocation.mapped = mapped;
+        allocation.size = requirements.size;
+        dedicatedCount++;
+        dedicatedBytes += allocation.size;
+    } else {
+        /* Smallest free range of at least this order, in any block of the pool */
+        size_t poolIndex = &poolFor(memoryType, image) - pools.data();
+        Pool& pool = pools[poolIndex];
+        DeviceBlock* block = nullptr;
+        int found = blockOrder + 1;
+        for (std::unique_ptr<DeviceBlock>& candidate : pool.blocks) {
+            for (int k = order; k < found; k++) {
+                if (!candidate->orders[k].empty()) {
+                    block = candidate.get();
+                    found = k;
+                    break;
+                }
+            }
+        }
+        if (block == nullptr) {
+            std::unique_ptr<DeviceBlock> newBlock(new DeviceBlock);
+            void* mapped;
+            newBlock->memory = allocateMemory(blockSize, memoryType, &mapped);
+            newBlock->mapped = static_cast<uint8_t*>(mapped);
+            newBlock->pool = poolIndex;
+            newBlock->liveAllocations = 0;
+            newBlock->orders.resize(blockOrder + 1);
+            newBlock->orders[blockOrder].insert(0);
+            block = newBlock.get();
+            found = blockOrder;
+            pool.blocks.push_back(std::move(newBlock));
+        }
+
+        /* Split down to the size needed, keeping the first half each time */
+        VkDeviceSize offset = *block->orders[found].begin();
+        block->orders[found].erase(block->orders[found].begin());
+        while (found > order) {
+            found--;
+            block->orders[found].insert(offset + (minAllocation << found));
+        }
+
+        block->liveAllocations++;
+        allocation.memory = block->memory;
+        allocation.offset = offset;
+        allocation.size = minAllocation << order;
+        allocation.mapped = block->mapped != nullptr ? block->mapped + offset : nullptr;
+        allocation.block = block;
+    }
+
+    allocationCount++;
+    bytesRequested += allocation.requestedSize;
+    bytesAllocated += allocation.size;
+    return allocation;
+}
+
+void DeviceAllocator::free(DeviceAllocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+        return;
+    }
+    allocationCount--;
+    bytesRequested -= allocation.requestedSize;
+    bytesAllocated -= allocation.size;
+
+    DeviceBlock* block = allocation.block;
+    if (block == nullptr) {
+        freeMemory(allocation.memory, allocation.mapped != nullptr);
+        dedicatedCount--;
+        dedicatedBytes -= allocation.size;
+    } else {
+        /* Merge with the buddy for as long as it's free too */
+        VkDeviceSize offset = allocation.offset;
+        int order = orderFor(allocation.size);
+        while (order < blockOrder) {
+            VkDeviceSize buddy = offset ^ (minAllocation << order);
+            auto it = block->orders[order].find(buddy);
+            if (it == block->orders[order].end()) {
+                break;
+            }
+            block->orders[order].erase(it);
+            offset = std::min(offset, buddy);
+            order++;
+        }
+        block->orders[order].insert(offset);
+        block->liveAllocations--;
+
+        /* Give empty blocks back, but keep one per pool around to avoid thrashing */
+        Pool& pool = pools[block->pool];
+        if (block->liveAllocations == 0 && pool.blocks.size() > 1) {
+            auto it = std::find_if(pool.blocks.begin(), pool.blocks.end(),
+                                   [block](const std::unique_ptr<DeviceBlock>& b) { return b.get() == block; });
+            freeMemory(block->memory, block->mapped != nullptr);
+            pool.blocks.erase(it);
+        }
+    }
+    allocation = DeviceAllocation();
+}
+
+DeviceAllocator::Stats DeviceAllocator::stats() const {
+    Stats s {};
+    s.allocations = allocationCount;
+    s.dedicatedAllocations = dedicatedCount;
+    s.memoryObjects = dedicatedCount;
+    s.bytesRequested = bytesRequested;
+    s.bytesAllocated = bytesAllocated;
+    s.bytesReserved = dedicatedBytes;
+    for (const Pool& pool : pools) {
+        for (const std::unique_ptr<DeviceBlock>& block : pool.blocks) {
+            s.memoryObjects++;
+            s.bytesReserved += blockSize;
+            for (int k = 0; k <= blockOrder; k++) {
+                s.bytesFree += VkDeviceSize(block->orders[k].size()) * (minAllocation << k);
+                s.freeRanges += block->orders[k].size();
+                if (!block->orders[k].empty()) {
+                    s.largestFreeRange = std::max(s.largestFreeRange, minAllocation << k);
+                }
+            }
+        }
+    }
+    return s;
+}
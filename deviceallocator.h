@@ -0,0 +1,104 @@
+#ifndef DEVICEALLOCATOR_H
+#define DEVICEALLOCATOR_H
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <set>
+#include <memory>
+#include <cstdint>
+
+struct DeviceBlock;
+
+/* A range of device memory handed out by DeviceAllocator */
+struct DeviceAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    /* What was actually reserved, a power of two for sub-allocations */
+    VkDeviceSize size = 0;
+    VkDeviceSize requestedSize = 0;
+    /* Points at offset in a persistent mapping for host visible memory, nullptr otherwise */
+    void* mapped = nullptr;
+    uint32_t memoryType = 0;
+    /* nullptr for dedicated allocations */
+    DeviceBlock* block = nullptr;
+};
+
+/*
+Sub-allocates buffers and images out of a few large vkAllocateMemory
+blocks, so the number of allocations stays far below
+maxMemoryAllocationCount however many resources come and go.
+
+Each memory type gets its own pool of blocks, split again between buffers
+and optimal tiling images so the two never share a bufferImageGranularity
+page. Blocks are buddy allocators: every allocation is rounded up to a
+power of two, which keeps offsets aligned to anything up to that size and
+makes freeing a matter of merging buddies. Anything bigger than half a
+block gets a dedicated allocation instead. Host visible blocks are mapped
+once when they're created, since a VkDeviceMemory can't be mapped twice.
+
+Not thread safe, everything goes through the main thread.
+*/
+class DeviceAllocator
+{
+public:
+    DeviceAllocator();
+    ~DeviceAllocator();
+
+    DeviceAllocator(const DeviceAllocator&) = delete;
+    DeviceAllocator& operator=(const DeviceAllocator&) = delete;
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice device);
+    /* Frees every block. Anything still allocated from them is gone too. */
+    void destroy();
+
+    /* First memory type allowed by typeFilter that has all of properties */
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const;
+
+    /* memoryType as returned by findMemoryType, image for optimal tiling images */
+    DeviceAllocation allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, bool image);
+    /* Resets allocation, does nothing if it's already empty */
+    void free(DeviceAllocation& allocation);
+
+    struct Stats {
+        /* Live allocations, including dedicated ones */
+        size_t allocations;
+        size_t dedicatedAllocations;
+        /* VkDeviceMemory objects currently held, blocks and dedicated */
+        size_t memoryObjects;
+        /* Sizes the resources asked for, and what was reserved after rounding up */
+        VkDeviceSize bytesRequested;
+        VkDeviceSize bytesAllocated;
+        /* Total size of all the memory objects */
+        VkDeviceSize bytesReserved;
+        /* Free space in blocks, how many pieces it's in and the biggest one */
+        VkDeviceSize bytesFree;
+        size_t freeRanges;
+        VkDeviceSize largestFreeRange;
+    };
+    Stats stats() const;
+
+    static constexpr VkDeviceSize blockSize = VkDeviceSize(64) << 20;
+    static constexpr VkDeviceSize minAllocation = 256;
+
+private:
+    struct Pool {
+        uint32_t memoryType;
+        bool image;
+        std::vector<std::unique_ptr<DeviceBlock>> blocks;
+    };
+
+    VkDeviceMemory allocateMemory(VkDeviceSize size, uint32_t memoryType, void** mapped);
+    void freeMemory(VkDeviceMemory memory, bool mapped);
+    Pool& poolFor(uint32_t memoryType, bool image);
+    bool isHostVisible(uint32_t memoryType) const;
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties {};
+    std::vector<Pool> pools;
+    size_t allocationCount = 0;
+    size_t dedicatedCount = 0;
+    VkDeviceSize dedicatedBytes = 0;
+    VkDeviceSize bytesRequested = 0;
+    VkDeviceSize bytesAllocated = 0;
+};
+
+#endif // DEVICEALLOCATOR_H
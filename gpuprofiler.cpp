@@ -0,0 +1,132 @@
+#include "gpuprofiler.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+void GPUProfiler::init(VkPhysicalDevice physicalDevice, VkDevice _device, uint32_t queueFamily, uint32_t _frames) {
+    device = _device;
+    frames = _frames;
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    const uint32_t validBits = queueFamilies[queueFamily].timestampValidBits;
+    if (validBits == 0) {
+        return;
+    }
+    timestampMask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    timestampPeriod = double(properties.limits.timestampPeriod);
+
+    VkQueryPoolCreateInfo poolInfo {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = frames * StageCount * 2;
+
+    if (vkCreateQueryPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timestamp query pool!");
+    }
+    pending.assign(frames * StageCount, 0);
+}
+
+void GPUProfiler::destroy() {
+    if (pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(device, pool, nullptr);
+        pool = VK_NULL_HANDLE;
+    }
+}
+
+void GPUProfiler::begin(VkCommandBuffer commandBuffer, uint32_t frame, Stage stage) {
+    if (pool == VK_NULL_HANDLE) {
+        return;
+    }
+    vkCmdResetQueryPool(commandBuffer, pool, queryIndex(frame, stage), 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, queryIndex(frame, stage));
+}
+
+void GPUProfiler::end(VkCommandBuffer commandBuffer, uint32_t frame, Stage stage) {
+    if (pool == VK_NULL_HANDLE) {
+        return;
+    }
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, queryIndex(frame, stage) + 1);
+    pending[frame * StageCount + stage] = 1;
+}
+
+void GPUProfiler::collect(uint32_t frame, uint64_t frameNumber) {
+    if (pool == VK_NULL_HANDLE) {
+        return;
+    }
+    for (int s = 0; s < StageCount; s++) {
+        const Stage stage = Stage(s);
+        if (!pending[frame * StageCount + stage]) {
+            continue;
+        }
+        /* Value and availability for each of the two queries */
+        uint64_t results[4];
+        VkResult result = vkGetQueryPoolResults(device, pool, queryIndex(frame, stage), 2, sizeof(results), results,
+                                                2 * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (result != VK_SUCCESS || results[1] == 0 || results[3] == 0) {
+            /* Not finished, try again next time */
+            continue;
+        }
+        pending[frame * StageCount + stage] = 0;
+
+        const uint64_t ticks = (results[2] - results[0]) & timestampMask;
+        const float ms = float(double(ticks) * timestampPeriod / 1e6);
+        latestMs[stage] = ms;
+
+        std::vector<float>& window = windows[stage];
+        if (window.size() < windowSize) {
+            window.push_back(ms);
+        } else {
+            window[windowNext[stage]] = ms;
+        }
+        windowNext[stage] = (windowNext[stage] + 1) % windowSize;
+
+        if (trace.size() < maxTraceSamples) {
+            trace.push_back({frameNumber, ms, stage});
+        }
+    }
+}
+
+double GPUProfiler::latest(Stage stage) const {
+    return windows[stage].empty() ? -1.0 : latestMs[stage];
+}
+
+double GPUProfiler::percentile(Stage stage, double p) const {
+    if (windows[stage].empty()) {
+        return -1.0;
+    }
+    /* Nearest rank */
+    std::vector<float> sorted = windows[stage];
+    size_t rank = size_t(p / 100.0 * double(sorted.size()));
+    rank = std::min(rank, sorted.size() - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
+
+void GPUProfiler::writeCSV(const std::string& filename) const {
+    std::ofstream file(filename);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open " + filename + " for writing!");
+    }
+
+    file << "frame,stage,ms\n";
+    for (const Sample& sample : trace) {
+        file << sample.frame << "," << stageName(sample.stage) << "," << sample.ms << "\n";
+    }
+}
+
+const char* GPUProfiler::stageName(Stage stage) {
+    switch (stage) {
+        case Raytrace: return "raytrace";
+        case Blit: return "blit";
+        case Distances: return "distances";
+        default: return "unknown";
+    }
+}
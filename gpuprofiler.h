@@ -0,0 +1,81 @@
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/*
+Timestamp queries around each stage of GPU work. Every frame in flight has
+its own queries, which are read back after that frame's fence has signaled
+the next time its slot comes around, so collecting never stalls the GPU.
+Keeps a rolling window of samples per stage for percentiles and every
+sample (up to maxTraceSamples) for a CSV trace.
+
+If the queue family can't write timestamps everything is a no-op and
+enabled() is false.
+*/
+class GPUProfiler
+{
+public:
+    enum Stage {
+        /* shader.comp */
+        Raytrace,
+        /* Graphics pass drawing the render image and overlays to the swapchain */
+        Blit,
+        /* shader_distances.comp */
+        Distances,
+        StageCount
+    };
+
+    GPUProfiler() {}
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily, uint32_t frames);
+    void destroy();
+    bool enabled() const { return pool != VK_NULL_HANDLE; }
+
+    /* Around the stage's commands in commandBuffer, outside of any render pass */
+    void begin(VkCommandBuffer commandBuffer, uint32_t frame, Stage stage);
+    void end(VkCommandBuffer commandBuffer, uint32_t frame, Stage stage);
+    /* Reads back whichever of frame's stages have finished, tagging them with frameNumber */
+    void collect(uint32_t frame, uint64_t frameNumber);
+
+    /* Most recent time in ms, negative if there are no samples yet */
+    double latest(Stage stage) const;
+    /* p-th percentile (0-100) in ms over the last windowSize samples, negative if there are none */
+    double percentile(Stage stage, double p) const;
+    size_t sampleCount(Stage stage) const { return windows[stage].size(); }
+
+    /* One line per sample: frame,stage,ms */
+    void writeCSV(const std::string& filename) const;
+
+    static const char* stageName(Stage stage);
+
+    static constexpr size_t windowSize = 512;
+    static constexpr size_t maxTraceSamples = 1 << 20;
+
+private:
+    uint32_t queryIndex(uint32_t frame, Stage stage) const { return (frame * StageCount + stage) * 2; }
+
+    struct Sample {
+        uint64_t frame;
+        float ms;
+        Stage stage;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueryPool pool = VK_NULL_HANDLE;
+    uint32_t frames = 0;
+    /* Nanoseconds per tick, and the mask for the bits the queue actually writes */
+    double timestampPeriod = 1.0;
+    uint64_t timestampMask = 0;
+    /* Written and not read back yet, frames * StageCount */
+    std::vector<uint8_t> pending;
+    /* Ring buffer of the last windowSize samples per stage */
+    std::vector<float> windows[StageCount];
+    size_t windowNext[StageCount] = {};
+    double latestMs[StageCount] = {};
+    std::vector<Sample> trace;
+};
+
+#endif // GPUPROFILER_H
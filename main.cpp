@@ -7,6 +7,8 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
+#include <climits>
 #include <optional>
 #include <set>
 #include <limits>
@@ -14,27 +16,57 @@
 #include <fstream>
 #include <chrono>
 #include <array>
+#include <random>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include "ansi.h"
 
 #include <vulkan/vk_enum_string_helper.h>
 
 #include "worldgenerator.h"
 #include "fontrenderer.h"
+#include "threadpool.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
+#include "deviceallocator.h"
+#include "uploadmanager.h"
+#include "camera.h"
+#include "cpurenderer.h"
 
 static bool platformIsLittleEndian() {
     unsigned int t = 1;
     return (reinterpret_cast<char*>(&t))[0] == 1;
 }
 
-struct Camera {
-    alignas(16) glm::vec3 position = glm::vec3(0, 0, 10.0);
-    alignas(16) glm::vec3 forward = glm::vec3(0, 1, 0);
-    alignas(16) glm::vec3 up = glm::vec3(0, 0, 1);
-    alignas(16) glm::vec3 right = glm::vec3(1, 0, 0);
-    alignas(4) float cur_time = 0.0f;
-    alignas(16) glm::vec3 sunDirection = glm::vec3(-1, -1, -1);
+/*
+Specialization constants for the compute shaders, constant_id is the index
+of the member. The world dimensions always come from worldgenerator.h, so
+the shaders can't disagree with the buffer LoadedChunks fills. The rest
+are tuning knobs that can be set from the command line.
+*/
+struct ShaderConstants {
+    int32_t chunkWidthMeters = CHUNK_WIDTH_METERS;
+    int32_t chunkHeightMeters = CHUNK_HEIGHT_METERS;
+    int32_t voxelsPerMeter = VOXELS_PER_METER;
+    int32_t drawDistance = DRAW_DISTANCE;
+    int32_t brickSize = BRICK_SIZE;
+    int32_t samples = 1;
+    int32_t maxSteps = 10000;
+    int32_t maxBounces = 10;
+    int32_t stitchBand = STITCH_BAND;
+    /* A VkBool32, the shaders declare it bool */
+    int32_t mortonOrder = MORTON_ORDER;
 };
 
+/* The shaders compute offsets into the voxel buffer assuming ChunkMap is nothing but int32s */
+static_assert(sizeof(ChunkMap) == sizeof(int32_t) * (2 + LOADED_CHUNKS_AXIS * LOADED_CHUNKS_AXIS), "ChunkMap has padding");
+static_assert(BRICK_POOL_OFFSET == BRICK_TABLE_OFFSET + sizeof(uint32_t) * TOTAL_CHUNKS_LOADED * BRICKS_PER_CHUNK, "Unexpected voxel buffer layout");
+/* shader.comp has its own copy of the occupancy pyramid's shape */
+static_assert(OCCUPANCY_LEVELS == 4 && occupancyCellSize(0) == 4, "Unexpected occupancy pyramid");
+static_assert(BRICK_OCCUPANCY_OFFSET == OCCUPANCY_OFFSET + OCCUPANCY_SIZE_BYTES && BRICK_VOXELS % 32 == 0,
+              "Unexpected brick occupancy layout");
+
 static VkVertexInputBindingDescription getVertexBindingDescription() {
     VkVertexInputBindingDescription bindingDescription {};
     bindingDescription.binding = 0;
@@ -82,10 +114,27 @@ struct UniformBufferObject {
     alignas(16) glm::mat4 proj;
 };
 
+/* One pass of shader_distances.comp over the chunk at chunk */
 struct DistancesPushConstants {
-    alignas(16) glm::ivec3 curVoxelOffset;
+    glm::ivec2 chunk;
+    /* Bit (dx + 1) * 3 + (dy + 1) is set if chunk + (dx, dy) is loaded */
+    int32_t loadedMask;
+    int32_t pass;
+};
+
+/* In the order they have to run, the same numbers as in the shader */
+enum DistancesPass {
+    DistancesColumns = 0,
+    DistancesRowsY = 1,
+    DistancesRowsX = 2,
+    DistancesResetBricks = 3,
+    DistancesWrite = 4
 };
 
+/* Chunk plus STITCH_BAND voxels of every neighbour, one byte per voxel */
+constexpr int DISTANCE_WINDOW_WIDTH = CHUNK_WIDTH_VOXELS + 2 * STITCH_BAND;
+constexpr VkDeviceSize DISTANCE_WINDOW_SIZE_BYTES = VkDeviceSize(DISTANCE_WINDOW_WIDTH) * DISTANCE_WINDOW_WIDTH * CHUNK_HEIGHT_VOXELS;
+
 const int MAX_FRAMES_IN_FLIGHT = 2;
 uint32_t currentFrame = 0;
 uint64_t frameCounter = 0;
@@ -99,6 +148,12 @@ const std::vector<const char*> deviceExtensions = {
     VK_KHR_8BIT_STORAGE_EXTENSION_NAME,
     VK_KHR_SHADER_FLOAT16_INT8_EXTENSION_NAME
 };
+
+/* Headless mode has nothing to present to */
+const std::vector<const char*> headlessDeviceExtensions = {
+    VK_KHR_8BIT_STORAGE_EXTENSION_NAME,
+    VK_KHR_SHADER_FLOAT16_INT8_EXTENSION_NAME
+};
 #define NDEBUG
 #ifdef NDEBUG
     const bool enableValidationLayers = false;
@@ -121,6 +176,27 @@ static std::vector<char> readFile(const std::string& filename) {
     return buffer;
 }
 
+/* Binary PPM of tightly packed RGBA8 pixels, alpha is dropped */
+static void writePPM(const std::string& filename, const uint8_t* pixels, uint32_t width, uint32_t height) {
+    std::ofstream file(filename, std::ios::binary);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open " + filename + " for writing!");
+    }
+
+    file << "P6\n" << width << " " << height << "\n255\n";
+    std::vector<char> row(size_t(width) * 3);
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* src = pixels + size_t(y) * width * 4;
+        for (uint32_t x = 0; x < width; x++) {
+            row[x * 3 + 0] = char(src[x * 4 + 0]);
+            row[x * 3 + 1] = char(src[x * 4 + 1]);
+            row[x * 3 + 2] = char(src[x * 4 + 2]);
+        }
+        file.write(row.data(), row.size());
+    }
+}
+
 VkResult CreateDebugUtilsMessengerEXT(VkInstance instance,
                                       const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo,
                                       const VkAllocationCallbacks* pAllocator,
@@ -146,12 +222,68 @@ public:
     void run() {
         littleEndian = platformIsLittleEndian();
         console.setGameInstance(this);
-        initWindow();
-        initVulkan();
-        mainLoop();
+        PROFILE_THREAD_NAME("main");
+        if (cpuRenderFrames > 0) {
+            /* Never touches Vulkan, so there's nothing for cleanup to destroy */
+            cpuRenderLoop();
+            return;
+        }
+        if (rayBenchRays > 0) {
+            rayBench();
+            return;
+        }
+        if (headless) {
+            initVulkan();
+            headlessLoop();
+        } else {
+            initWindow();
+            initVulkan();
+            mainLoop();
+        }
         cleanup();
     }
 
+    /*
+    Render frames compute passes offscreen instead of opening a window, for
+    benchmarking on machines without a display. If outputPrefix isn't empty
+    every frame is also written to <outputPrefix>_<frame>.ppm.
+    */
+    void setHeadless(int frames, const std::string& outputPrefix) {
+        headless = true;
+        headlessFrames = frames;
+        headlessOutputPrefix = outputPrefix;
+    }
+
+    /* Samples per pixel and indirect bounces, baked into the compute pipeline when it's created */
+    void setRenderQuality(int samples, int maxBounces) {
+        shaderConstants.samples = samples;
+        shaderConstants.maxBounces = maxBounces;
+    }
+
+    /*
+    Render frames with CPURenderer instead, without creating a Vulkan instance
+    at all. outputPrefix works like setHeadless'.
+    */
+    void setCpuRender(int frames, const std::string& outputPrefix) {
+        cpuRenderFrames = frames;
+        headlessOutputPrefix = outputPrefix;
+    }
+
+    /* Run CPURenderer::benchmarkTraversal with rays rays on the startup chunks instead, also without Vulkan */
+    void setRayBench(int rays) {
+        rayBenchRays = rays;
+    }
+
+    /* In headless mode, also render every frame with CPURenderer and compare it with the GPU's */
+    void setCompareWithCpu(bool enabled) {
+        compareWithCpu = enabled;
+    }
+
+    /* Compute distances across chunk borders in shader_distances.comp instead of LoadedChunks::stitchChunk */
+    void setGpuDistances(bool enabled) {
+        gpuDistances = enabled;
+    }
+
 private:
     /** Console class **/
     static constexpr int MAX_LINE = 256;
@@ -194,8 +326,14 @@ private:
                                                         "%s: print a message.\n"
                                                         "%s: quit the game.\n"
                                                         "%s: get current position\n"
-                                                        "%s: set position",
-                                                        "help", "echo <message>", "exit/quit", "getpos", "setpos x,y,z");
+                                                        "%s: set position\n"
+                                                        "%s: check distance field against brute force\n"
+                                                        "%s: time SDF evaluation, results on stdout\n"
+                                                        "%s: write CPU profiler zones as a Chrome trace\n"
+                                                        "%s: device memory allocations and fragmentation\n"
+                                                        "%s: check GPU distance pass against the CPU",
+                                                        "help", "echo <message>", "exit/quit", "getpos", "setpos x,y,z", "checkdist [n]", "sdfbench [n]",
+                                                        "cputrace [file]", "meminfo", "gpudist");
                     strcpy(output, scratch);
                 } else if (strncmp(commandBuf + 1, "echo ", 5) == 0) {
                     strcpy(output, commandBuf + 6);
@@ -212,6 +350,47 @@ private:
                     } else {
                         strcpy(output, "Invalid position.");
                     }
+                } else if (strncmp(commandBuf + 1, "checkdist", 9) == 0) {
+                    int numFragments = 20;
+                    sscanf(commandBuf + 10, "%d", &numFragments);
+                    WorldGenerator::DistanceValidation check = WorldGenerator::validateDistances(numFragments, WorldGenerator::getSeed(),
+                                                                                                 &instance->generatorPool);
+                    snprintf(scratch, sizeof(scratch), "%d / %d fragments match, parallel chunk %s", numFragments - check.fragmentMismatches,
+                             numFragments, !check.chunkChecked ? "not checked" : check.chunkMatches ? "matches" : "differs");
+                    strcpy(output, scratch);
+                } else if (strncmp(commandBuf + 1, "sdfbench", 8) == 0) {
+                    int numRuns = 3;
+                    sscanf(commandBuf + 9, "%d", &numRuns);
+                    int comparisons = 0;
+                    int mismatches = WorldGenerator::benchmarkSDFTape(numRuns, WorldGenerator::getSeed(), comparisons);
+                    snprintf(scratch, sizeof(scratch), "%d / %d SDFs match", comparisons - mismatches, comparisons);
+                    strcpy(output, scratch);
+                } else if (strncmp(commandBuf + 1, "cputrace", 8) == 0) {
+                    char filename[MAX_LINE] = "cpu_trace.json";
+                    sscanf(commandBuf + 9, "%255s", filename);
+                    if (CPUProfiler::enabled) {
+                        size_t events = CPUProfiler::writeChromeTrace(filename);
+                        snprintf(scratch, sizeof(scratch), "Wrote %zu events to %s", events, filename);
+                    } else {
+                        snprintf(scratch, sizeof(scratch), "Profiler not compiled in, rebuild with -DENABLE_PROFILER");
+                    }
+                    strcpy(output, scratch);
+                } else if (strcmp(commandBuf + 1, "meminfo") == 0) {
+                    DeviceAllocator::Stats stats = instance->deviceAllocator.stats();
+                    const double mb = 1024.0 * 1024.0;
+                    snprintf(scratch, sizeof(scratch), "%zu allocations (%zu dedicated) in %zu memory objects\n"
+                                                       "%.2f MB requested, %.2f MB allocated, %.2f MB reserved\n"
+                                                       "%.2f MB free in %zu ranges, largest %.2f MB",
+                             stats.allocations, stats.dedicatedAllocations, stats.memoryObjects,
+                             stats.bytesRequested / mb, stats.bytesAllocated / mb, stats.bytesReserved / mb,
+                             stats.bytesFree / mb, stats.freeRanges, stats.largestFreeRange / mb);
+                    strcpy(output, scratch);
+                    std::cout << output << std::endl;
+                } else if (strcmp(commandBuf + 1, "gpudist") == 0) {
+                    size_t bricks = 0;
+                    size_t mismatches = instance->validateGpuDistances(bricks);
+                    snprintf(scratch, sizeof(scratch), "%zu / %zu bricks differ, details on stdout", mismatches, bricks);
+                    strcpy(output, scratch);
                 } else {
                     strcpy(output, "Invalid command.");
                 }
@@ -264,6 +443,7 @@ private:
     VkQueue graphicsQueue;
     VkQueue presentQueue;
     VkQueue computeQueue;
+    VkQueue transferQueue;
 
     VkSurfaceKHR surface;
     VkSwapchainKHR swapChain;
@@ -292,16 +472,16 @@ private:
     std::vector<VkFence> computeFinishedFences;
 
     VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+    DeviceAllocation vertexBufferAllocation;
     VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    DeviceAllocation indexBufferAllocation;
 
     std::vector<VkBuffer> uniformBuffers;
-    std::vector<VkDeviceMemory> uniformBuffersMemory;
+    std::vector<DeviceAllocation> uniformBuffersAllocations;
     std::vector<void*> uniformBuffersMapped;
 
     std::vector<VkImage> renderImages;
-    std::vector<VkDeviceMemory> renderImagesMemory;
+    std::vector<DeviceAllocation> renderImagesAllocations;
     std::vector<VkImageView> renderImageViews;
 
     VkSampler textureSampler;
@@ -313,19 +493,29 @@ private:
     FontMesh renderedFpsCounter;
 
     VkImage fontImage;
-    VkDeviceMemory fontImageMemory;
+    DeviceAllocation fontImageAllocation;
     VkImageView fontImageView;
     VkSampler fontSampler;
 
-    VkBuffer textBuffer;
-    VkDeviceMemory textBufferMemory;
-    VkBuffer textIndexBuffer;
-    VkDeviceMemory textIndexBufferMemory;
-
-    VkBuffer fpsCounterBuffer;
-    VkDeviceMemory fpsCounterMemory;
-    VkBuffer fpsCounterIndexBuffer;
-    VkDeviceMemory fpsCounterIndexMemory;
+    /*
+    Console and FPS counter meshes are written straight into this
+    persistently mapped buffer. Each frame in flight has its own
+    overlayRegionSize bytes of it, filled from the start every frame.
+    The console's ~4k glyphs at 76 bytes each fit with room to spare.
+    */
+    static constexpr VkDeviceSize overlayRegionSize = 512 * 1024;
+    VkBuffer overlayBuffer;
+    DeviceAllocation overlayBufferAllocation;
+    uint8_t* overlayBufferMapped;
+    VkDeviceSize overlayRegionUsed = 0;
+
+    struct OverlayDraw {
+        VkDeviceSize vertexOffset;
+        VkDeviceSize indexOffset;
+        uint32_t indexCount;
+    };
+    OverlayDraw consoleDraw;
+    OverlayDraw fpsCounterDraw;
 
     std::vector<VkDescriptorSet> fontDescriptorSets;
 
@@ -333,6 +523,7 @@ private:
     Console console;
 
     /* Compute pipeline */
+    ShaderConstants shaderConstants;
     VkDescriptorSetLayout computeDescriptorSetLayout;
     VkDescriptorPool computeDescriptorPool;
     std::vector<VkDescriptorSet> computeDescriptorSets;
@@ -340,12 +531,13 @@ private:
     VkPipelineLayout computePipelineLayout;
     /*
     std::vector<VkBuffer> computeUniformBuffers;
-    std::vector<VkDeviceMemory> computeUniformsMemory;
+    std::vector<DeviceAllocation> computeUniformsAllocations;
     std::vector<void*> computeUniformsMapped;
     */
 
-    std::vector<VkBuffer> voxelBuffers;
-    std::vector<VkDeviceMemory> voxelBuffersMemory;
+    /* Shared by every frame in flight, see the timelines below for how writes are kept away from reads */
+    VkBuffer voxelBuffer;
+    DeviceAllocation voxelBufferAllocation;
 
     /* Compute - calculating distance field */
     VkDescriptorSetLayout computeDistancesSetLayout;
@@ -353,12 +545,60 @@ private:
     std::vector<VkDescriptorSet> computeDistancesDescriptorSets;
     VkPipeline computeDistancesPipeline;
     VkPipelineLayout computeDistancesPipelineLayout;
+    /* Scratch for the transform, reused by every chunk, see DISTANCE_WINDOW_WIDTH */
+    VkBuffer distanceWindowBuffer;
+    DeviceAllocation distanceWindowAllocation;
+    /* Set by --gpu-distances */
+    bool gpuDistances = false;
+    /* Chunks whose distances the next frame should recompute on the GPU */
+    std::vector<glm::ivec2> pendingDistanceChunks;
+
+    /* Every buffer and image gets its memory from here, see the meminfo command */
+    DeviceAllocator deviceAllocator;
 
     /* Debug messenger */
     VkDebugUtilsMessengerEXT debugMessenger;
 
+    /* GPU timings per stage, written to gpuTimingsFile on exit */
+    GPUProfiler gpuProfiler;
+    static constexpr const char* gpuTimingsFile = "gpu_timings.csv";
+    /* CPU zones, when built with ENABLE_PROFILER */
+    static constexpr const char* cpuTraceFile = "cpu_trace.json";
+
     /* Voxels */
     LoadedChunks* chunks = nullptr;
+    /* Chunks the generator threads have finished, waiting for the main thread to store them */
+    std::vector<std::unique_ptr<CompressedChunk>> finishedChunks;
+    /* Same for distances across the borders of chunks already stored, see queueStitch */
+    std::vector<std::unique_ptr<ChunkStitch>> finishedStitches;
+    std::mutex finishedChunksMutex;
+    /* Queued or being generated, so nothing is queued twice */
+    std::vector<glm::ivec2> chunksInFlight;
+    /* Set on exit so queued jobs return straight away instead of generating */
+    std::atomic<bool> stopGenerating {false};
+    /* Declared after everything its jobs touch, so the workers are joined first */
+    ThreadPool generatorPool;
+
+    /*
+    Voxel uploads run on the transfer queue. Each frame's compute pass signals
+    frameTimeline, an upload waits for the last submitted frame before
+    overwriting bricks and signals uploadTimeline, which the next compute pass
+    waits on. Neither side ever blocks the CPU.
+
+    Frames signal frameTimeline in submission order, so waiting for the last
+    one means no frame is still reading voxelBuffer when a copy lands, and
+    one buffer is enough for all frames in flight.
+    */
+    VkSemaphore frameTimeline;
+    VkSemaphore uploadTimeline;
+    uint64_t frameTimelineValue = 0;
+    uint64_t uploadTimelineValue = 0;
+
+    /* Textures, meshes and layout transitions go through uploads on the graphics queue, voxel data through voxelUploads */
+    UploadManager uploads;
+    UploadManager voxelUploads;
+    static constexpr VkDeviceSize uploadArenaSize = VkDeviceSize(8) << 20;
+    static constexpr VkDeviceSize voxelUploadArenaSize = VkDeviceSize(64) << 20;
 
     /* Camera / player */
     Camera camera;
@@ -379,11 +619,25 @@ private:
     bool framebufferResized = false;
     bool shouldQuit = false;
 
+    /* Headless mode: no window, surface or swapchain */
+    bool headless = false;
+    int headlessFrames = 0;
+    std::string headlessOutputPrefix;
+    /* Fixed time step, so the same seed always renders the same frames */
+    static constexpr float headlessFrameTime = 1.0f / 60.0f;
+    int cpuRenderFrames = 0;
+    int rayBenchRays = 0;
+    bool compareWithCpu = false;
+    /* Largest difference in a channel for a CPU and GPU pixel to count as matching */
+    static constexpr int cpuCompareTolerance = 8;
+
     double lastFrameFps = 0.0;
     bool fpsCounterEnabled = false;
 
-    FontMesh getMeshForFpsCounter(double fps) {
-        FontMesh result;
+    /* Clears result and fills it, so it can be reused without allocating */
+    void getMeshForFpsCounter(FontMesh& result, double fps) {
+        result.vert.clear();
+        result.ind.clear();
         char scratch[64];
         snprintf(scratch, 64, "%.0f @ %dx%d", fps, swapChainExtent.width / RENDER_SCALE, swapChainExtent.height / RENDER_SCALE);
         scratch[63] = '\0';
@@ -415,12 +669,25 @@ private:
         labelWidth = fontRenderer.getGlyphWidthScreen() * strlen(scratch) + CONSOLE_MARGIN * 2.0;
         fontRenderer.addMeshForBG(result, FONT_BG2_UV, cursor, {-1.0 + labelWidth, cursor.y + labelHeight});
         fontRenderer.addMeshForLabel(result, scratch, {cursor.x + CONSOLE_MARGIN, cursor.y + CONSOLE_MARGIN});
+        cursor.y += labelHeight;
 
-        return result;
+        /* GPU time percentiles */
+        for (GPUProfiler::Stage stage : {GPUProfiler::Raytrace, GPUProfiler::Blit}) {
+            if (gpuProfiler.sampleCount(stage) == 0) {
+                continue;
+            }
+            snprintf(scratch, 64, "%s p50/95/99: %.2f/%.2f/%.2f ms", GPUProfiler::stageName(stage),
+                     gpuProfiler.percentile(stage, 50.0), gpuProfiler.percentile(stage, 95.0), gpuProfiler.percentile(stage, 99.0));
+            labelWidth = fontRenderer.getGlyphWidthScreen() * strlen(scratch) + CONSOLE_MARGIN * 2.0;
+            fontRenderer.addMeshForBG(result, FONT_BG2_UV, cursor, {-1.0 + labelWidth, cursor.y + labelHeight});
+            fontRenderer.addMeshForLabel(result, scratch, {cursor.x + CONSOLE_MARGIN, cursor.y + CONSOLE_MARGIN});
+            cursor.y += labelHeight;
+        }
     }
 
-    FontMesh getMeshForConsole() {
-        FontMesh result;
+    void getMeshForConsole(FontMesh& result) {
+        result.vert.clear();
+        result.ind.clear();
 
         /* Command buffer */
         glm::vec2 cursor(-1.0 + CONSOLE_MARGIN, -1.0 + (fontRenderer.getGlyphHeightScreen() + 2.0 * CONSOLE_MARGIN) * 4.0);
@@ -443,8 +710,6 @@ private:
                                                           {1.0, cursor.y + outputHeight});
             fontRenderer.addMeshForLabel(result, console.getOutputBuf(), cursor);
         }
-
-        return result;
     }
 
     /*
@@ -562,26 +827,39 @@ private:
     void initVulkan() {
         createInstance();
         setupDebugMessenger();
-        createSurface();
+        if (headless) {
+            surface = VK_NULL_HANDLE;
+        } else {
+            createSurface();
+        }
         pickPhysicalDevice();
         createLogicalDevice();
-        createSwapChain();
+        deviceAllocator.init(physicalDevice, device);
+        gpuProfiler.init(physicalDevice, device, findQueueFamilies(physicalDevice).graphicsAndComputeFamily.value(),
+                         MAX_FRAMES_IN_FLIGHT);
+        if (headless) {
+            createHeadlessTarget();
+        } else {
+            createSwapChain();
+        }
         createImageViews();
         createRenderPass();
         createDescriptorSetLayout();
         createGraphicsPipeline();
         createFramebuffers();
         createCommandPool();
+        uploads.init(device, &deviceAllocator, graphicsQueue, findQueueFamilies(physicalDevice).graphicsAndComputeFamily.value(),
+                     uploadArenaSize);
         createTextureSampler();
         loadFont();
         createFontImageView();
         createFontSampler();
         createVertexBuffer();
         createIndexBuffer();
-        createTextBuffers();
-        createFpsCounterBuffers();
+        createOverlayBuffer();
         createUniformBuffers();
-        createVoxelBuffers();
+        createVoxelStreamingObjects();
+        createVoxelBuffer();
         createRenderImages();
         createRenderImageViews();
         createDescriptorPool();
@@ -596,10 +874,10 @@ private:
         // Compute distances
         createComputeDistancesLayout();
         createComputeDistancesPipeline();
+        createDistanceWindowBuffer();
         createComputeDistancesPool();
         createComputeDistancesDescriptorSets();
-        // Compute actual distances...
-        //computeVoxelDistances();
+        submitUploads();
     }
 
     void populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& createInfo) {
@@ -626,80 +904,229 @@ private:
         }
     }
 
-    void computeVoxelDistances() {
-        VkFence computeDistanceFence;
+    /*
+    Record the distance transform in shader_distances.comp for each chunk in
+    targets. A chunk is transformed over a window reaching STITCH_BAND voxels
+    into its loaded neighbours, which gives the same distances as
+    LoadedChunks::stitchChunk once every chunk around it has been through it.
+    The window is shared, so chunks run one after another.
+    */
+    void recordVoxelDistances(VkCommandBuffer commandBuffer, uint32_t frame, const std::vector<glm::ivec2>& targets) {
+        if (targets.empty()) {
+            return;
+        }
+        gpuProfiler.begin(commandBuffer, frame, GPUProfiler::Distances);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computeDistancesPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computeDistancesPipelineLayout,
+                                0, 1, &computeDistancesDescriptorSets[frame], 0, nullptr);
+        /* The previous frame's raytrace may still be reading what this overwrites */
+        recordComputeBarrier(commandBuffer);
+
+        for (const glm::ivec2& target : targets) {
+            DistancesPushConstants constants {};
+            constants.chunk = target;
+            constants.loadedMask = 0;
+            for (int dx = -1; dx <= 1; dx++) {
+                for (int dy = -1; dy <= 1; dy++) {
+                    if (chunks->isLoaded(target.x + dx, target.y + dy)) {
+                        constants.loadedMask |= 1 << ((dx + 1) * 3 + dy + 1);
+                    }
+                }
+            }
+            for (int pass = DistancesColumns; pass <= DistancesWrite; pass++) {
+                constants.pass = pass;
+                vkCmdPushConstants(commandBuffer, computeDistancesPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                                   0, sizeof(DistancesPushConstants), &constants);
+                recordFlatDispatch(commandBuffer, distancesWorkgroups(DistancesPass(pass)));
+                recordComputeBarrier(commandBuffer);
+            }
+        }
+        gpuProfiler.end(commandBuffer, frame, GPUProfiler::Distances);
+    }
 
-        VkFenceCreateInfo computeFenceInfo {};
-        computeFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        computeFenceInfo.flags = 0;
+    /* Workgroups of 64 invocations, except the line passes which take a workgroup per line */
+    static uint32_t distancesWorkgroups(DistancesPass pass) {
+        const uint32_t workgroupSize = 64;
+        switch (pass) {
+        case DistancesColumns:
+            return (DISTANCE_WINDOW_WIDTH * DISTANCE_WINDOW_WIDTH + workgroupSize - 1) / workgroupSize;
+        case DistancesRowsY:
+        case DistancesRowsX:
+            return DISTANCE_WINDOW_WIDTH * CHUNK_HEIGHT_VOXELS;
+        case DistancesResetBricks:
+            return (BRICKS_PER_CHUNK + workgroupSize - 1) / workgroupSize;
+        case DistancesWrite:
+            return uint32_t((size_t(CHUNK_WIDTH_VOXELS) * CHUNK_WIDTH_VOXELS * CHUNK_HEIGHT_VOXELS + workgroupSize - 1) / workgroupSize);
+        }
+        return 0;
+    }
 
-        if (vkCreateFence(device, &computeFenceInfo, nullptr, &computeDistanceFence) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to create compute distance fences!");
+    /* More workgroups than one dimension can hold, the shader flattens them back and skips the extras */
+    static void recordFlatDispatch(VkCommandBuffer commandBuffer, uint32_t workgroups) {
+        const uint32_t rowLength = 1024;
+        if (workgroups <= rowLength) {
+            vkCmdDispatch(commandBuffer, workgroups, 1, 1);
+        } else {
+            vkCmdDispatch(commandBuffer, rowLength, (workgroups + rowLength - 1) / rowLength, 1);
         }
+    }
 
-        const int workgroupSizeX = 8;
-        const int workgroupSizeY = 8;
-        const int workgroupSizeZ = 16;
+    static void recordComputeBarrier(VkCommandBuffer commandBuffer) {
+        VkMemoryBarrier barrier {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
 
-        VkCommandBufferBeginInfo beginInfo {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    /* Loaded chunks queued for the GPU pass once, each with its loaded neighbours */
+    void queueGpuDistances(glm::ivec2 chunk) {
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                const glm::ivec2 c(chunk.x + dx, chunk.y + dy);
+                if (chunks->isLoaded(c.x, c.y) &&
+                    std::find(pendingDistanceChunks.begin(), pendingDistanceChunks.end(), c) == pendingDistanceChunks.end()) {
+                    pendingDistanceChunks.push_back(c);
+                }
+            }
+        }
+    }
 
-        if (vkBeginCommandBuffer(computeDistancesCommandBuffers[0], &beginInfo) != VK_SUCCESS)
-        {
-            throw std::runtime_error("Failed to begin recording compute command buffer!");
+    std::vector<glm::ivec2> loadedChunksAround(glm::ivec2 centerChunk) {
+        std::vector<glm::ivec2> loaded;
+        for (int x = -DRAW_DISTANCE; x <= DRAW_DISTANCE; x++) {
+            for (int y = -DRAW_DISTANCE; y <= DRAW_DISTANCE; y++) {
+                if (chunks->isLoaded(centerChunk.x + x, centerChunk.y + y)) {
+                    loaded.push_back(glm::ivec2(centerChunk.x + x, centerChunk.y + y));
+                }
+            }
         }
+        return loaded;
+    }
 
-        vkCmdBindPipeline(computeDistancesCommandBuffers[0], VK_PIPELINE_BIND_POINT_COMPUTE, computeDistancesPipeline);
-        vkCmdBindDescriptorSets(computeDistancesCommandBuffers[0], VK_PIPELINE_BIND_POINT_COMPUTE, computeDistancesPipelineLayout,
-                                0, 1, &computeDistancesDescriptorSets[0], 0, nullptr);
+    /*
+    Run the GPU distance pass over every loaded chunk and compare the result
+    with LoadedChunks after stitching them all on the CPU. Blocks until the
+    device is idle. Meant for a freshly loaded world: after moving, the CPU
+    side can keep distances capped towards chunks that have since unloaded.
+    Only empty bricks have distances, so this compares the brick tables.
+    Returns the number of bricks that differ, bricks is set to how many were compared.
+    */
+    size_t validateGpuDistances(size_t& bricks) {
+        vkDeviceWaitIdle(device);
+        const std::vector<glm::ivec2> loaded = loadedChunksAround(lastUpdatePlayerChunk);
+        /* Without gpuDistances they've been stitched already, but some stitches may still be queued.
+           Stitching again only lowers distances to what they already are. */
+        for (const glm::ivec2& chunk : loaded) {
+            chunks->stitchChunk(chunk.x, chunk.y, &generatorPool);
+        }
+        /* Whatever is pending would be recomputed below anyway */
+        pendingDistanceChunks.clear();
+        uploadVoxelChanges();
+        vkDeviceWaitIdle(device);
+        gpuProfiler.collect(currentFrame, frameCounter);
+
+        /* The table for every slot */
+        const VkDeviceSize readbackSize = BRICK_TABLE_SIZE_BYTES;
+        VkBuffer readbackBuffer;
+        DeviceAllocation readbackAllocation;
+        createBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     readbackBuffer, readbackAllocation);
+
+        VkCommandBuffer commandBuffer = computeDistancesCommandBuffers[currentFrame];
+        vkResetCommandBuffer(commandBuffer, 0);
+        VkCommandBufferBeginInfo beginInfo {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to begin recording compute distances command buffer!");
+        }
+        recordVoxelDistances(commandBuffer, currentFrame, loaded);
 
-        vkCmdDispatch(computeDistancesCommandBuffers[0], CHUNK_WIDTH_VOXELS / workgroupSizeX, CHUNK_WIDTH_VOXELS / workgroupSizeY, CHUNK_HEIGHT_VOXELS / workgroupSizeZ);
+        VkMemoryBarrier barrier {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+        VkBufferCopy copyRegion {};
+        copyRegion.srcOffset = BRICK_TABLE_OFFSET;
+        copyRegion.dstOffset = 0;
+        copyRegion.size = readbackSize;
+        vkCmdCopyBuffer(commandBuffer, voxelBuffer, readbackBuffer, 1, &copyRegion);
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-        if (vkEndCommandBuffer(computeDistancesCommandBuffers[0]) != VK_SUCCESS)
-        {
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
             throw std::runtime_error("Failed to record compute distances command buffer!");
         }
 
-        VkSubmitInfo computeDistancesSubmitInfo {};
-        computeDistancesSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-        computeDistancesSubmitInfo.waitSemaphoreCount = 0;
-        computeDistancesSubmitInfo.pWaitSemaphores = nullptr;
-        computeDistancesSubmitInfo.pWaitDstStageMask = nullptr;
-
-        computeDistancesSubmitInfo.commandBufferCount = 1;
-        computeDistancesSubmitInfo.pCommandBuffers = &computeDistancesCommandBuffers[0];
-
-        computeDistancesSubmitInfo.signalSemaphoreCount = 0;
-        computeDistancesSubmitInfo.pSignalSemaphores = nullptr;
-
+        VkSubmitInfo submitInfo {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
         VkResult result;
-        if ((result = vkQueueSubmit(computeQueue, 1, &computeDistancesSubmitInfo, computeDistanceFence)) != VK_SUCCESS)
-        {
+        if ((result = vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE)) != VK_SUCCESS) {
             std::cerr << string_VkResult(result) << std::endl;
             throw std::runtime_error("Failed to submit compute distances command buffer");
         }
-        if ((result = vkWaitForFences(device, 1, &computeDistanceFence, VK_TRUE, UINT64_MAX)) != VK_SUCCESS)
-        {
-            std::cerr << "Error waiting for fence: " << string_VkResult(result) << std::endl;
-            throw std::runtime_error("Failed to wait for compute distances fence!");
+        vkDeviceWaitIdle(device);
+        gpuProfiler.collect(currentFrame, frameCounter);
+
+        const uint32_t* table = static_cast<const uint32_t*>(readbackAllocation.mapped);
+        std::vector<uint32_t> expected(BRICKS_PER_CHUNK);
+        size_t mismatches = 0;
+        bricks = 0;
+        for (const glm::ivec2& chunk : loaded) {
+            const size_t slot = LoadedChunks::slotIndex(chunk.x, chunk.y);
+            chunks->copyRegion({BRICK_TABLE_OFFSET + slot * BRICKS_PER_CHUNK * sizeof(uint32_t), BRICKS_PER_CHUNK * sizeof(uint32_t)},
+                               expected.data());
+            const uint32_t* slotTable = table + slot * BRICKS_PER_CHUNK;
+            for (int x = 0; x < CHUNK_WIDTH_VOXELS; x += BRICK_SIZE) {
+                for (int y = 0; y < CHUNK_WIDTH_VOXELS; y += BRICK_SIZE) {
+                    for (int z = 0; z < CHUNK_HEIGHT_VOXELS; z += BRICK_SIZE) {
+                        const int b = LoadedChunks::brickIndex(x, y, z);
+                        bricks++;
+                        if (slotTable[b] != expected[b]) {
+                            if (mismatches < 10) {
+                                std::cout << "Chunk (" << chunk.x << ", " << chunk.y << ") brick at (" << x << ", " << y << ", " << z
+                                          << "): GPU " << std::hex << slotTable[b] << ", CPU " << expected[b] << std::dec << std::endl;
+                            }
+                            mismatches++;
+                        }
+                    }
+                }
+            }
         }
+        destroyBuffer(readbackBuffer, readbackAllocation);
 
-        vkDestroyFence(device, computeDistanceFence, nullptr);
-
-        for (int i = 1; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            copyBuffer(voxelBuffers[0], voxelBuffers[i], sizeof(LoadedChunks));
+        std::cout << mismatches << " / " << bricks << " bricks differ between the GPU and CPU distances in "
+                  << loaded.size() << " chunks";
+        if (gpuProfiler.latest(GPUProfiler::Distances) >= 0.0) {
+            std::cout << ", GPU pass took " << gpuProfiler.latest(GPUProfiler::Distances) << " ms";
         }
+        std::cout << std::endl;
+        return mismatches;
     }
 
     void createComputeDistancesLayout() {
-        std::array<VkDescriptorSetLayoutBinding, 1> layoutBindings {};
+        std::array<VkDescriptorSetLayoutBinding, 2> layoutBindings {};
         layoutBindings[0].binding = 0;
         layoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
         layoutBindings[0].descriptorCount = 1;
         layoutBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
         layoutBindings[0].pImmutableSamplers = nullptr;
 
+        layoutBindings[1].binding = 1;
+        layoutBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[1].descriptorCount = 1;
+        layoutBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        layoutBindings[1].pImmutableSamplers = nullptr;
+
         VkDescriptorSetLayoutCreateInfo layoutInfo {};
         layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
@@ -717,7 +1144,6 @@ private:
         pipelineLayoutInfo.pSetLayouts = &computeDistancesSetLayout;
 
         // Push constant
-        /*
         VkPushConstantRange pushConstantRange {};
         pushConstantRange.offset = 0;
         pushConstantRange.size = sizeof(DistancesPushConstants);
@@ -725,7 +1151,6 @@ private:
 
         pipelineLayoutInfo.pushConstantRangeCount = 1;
         pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
-        */
 
         if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &computeDistancesPipelineLayout) != VK_SUCCESS) {
             throw std::runtime_error("Failed to create compute distances pipeline layout!");
@@ -741,6 +1166,11 @@ private:
         computeDistancesShaderStageInfo.module = computeDistancesShaderModule;
         computeDistancesShaderStageInfo.pName = "main";
 
+        /* The rendering knobs don't exist in this shader, so they're ignored */
+        std::vector<VkSpecializationMapEntry> specializationEntries = shaderConstantEntries(sizeof(ShaderConstants) / sizeof(int32_t));
+        VkSpecializationInfo specializationInfo = shaderSpecializationInfo(specializationEntries);
+        computeDistancesShaderStageInfo.pSpecializationInfo = &specializationInfo;
+
         VkComputePipelineCreateInfo pipelineInfo {};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
         pipelineInfo.layout = computeDistancesPipelineLayout;
@@ -754,10 +1184,15 @@ private:
         vkDestroyShaderModule(device, computeDistancesShaderModule, nullptr);
     }
 
+    void createDistanceWindowBuffer() {
+        createBuffer(DISTANCE_WINDOW_SIZE_BYTES, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, distanceWindowBuffer, distanceWindowAllocation);
+    }
+
     void createComputeDistancesPool() {
         std::array<VkDescriptorPoolSize, 1> poolSizes {};
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        poolSizes[0].descriptorCount = static_cast<uint32_t>(2 * MAX_FRAMES_IN_FLIGHT);
 
         VkDescriptorPoolCreateInfo poolInfo {};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -788,11 +1223,16 @@ private:
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             VkDescriptorBufferInfo bufferInfo {};
-            bufferInfo.buffer = voxelBuffers[i];
+            bufferInfo.buffer = voxelBuffer;
             bufferInfo.offset = 0;
             bufferInfo.range = VK_WHOLE_SIZE;
 
-            std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+            VkDescriptorBufferInfo windowInfo {};
+            windowInfo.buffer = distanceWindowBuffer;
+            windowInfo.offset = 0;
+            windowInfo.range = VK_WHOLE_SIZE;
+
+            std::array<VkWriteDescriptorSet, 2> descriptorWrites {};
 
             descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
             descriptorWrites[0].dstSet = computeDistancesDescriptorSets[i];
@@ -802,6 +1242,14 @@ private:
             descriptorWrites[0].descriptorCount = 1;
             descriptorWrites[0].pBufferInfo = &bufferInfo;
 
+            descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[1].dstSet = computeDistancesDescriptorSets[i];
+            descriptorWrites[1].dstBinding = 1;
+            descriptorWrites[1].dstArrayElement = 0;
+            descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrites[1].descriptorCount = 1;
+            descriptorWrites[1].pBufferInfo = &windowInfo;
+
             vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()),
                                    descriptorWrites.data(), 0, nullptr);
         }
@@ -812,14 +1260,14 @@ private:
         VkDeviceSize bufferSize = sizeof(Camera);
 
         computeUniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-        computeUniformsMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        computeUniformsAllocations.resize(MAX_FRAMES_IN_FLIGHT);
         computeUniformsMapped.resize(MAX_FRAMES_IN_FLIGHT);
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         computeUniformBuffers[i], computeUniformsMemory[i]);
-            vkMapMemory(device, computeUniformsMemory[i], 0, bufferSize, 0, &computeUniformsMapped[i]);
+                         computeUniformBuffers[i], computeUniformsAllocations[i]);
+            computeUniformsMapped[i] = computeUniformsAllocations[i].mapped;
         }
     }
     */
@@ -829,7 +1277,7 @@ private:
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
         poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
         poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        poolSizes[1].descriptorCount = static_cast<uint32_t>(2 * MAX_FRAMES_IN_FLIGHT);
 
         VkDescriptorPoolCreateInfo poolInfo {};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -866,11 +1314,17 @@ private:
             outputImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
             VkDescriptorBufferInfo voxelBufferInfo {};
-            voxelBufferInfo.buffer = voxelBuffers[i];
+            voxelBufferInfo.buffer = voxelBuffer;
             voxelBufferInfo.offset = 0;
             voxelBufferInfo.range = VK_WHOLE_SIZE;
 
-            std::array<VkWriteDescriptorSet, 2> descriptorWrites {};
+            /* The occupancy pyramids and brick occupancy at the end of the same buffer */
+            VkDescriptorBufferInfo occupancyInfo {};
+            occupancyInfo.buffer = voxelBuffer;
+            occupancyInfo.offset = OCCUPANCY_OFFSET;
+            occupancyInfo.range = VK_WHOLE_SIZE;
+
+            std::array<VkWriteDescriptorSet, 3> descriptorWrites {};
 
             descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
             descriptorWrites[0].dstSet = computeDescriptorSets[i];
@@ -888,6 +1342,14 @@ private:
             descriptorWrites[1].descriptorCount = 1;
             descriptorWrites[1].pBufferInfo = &voxelBufferInfo;
 
+            descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[2].dstSet = computeDescriptorSets[i];
+            descriptorWrites[2].dstBinding = 2;
+            descriptorWrites[2].dstArrayElement = 0;
+            descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrites[2].descriptorCount = 1;
+            descriptorWrites[2].pBufferInfo = &occupancyInfo;
+
             vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()),
                                    descriptorWrites.data(), 0, nullptr);
         }
@@ -934,7 +1396,7 @@ private:
     }
 
     void createComputeDescriptorSetLayout() {
-        std::array<VkDescriptorSetLayoutBinding, 2> layoutBindings {};
+        std::array<VkDescriptorSetLayoutBinding, 3> layoutBindings {};
 
         layoutBindings[0].binding = 0;
         layoutBindings[0].descriptorCount = 1;
@@ -948,6 +1410,12 @@ private:
         layoutBindings[1].pImmutableSamplers = nullptr;
         layoutBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
+        layoutBindings[2].binding = 2;
+        layoutBindings[2].descriptorCount = 1;
+        layoutBindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[2].pImmutableSamplers = nullptr;
+        layoutBindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
         VkDescriptorSetLayoutCreateInfo layoutInfo {};
         layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
@@ -958,6 +1426,26 @@ private:
         }
     }
 
+    /* One entry per ShaderConstants member, for the first count of them */
+    static std::vector<VkSpecializationMapEntry> shaderConstantEntries(uint32_t count) {
+        std::vector<VkSpecializationMapEntry> entries(count);
+        for (uint32_t i = 0; i < count; i++) {
+            entries[i].constantID = i;
+            entries[i].offset = i * sizeof(int32_t);
+            entries[i].size = sizeof(int32_t);
+        }
+        return entries;
+    }
+
+    VkSpecializationInfo shaderSpecializationInfo(const std::vector<VkSpecializationMapEntry>& entries) {
+        VkSpecializationInfo info {};
+        info.mapEntryCount = static_cast<uint32_t>(entries.size());
+        info.pMapEntries = entries.data();
+        info.dataSize = sizeof(ShaderConstants);
+        info.pData = &shaderConstants;
+        return info;
+    }
+
     void createComputePipeline() {
         /* Pipeline layout */
         VkPipelineLayoutCreateInfo pipelineLayoutInfo {};
@@ -989,6 +1477,10 @@ private:
         computeShaderStageInfo.module = computeShaderModule;
         computeShaderStageInfo.pName = "main";
 
+        std::vector<VkSpecializationMapEntry> specializationEntries = shaderConstantEntries(sizeof(ShaderConstants) / sizeof(int32_t));
+        VkSpecializationInfo specializationInfo = shaderSpecializationInfo(specializationEntries);
+        computeShaderStageInfo.pSpecializationInfo = &specializationInfo;
+
         /* Pipeline */
         VkComputePipelineCreateInfo pipelineInfo {};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
@@ -1067,48 +1559,8 @@ private:
         }
     }
 
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-        VkBufferImageCopy region {};
-        region.bufferOffset = 0;
-        region.bufferRowLength = 0;
-        region.bufferImageHeight = 0;
-
-        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.imageSubresource.mipLevel = 0;
-        region.imageSubresource.baseArrayLayer = 0;
-        region.imageSubresource.layerCount = 1;
-
-        region.imageOffset = {0, 0, 0};
-        region.imageExtent = {
-            width,
-            height,
-            1
-        };
-
-        vkCmdCopyBufferToImage(commandBuffer, buffer, image,
-                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-        endSingleTimeCommands(commandBuffer);
-    }
-
-    void copyBufferToBuffer(VkBuffer src, VkBuffer dst, VkDeviceSize sz) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-        VkBufferCopy bufferCopy {};
-        bufferCopy.srcOffset = 0;
-        bufferCopy.dstOffset = 0;
-        bufferCopy.size = sz;
-
-        vkCmdCopyBuffer(commandBuffer, src, dst, 1, &bufferCopy);
-        endSingleTimeCommands(commandBuffer);
-    }
-
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout,
+    void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout,
                                VkImageLayout newLayout) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
         VkImageMemoryBarrier barrier {};
         barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         barrier.oldLayout = oldLayout;
@@ -1166,46 +1618,11 @@ private:
                              0, nullptr,
                              0, nullptr,
                              1, &barrier);
-
-        endSingleTimeCommands(commandBuffer);
-    }
-
-    VkCommandBuffer beginSingleTimeCommands() {
-        VkCommandBufferAllocateInfo allocInfo {};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandPool = commandPool;
-        allocInfo.commandBufferCount = 1;
-
-        VkCommandBuffer commandBuffer;
-        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-
-        VkCommandBufferBeginInfo beginInfo {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-        vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-        return commandBuffer;
-    }
-
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-        vkEndCommandBuffer(commandBuffer);
-
-        VkSubmitInfo submitInfo {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue);
-
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
     }
 
     void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling,
                      VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image,
-                     VkDeviceMemory& imageMemory) {
+                     DeviceAllocation& allocation) {
         // Create the image
         VkImageCreateInfo imageInfo {};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -1232,17 +1649,15 @@ private:
         VkMemoryRequirements memRequirements;
         vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo {};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-                                    properties);
+        allocation = deviceAllocator.allocate(memRequirements, findMemoryType(memRequirements.memoryTypeBits, properties),
+                                              tiling == VK_IMAGE_TILING_OPTIMAL);
 
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate image memory!");
-        }
+        vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+    }
 
-        vkBindImageMemory(device, image, imageMemory, 0);
+    void destroyImage(VkImage image, DeviceAllocation& allocation) {
+        vkDestroyImage(device, image, nullptr);
+        deviceAllocator.free(allocation);
     }
     /*
     void createTextureImage() {
@@ -1255,105 +1670,56 @@ private:
             throw std::runtime_error("failed to load texture image!");
         }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(imageSize, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-            memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vkUnmapMemory(device, stagingBufferMemory);
-
-        stbi_image_free(pixels);
-
         createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
                     VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageAllocation);
 
-        transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
+        transitionImageLayout(uploads.commandBuffer(), textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth),
-                          static_cast<uint32_t>(texHeight));
-        transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        uploads.copyToImage(pixels, imageSize, textureImage, static_cast<uint32_t>(texWidth),
+                            static_cast<uint32_t>(texHeight));
+        transitionImageLayout(uploads.commandBuffer(), textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        stbi_image_free(pixels);
     }
     */
 
     /*
-    Load a given file to a VkImage and VkDeviceMemory
+    Load a given file to a VkImage and its DeviceAllocation
     calls stbi_load with given desired_channels
     */
-    void loadVkImage(const char* path, int desired_channels, VkImage& image, VkDeviceMemory& memory) {
+    void loadVkImage(const char* path, int desired_channels, VkImage& image, DeviceAllocation& allocation) {
         int texWidth, texHeight, texChannels;
         stbi_uc* pixels = stbi_load(path, &texWidth, &texHeight,
                                     &texChannels, desired_channels);
-        VkDeviceSize imageSize = texWidth * texHeight * 4;
 
         if (!pixels) {
             throw std::runtime_error("failed to load texture image!");
         }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(imageSize, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-            memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vkUnmapMemory(device, stagingBufferMemory);
-
+        loadVkImage(pixels, texWidth, texHeight, image, allocation);
         stbi_image_free(pixels);
-
-        createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-                    VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory);
-
-        transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
-                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        copyBufferToImage(stagingBuffer, image, static_cast<uint32_t>(texWidth),
-                          static_cast<uint32_t>(texHeight));
-        transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
     }
 
-    void loadVkImage(stbi_uc* pixels, int texWidth, int texHeight, VkImage& image, VkDeviceMemory& memory) {
+    void loadVkImage(stbi_uc* pixels, int texWidth, int texHeight, VkImage& image, DeviceAllocation& allocation) {
         VkDeviceSize imageSize = texWidth * texHeight * 4;
 
         if (!pixels) {
             throw std::runtime_error("NULL texture image!");
         }
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(imageSize, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-            memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vkUnmapMemory(device, stagingBufferMemory);
-
         createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
                     VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory);
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, allocation);
 
-        transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
+        /* Recorded into the startup batch, pixels can be freed as soon as this returns */
+        transitionImageLayout(uploads.commandBuffer(), image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED,
                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        copyBufferToImage(stagingBuffer, image, static_cast<uint32_t>(texWidth),
-                          static_cast<uint32_t>(texHeight));
-        transitionImageLayout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        uploads.copyToImage(pixels, imageSize, image, static_cast<uint32_t>(texWidth),
+                            static_cast<uint32_t>(texHeight));
+        transitionImageLayout(uploads.commandBuffer(), image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                               VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
     }
 
     void loadFont() {
@@ -1366,7 +1732,7 @@ private:
             throw std::runtime_error("failed to load texture image!");
         }
 
-        loadVkImage(pixels, texWidth, texHeight, fontImage, fontImageMemory);
+        loadVkImage(pixels, texWidth, texHeight, fontImage, fontImageAllocation);
         stbi_image_free(pixels);
     }
 
@@ -1403,13 +1769,14 @@ private:
 
     void createRenderImages() {
         renderImages.resize(MAX_FRAMES_IN_FLIGHT);
-        renderImagesMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        renderImagesAllocations.resize(MAX_FRAMES_IN_FLIGHT);
 
         for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             createImage(swapChainExtent.width / RENDER_SCALE, swapChainExtent.height / RENDER_SCALE, VK_FORMAT_R8G8B8A8_UNORM,
-                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
-                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, renderImages[i], renderImagesMemory[i]);
-            transitionImageLayout(renderImages[i], VK_FORMAT_R8G8B8A8_UNORM,
+                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT |
+                        VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, renderImages[i], renderImagesAllocations[i]);
+            transitionImageLayout(uploads.commandBuffer(), renderImages[i], VK_FORMAT_R8G8B8A8_UNORM,
                                   VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
         }
     }
@@ -1422,95 +1789,231 @@ private:
         }
     }
 
-    void createVoxelBuffers() {
-        lastUpdatePlayerChunk = glm::ivec2(int(camera.position.x) / CHUNK_WIDTH_VOXELS,
-                                           int(camera.position.y) / CHUNK_WIDTH_VOXELS);
-        size_t voxelBufferSize = sizeof(LoadedChunks);
-        std::cout << "Creating a voxel buffer of size " << voxelBufferSize << std::endl;
-        chunks = new LoadedChunks;
-        std::cout << "Generating chunks: 0 / " << TOTAL_CHUNKS_LOADED;
-        std::cout.flush();
-        for (int x = 0; x < LOADED_CHUNKS_AXIS; x++) {
-            for (int y = 0; y < LOADED_CHUNKS_AXIS; y++) {
-                VoxelChunk v(chunks, x, y);
-                WorldGenerator::generateChunk(&v, lastUpdatePlayerChunk.x + x - DRAW_DISTANCE, lastUpdatePlayerChunk.y + y - DRAW_DISTANCE);
-                std::cout << "\rGenerating chunks: " << x * LOADED_CHUNKS_AXIS + y + 1 << " / " << TOTAL_CHUNKS_LOADED;
-                std::cout.flush();
-            }
-        }
-        std::cout << std::endl;
-
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(voxelBufferSize, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+    void createVoxelStreamingObjects() {
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+        voxelUploads.init(device, &deviceAllocator, transferQueue, queueFamilyIndices.transferFamily.value(),
+                          voxelUploadArenaSize);
 
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, voxelBufferSize, 0, &data);
-            memcpy(data, &chunks->voxels, voxelBufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-        //delete chunks;
+        VkSemaphoreTypeCreateInfo timelineInfo {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        timelineInfo.initialValue = 0;
 
-        voxelBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-        voxelBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        VkSemaphoreCreateInfo semaphoreInfo {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &timelineInfo;
 
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            createBuffer(voxelBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, voxelBuffers[i],
-                                    voxelBuffersMemory[i]);
-            copyBuffer(stagingBuffer, voxelBuffers[i], voxelBufferSize);
+        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &frameTimeline) != VK_SUCCESS ||
+            vkCreateSemaphore(device, &semaphoreInfo, nullptr, &uploadTimeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create timeline semaphores");
         }
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
     }
 
-    void updateChunks() {
-        glm::ivec2 playerChunk = glm::ivec2(int(camera.position.x) / CHUNK_WIDTH_METERS,
-                                             int(camera.position.y) / CHUNK_WIDTH_METERS);
-        if (playerChunk.x != lastUpdatePlayerChunk.x ||
-            playerChunk.y != lastUpdatePlayerChunk.y) {
-            loadNewChunks(playerChunk.x - lastUpdatePlayerChunk.x, playerChunk.y - lastUpdatePlayerChunk.y);
+    /* Nothing to look at until the first chunks exist, so this waits for them */
+    void loadStartupChunks() {
+        lastUpdatePlayerChunk = chunkContaining(camera.position);
+        chunks = new LoadedChunks;
+
+        auto genStart = std::chrono::high_resolution_clock::now();
+        {
+            PROFILE_ZONE("generateStartupChunks");
+            requestChunksAround(lastUpdatePlayerChunk);
+            generatorPool.waitIdle();
+            storeFinishedChunks();
+            /* Storing them queued their stitches */
+            generatorPool.waitIdle();
+            storeFinishedChunks();
         }
+        auto genEnd = std::chrono::high_resolution_clock::now();
+        std::cout << "Generated startup chunks in " << std::chrono::duration<double, std::milli>(genEnd - genStart).count() << " ms" << std::endl;
     }
 
-    /*
-    Load the new chunks into memory when the player moves.
-    directionX = -1 if player moved in the negative x direction
-                  0 if player did not change x coord
-                  1 if player moved in positive x direction
-                  etc.
-
-    if either directionX or directionY is not one of these values,
-    reload all chunks
-    */
-    void loadNewChunks(int directionX, int directionY) {
-        std::cout << "Player moved in the " << directionX << ", " << directionY << " direction." << std::endl;
-        lastUpdatePlayerChunk = glm::ivec2(int(camera.position.x) / CHUNK_WIDTH_METERS,
-                                           int(camera.position.y) / CHUNK_WIDTH_METERS);
-        glm::ivec2 minChunk(lastUpdatePlayerChunk.x - DRAW_DISTANCE,
-                            lastUpdatePlayerChunk.y - DRAW_DISTANCE);
-        if (directionX == 0 && directionY == 1) {
-            /* Issue CHUNK_WIDTH_VOXELS * LOADED_CHUNKS_AXIS buffer copies */
-        } else if (directionX == 1 && directionY == 0) {
+    void createVoxelBuffer() {
+        PROFILE_FUNCTION();
+        loadStartupChunks();
 
-        } else if (directionX == 1 && directionY == 1) {
+        std::cout << "Creating a voxel buffer of size " << VOXEL_BUFFER_SIZE_BYTES << ", " << chunks->getBrickCount()
+                  << " bricks in use (dense would be " << CHUNK_SIZE_BYTES * TOTAL_CHUNKS_LOADED << ")" << std::endl;
 
-        } else if (directionX == 0 && directionY == -1) {
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+        std::vector<uint32_t> voxelQueueFamilies = {queueFamilyIndices.graphicsAndComputeFamily.value()};
+        if (queueFamilyIndices.transferFamily != queueFamilyIndices.graphicsAndComputeFamily) {
+            voxelQueueFamilies.push_back(queueFamilyIndices.transferFamily.value());
+        }
 
-        } else if (directionX == -1 && directionY == 0) {
+        /* Transfer source for the gpudist command's readback */
+        createBuffer(VOXEL_BUFFER_SIZE_BYTES, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, voxelBuffer, voxelBufferAllocation, voxelQueueFamilies);
+        /* Only the used part of the brick pool is uploaded, the rest is left uninitialized */
+        uploadVoxelChanges();
+    }
 
-        } else if (directionX == -1 && directionY == -1) {
+    glm::ivec2 chunkContaining(const glm::vec3& position) {
+        return glm::ivec2(int(glm::floor(position.x / CHUNK_WIDTH_METERS)),
+                          int(glm::floor(position.y / CHUNK_WIDTH_METERS)));
+    }
 
-        } else {
-            return;
-        }
+    bool inLoadedWindow(glm::ivec2 chunk) {
+        return std::abs(chunk.x - lastUpdatePlayerChunk.x) <= DRAW_DISTANCE &&
+               std::abs(chunk.y - lastUpdatePlayerChunk.y) <= DRAW_DISTANCE;
     }
 
-    void createDescriptorSets() {
-        std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptorSetLayout);
-        VkDescriptorSetAllocateInfo allocInfo {};
+    /*
+    Queue generation of every chunk within DRAW_DISTANCE of centerChunk that
+    isn't loaded or already on its way. Doesn't wait for anything, the
+    results are picked up by storeFinishedChunks.
+    */
+    void requestChunksAround(glm::ivec2 centerChunk) {
+        chunks->setLowestChunk(centerChunk.x - DRAW_DISTANCE, centerChunk.y - DRAW_DISTANCE);
+        int queued = 0;
+        for (int x = -DRAW_DISTANCE; x <= DRAW_DISTANCE; x++) {
+            for (int y = -DRAW_DISTANCE; y <= DRAW_DISTANCE; y++) {
+                const glm::ivec2 c(centerChunk.x + x, centerChunk.y + y);
+                if (chunks->isLoaded(c.x, c.y) ||
+                    std::find(chunksInFlight.begin(), chunksInFlight.end(), c) != chunksInFlight.end()) {
+                    continue;
+                }
+                chunksInFlight.push_back(c);
+                generatorPool.enqueue([this, c]() {
+                    if (stopGenerating) {
+                        return;
+                    }
+                    std::unique_ptr<VoxelChunk> v(new VoxelChunk);
+                    WorldGenerator::generateChunk(v.get(), c.x, c.y, &generatorPool);
+                    std::unique_ptr<CompressedChunk> compressed(new CompressedChunk);
+                    LoadedChunks::compressChunk(c.x, c.y, *v, *compressed);
+
+                    std::lock_guard<std::mutex> lock(finishedChunksMutex);
+                    finishedChunks.push_back(std::move(compressed));
+                });
+                queued++;
+            }
+        }
+        if (queued > 0) {
+            std::cout << "Queued " << queued << " chunks on " << generatorPool.size()
+                      << " threads (seed " << WorldGenerator::getSeed() << ")" << std::endl;
+        }
+    }
+
+    /*
+    Stitch a stored chunk to its neighbours on the generator threads. Only
+    applying the result touches chunks, which storeFinishedChunks does once
+    it's done, so the main thread never waits for the distance transforms.
+    */
+    void queueStitch(glm::ivec2 chunk) {
+        generatorPool.enqueue([this, chunk]() {
+            if (stopGenerating) {
+                return;
+            }
+            std::unique_ptr<ChunkStitch> stitch(new ChunkStitch);
+            chunks->computeStitch(chunk.x, chunk.y, *stitch, &generatorPool);
+
+            std::lock_guard<std::mutex> lock(finishedChunksMutex);
+            finishedStitches.push_back(std::move(stitch));
+        });
+    }
+
+    /* Move whatever the generator threads have finished into chunks and queue stitching them to their
+       neighbours, or with gpuDistances queue them for the GPU pass. Chunks the player has moved away
+       from are dropped. Stitches that have finished are applied. */
+    void storeFinishedChunks() {
+        std::vector<std::unique_ptr<CompressedChunk>> finished;
+        std::vector<std::unique_ptr<ChunkStitch>> stitches;
+        {
+            std::lock_guard<std::mutex> lock(finishedChunksMutex);
+            finished.swap(finishedChunks);
+            stitches.swap(finishedStitches);
+        }
+        generatorPool.rethrowErrors();
+
+        for (const std::unique_ptr<ChunkStitch>& s : stitches) {
+            chunks->applyStitch(*s);
+        }
+        for (const std::unique_ptr<CompressedChunk>& c : finished) {
+            const glm::ivec2 chunk(c->chunkX, c->chunkY);
+            chunksInFlight.erase(std::find(chunksInFlight.begin(), chunksInFlight.end(), chunk));
+            if (inLoadedWindow(chunk)) {
+                chunks->storeChunk(*c);
+                if (gpuDistances) {
+                    queueGpuDistances(chunk);
+                } else {
+                    queueStitch(chunk);
+                }
+            }
+        }
+    }
+
+    /*
+    Copy everything that changed in chunks since the last upload into the
+    voxel buffer, on the transfer queue. The copy waits for frames already
+    submitted to stop reading the bricks it overwrites, and the next frame
+    waits for the copy, so the map, tables, bricks and occupancy of a new chunk all
+    become visible together.
+    */
+    void uploadVoxelChanges() {
+        std::vector<VoxelBufferRegion> regions = chunks->takeDirtyRegions();
+        if (regions.empty()) {
+            return;
+        }
+        std::vector<VkBufferCopy> copyRegions(regions.size());
+        VkDeviceSize stagingSize = 0;
+        for (size_t i = 0; i < regions.size(); i++) {
+            copyRegions[i].srcOffset = stagingSize;
+            copyRegions[i].dstOffset = regions[i].offset;
+            copyRegions[i].size = regions[i].size;
+            stagingSize += regions[i].size;
+        }
+
+        UploadManager::Staging staging = voxelUploads.stage(stagingSize);
+        char* data = static_cast<char*>(staging.data);
+        for (size_t i = 0; i < regions.size(); i++) {
+            chunks->copyRegion(regions[i], data + copyRegions[i].srcOffset);
+            copyRegions[i].srcOffset += staging.offset;
+        }
+
+        /* No barriers needed, the semaphores on either side order the copy against the compute passes */
+        vkCmdCopyBuffer(voxelUploads.commandBuffer(), staging.buffer, voxelBuffer, static_cast<uint32_t>(copyRegions.size()),
+                        copyRegions.data());
+        uploadTimelineValue++;
+        voxelUploads.submit({frameTimeline, frameTimelineValue}, {uploadTimeline, uploadTimelineValue});
+    }
+
+    /* Called once per frame, never blocks */
+    void updateChunks() {
+        PROFILE_FUNCTION();
+        glm::ivec2 playerChunk = chunkContaining(camera.position);
+        if (playerChunk.x != lastUpdatePlayerChunk.x ||
+            playerChunk.y != lastUpdatePlayerChunk.y) {
+            loadNewChunks(playerChunk.x - lastUpdatePlayerChunk.x, playerChunk.y - lastUpdatePlayerChunk.y);
+        }
+        storeFinishedChunks();
+        uploadVoxelChanges();
+        voxelUploads.collect();
+        uploads.collect();
+    }
+
+    /*
+    Load the new chunks into memory when the player moves.
+    directionX = -1 if player moved in the negative x direction
+                  0 if player did not change x coord
+                  1 if player moved in positive x direction
+                  etc.
+
+    Chunk slots are a ring buffer, so whatever the direction (or distance,
+    e.g. after setpos) only the chunks that came into range are generated
+    and uploaded. Chunks that stay loaded are never moved. Until a new chunk
+    has been generated and uploaded its slot is rendered as empty.
+    */
+    void loadNewChunks(int directionX, int directionY) {
+        std::cout << "Player moved in the " << directionX << ", " << directionY << " direction." << std::endl;
+        lastUpdatePlayerChunk += glm::ivec2(directionX, directionY);
+        requestChunksAround(lastUpdatePlayerChunk);
+    }
+
+    void createDescriptorSets() {
+        std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptorSetLayout);
+        VkDescriptorSetAllocateInfo allocInfo {};
         allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
         allocInfo.descriptorPool = descriptorPool;
         allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
@@ -1629,16 +2132,15 @@ private:
         VkDeviceSize bufferSize = sizeof(UniformBufferObject);
 
         uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-        uniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        uniformBuffersAllocations.resize(MAX_FRAMES_IN_FLIGHT);
         uniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i],
-                         uniformBuffersMemory[i]);
-            vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0,
-                        &uniformBuffersMapped[i]);
+                         uniformBuffersAllocations[i]);
+            uniformBuffersMapped[i] = uniformBuffersAllocations[i].mapped;
         }
     }
 
@@ -1670,16 +2172,23 @@ private:
         }
     }
 
+    /* If sharedQueueFamilies has more than one family the buffer is shared between them without ownership transfers */
     void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                       VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                      VkDeviceMemory& bufferMemory) {
+                      DeviceAllocation& allocation, const std::vector<uint32_t>& sharedQueueFamilies = {}) {
 
         // Create the buffer
         VkBufferCreateInfo bufferInfo {};
         bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         bufferInfo.size = size;
         bufferInfo.usage = usage;
-        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (sharedQueueFamilies.size() > 1) {
+            bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(sharedQueueFamilies.size());
+            bufferInfo.pQueueFamilyIndices = sharedQueueFamilies.data();
+        } else {
+            bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        }
 
         if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
             throw std::runtime_error("failed to create vertex buffer!");
@@ -1689,219 +2198,128 @@ private:
         VkMemoryRequirements memRequirements;
         vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo {};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-                                                   properties);
+        allocation = deviceAllocator.allocate(memRequirements, findMemoryType(memRequirements.memoryTypeBits, properties),
+                                              false);
 
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate vertex buffer memory!");
-        }
+        vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+    }
 
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    void destroyBuffer(VkBuffer buffer, DeviceAllocation& allocation) {
+        vkDestroyBuffer(device, buffer, nullptr);
+        deviceAllocator.free(allocation);
     }
 
     // Type filter - bit field of suitable memory types
     // properties - bit field of required properties
     uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-
         // memoryHeaps - different memory resources (ex. dedicated VRAM, swap space
         // in RAM)
         // TODO this affects performance, but we don't consider it here
-
-        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-                return i;
-            }
-        }
-
-        throw std::runtime_error("failed to find suitable memory type!");
+        return deviceAllocator.findMemoryType(typeFilter, properties);
     }
 
-    // Optimization - use a separate command pool for temporary command buffers
+    /* Recorded into the open uploads batch, goes out with the next submitUploads */
     void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
         VkBufferCopy copyRegion {};
         copyRegion.srcOffset = 0;
         copyRegion.dstOffset = 0;
         copyRegion.size = size;
-        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+        vkCmdCopyBuffer(uploads.commandBuffer(), srcBuffer, dstBuffer, 1, &copyRegion);
+    }
 
-        endSingleTimeCommands(commandBuffer);
+    /* Make everything recorded into uploads so far visible to whatever reads it next, and submit it without waiting */
+    void submitUploads() {
+        VkMemoryBarrier barrier {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(uploads.commandBuffer(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+        uploads.submit();
     }
 
     void createVertexBuffer() {
         VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        // Fill the buffer with data
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-            memcpy(data, vertices.data(), (size_t) bufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-
         createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
                      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
-        copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferAllocation);
+        uploads.copyToBuffer(vertices.data(), bufferSize, vertexBuffer);
     }
 
-    void createFpsCounterBuffers() {
-        /* Font mesh */
-        renderedFpsCounter = getMeshForFpsCounter(lastFrameFps);
-        /* Vertex buffer */
-        VkDeviceSize bufferSize = sizeof(renderedFpsCounter.vert[0]) * renderedFpsCounter.vert.size();
-
-        VkBuffer vertexStagingBuffer;
-        VkDeviceMemory vertexStagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vertexStagingBuffer, vertexStagingBufferMemory);
-
-        // Fill the buffer with data
-        void* data;
-        vkMapMemory(device, vertexStagingBufferMemory, 0, bufferSize, 0, &data);
-            memcpy(data, renderedFpsCounter.vert.data(), (size_t) bufferSize);
-        vkUnmapMemory(device, vertexStagingBufferMemory);
-
-        createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, fpsCounterBuffer, fpsCounterMemory);
-        copyBuffer(vertexStagingBuffer, fpsCounterBuffer, bufferSize);
-
-        vkDestroyBuffer(device, vertexStagingBuffer, nullptr);
-        vkFreeMemory(device, vertexStagingBufferMemory, nullptr);
-        /* Index buffer */
-        VkDeviceSize indexBufferSize = sizeof(renderedFpsCounter.ind[0]) * renderedFpsCounter.ind.size();
-
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(indexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        // Fill the buffer with data
-        //void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, indexBufferSize, 0, &data);
-            memcpy(data, renderedFpsCounter.ind.data(), (size_t) indexBufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-
-        createBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, fpsCounterIndexBuffer, fpsCounterIndexMemory);
-        copyBuffer(stagingBuffer, fpsCounterIndexBuffer, indexBufferSize);
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+    void createOverlayBuffer() {
+        createBuffer(overlayRegionSize * MAX_FRAMES_IN_FLIGHT,
+                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     overlayBuffer, overlayBufferAllocation);
+        overlayBufferMapped = static_cast<uint8_t*>(overlayBufferAllocation.mapped);
     }
 
-    void recreateFpsBuffers() {
-        vkDeviceWaitIdle(device);
-
-        vkDestroyBuffer(device, fpsCounterBuffer, nullptr);
-        vkFreeMemory(device, fpsCounterMemory, nullptr);
-
-        vkDestroyBuffer(device, fpsCounterIndexBuffer, nullptr);
-        vkFreeMemory(device, fpsCounterIndexMemory, nullptr);
+    /* Copies size bytes into the current frame's region, returns where they went in overlayBuffer */
+    VkDeviceSize writeOverlayData(const void* data, VkDeviceSize size) {
+        /* Vertices are floats and indices uint16_t, so this suits both */
+        const VkDeviceSize offset = (overlayRegionUsed + 15) & ~VkDeviceSize(15);
+        if (offset + size > overlayRegionSize) {
+            throw std::runtime_error("overlay meshes don't fit in their buffer region!");
+        }
+        overlayRegionUsed = offset + size;
 
-        createFpsCounterBuffers();
+        const VkDeviceSize bufferOffset = VkDeviceSize(currentFrame) * overlayRegionSize + offset;
+        memcpy(overlayBufferMapped + bufferOffset, data, size_t(size));
+        return bufferOffset;
     }
 
-    void createTextBuffers() {
-        /* Font mesh */
-        renderedFont = getMeshForConsole();
-        /* Vertex buffer */
-        VkDeviceSize bufferSize = sizeof(renderedFont.vert[0]) * renderedFont.vert.size();
-
-        VkBuffer vertexStagingBuffer;
-        VkDeviceMemory vertexStagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vertexStagingBuffer, vertexStagingBufferMemory);
-
-        // Fill the buffer with data
-        void* data;
-        vkMapMemory(device, vertexStagingBufferMemory, 0, bufferSize, 0, &data);
-            memcpy(data, renderedFont.vert.data(), (size_t) bufferSize);
-        vkUnmapMemory(device, vertexStagingBufferMemory);
-
-        createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textBuffer, textBufferMemory);
-        copyBuffer(vertexStagingBuffer, textBuffer, bufferSize);
-
-        vkDestroyBuffer(device, vertexStagingBuffer, nullptr);
-        vkFreeMemory(device, vertexStagingBufferMemory, nullptr);
-        /* Index buffer */
-        VkDeviceSize indexBufferSize = sizeof(renderedFont.ind[0]) * renderedFont.ind.size();
-
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(indexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        // Fill the buffer with data
-        //void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, indexBufferSize, 0, &data);
-            memcpy(data, renderedFont.ind.data(), (size_t) indexBufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-
-        createBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
-                     VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textIndexBuffer, textIndexBufferMemory);
-        copyBuffer(stagingBuffer, textIndexBuffer, indexBufferSize);
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+    OverlayDraw writeOverlayMesh(const FontMesh& mesh) {
+        OverlayDraw draw;
+        draw.vertexOffset = writeOverlayData(mesh.vert.data(), sizeof(mesh.vert[0]) * mesh.vert.size());
+        draw.indexOffset = writeOverlayData(mesh.ind.data(), sizeof(mesh.ind[0]) * mesh.ind.size());
+        draw.indexCount = static_cast<uint32_t>(mesh.ind.size());
+        return draw;
     }
 
-    void recreateTextBuffers() {
-        vkDeviceWaitIdle(device);
-
-        vkDestroyBuffer(device, textBuffer, nullptr);
-        vkFreeMemory(device, textBufferMemory, nullptr);
+    /*
+    Refills the current frame's region of overlayBuffer. Must be called after
+    that frame's fence has signaled, since the GPU may still be reading it
+    until then. The console mesh is only rebuilt when its text changes, and
+    the meshes keep their capacity so this doesn't allocate either.
+    */
+    void updateOverlayMeshes() {
+        PROFILE_FUNCTION();
+        overlayRegionUsed = 0;
+        if (!console.latestTextRendered()) {
+            getMeshForConsole(renderedFont);
+            console.setRenderedText();
+        }
+        if (console.isEnabled()) {
+            consoleDraw = writeOverlayMesh(renderedFont);
+        }
+        if (fpsCounterEnabled) {
+            getMeshForFpsCounter(renderedFpsCounter, lastFrameFps);
+            fpsCounterDraw = writeOverlayMesh(renderedFpsCounter);
+        }
+    }
 
-        vkDestroyBuffer(device, textIndexBuffer, nullptr);
-        vkFreeMemory(device, textIndexBufferMemory, nullptr);
+    void recordOverlayDraw(VkCommandBuffer commandBuffer, const OverlayDraw& draw) {
+        VkBuffer overlayBuffers[] = {overlayBuffer};
+        VkDeviceSize overlayOffsets[] = {draw.vertexOffset};
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, overlayBuffers, overlayOffsets);
 
-        createTextBuffers();
+        vkCmdBindIndexBuffer(commandBuffer, overlayBuffer, draw.indexOffset, VK_INDEX_TYPE_UINT16);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 0, 1, &fontDescriptorSets[currentFrame], 0,
+                                nullptr);
+        vkCmdDrawIndexed(commandBuffer, draw.indexCount, 1, 0, 0, 0);
     }
 
     void createIndexBuffer() {
         VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-        // Fill the buffer with data
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-            memcpy(data, indices.data(), (size_t) bufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-
         createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
                      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
-        copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferAllocation);
+        uploads.copyToBuffer(indices.data(), bufferSize, indexBuffer);
     }
 
     void cleanupSwapChain() {
@@ -1909,10 +2327,7 @@ private:
             vkDestroyImageView(device, renderImageViews[i], nullptr);
         }
         for (size_t i = 0; i < renderImages.size(); i++) {
-            vkDestroyImage(device, renderImages[i], nullptr);
-        }
-        for (size_t i = 0; i < renderImagesMemory.size(); i++) {
-            vkFreeMemory(device, renderImagesMemory[i], nullptr);
+            destroyImage(renderImages[i], renderImagesAllocations[i]);
         }
         for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
             vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
@@ -1920,7 +2335,9 @@ private:
         for (size_t i = 0; i < swapChainImageViews.size(); i++) {
             vkDestroyImageView(device, swapChainImageViews[i], nullptr);
         }
-        vkDestroySwapchainKHR(device, swapChain, nullptr);
+        if (!headless) {
+            vkDestroySwapchainKHR(device, swapChain, nullptr);
+        }
     }
 
     void recreateSwapChain() {
@@ -1949,6 +2366,7 @@ private:
         createFramebuffers();
         createRenderImages();
         createRenderImageViews();
+        submitUploads();
         updateDescriptorSets();
         updateComputeDescriptorSets();
     }
@@ -1982,7 +2400,10 @@ private:
         }
     }
 
-    void recordComputeCommandBuffer(VkCommandBuffer commandBuffer, uint32_t renderImageIndex) {
+    /* If readbackBuffer is given, the frame's render image is copied into it once the dispatch is done */
+    void recordComputeCommandBuffer(VkCommandBuffer commandBuffer, uint32_t renderImageIndex,
+                                    VkBuffer readbackBuffer = VK_NULL_HANDLE) {
+        PROFILE_FUNCTION();
         VkCommandBufferBeginInfo beginInfo {};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
@@ -1990,6 +2411,20 @@ private:
             throw std::runtime_error("failed to begin recording compute command buffer!");
         }
 
+        /* Recorded after the chunks were uploaded, and this frame waits for the upload */
+        if (!pendingDistanceChunks.empty()) {
+            std::vector<glm::ivec2> targets;
+            for (const glm::ivec2& chunk : pendingDistanceChunks) {
+                if (chunks->isLoaded(chunk.x, chunk.y)) {
+                    targets.push_back(chunk);
+                }
+            }
+            recordVoxelDistances(commandBuffer, currentFrame, targets);
+            pendingDistanceChunks.clear();
+        }
+
+        gpuProfiler.begin(commandBuffer, currentFrame, GPUProfiler::Raytrace);
+
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout,
                                 0, 1, &computeDescriptorSets[currentFrame], 0, nullptr);
@@ -1997,12 +2432,67 @@ private:
                            0, sizeof(Camera), &camera);
         vkCmdDispatch(commandBuffer, ((swapChainExtent.width / RENDER_SCALE) + 31) / 32, ((swapChainExtent.height / RENDER_SCALE) + 31) / 32, 1);
 
+        gpuProfiler.end(commandBuffer, currentFrame, GPUProfiler::Raytrace);
+
+        if (readbackBuffer != VK_NULL_HANDLE) {
+            recordRenderImageReadback(commandBuffer, readbackBuffer);
+        }
+
         if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
             throw std::runtime_error("failed to record command buffer!");
         }
     }
 
+    /* Copies this frame's render image, which stays in the general layout, into a host visible buffer */
+    void recordRenderImageReadback(VkCommandBuffer commandBuffer, VkBuffer readbackBuffer) {
+        VkImageMemoryBarrier barrier {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = renderImages[currentFrame];
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkBufferImageCopy region {};
+        region.bufferOffset = 0;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {swapChainExtent.width / RENDER_SCALE, swapChainExtent.height / RENDER_SCALE, 1};
+
+        vkCmdCopyImageToBuffer(commandBuffer, renderImages[currentFrame], VK_IMAGE_LAYOUT_GENERAL,
+                               readbackBuffer, 1, &region);
+
+        VkBufferMemoryBarrier hostBarrier {};
+        hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        hostBarrier.buffer = readbackBuffer;
+        hostBarrier.offset = 0;
+        hostBarrier.size = VK_WHOLE_SIZE;
+
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                             0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+    }
+
     void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+        PROFILE_FUNCTION();
         VkCommandBufferBeginInfo beginInfo {};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         beginInfo.flags = 0; // Optional
@@ -2025,6 +2515,7 @@ private:
         renderPassInfo.clearValueCount = 1;
         renderPassInfo.pClearValues = &clearColor;
 
+        gpuProfiler.begin(commandBuffer, currentFrame, GPUProfiler::Blit);
         vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
@@ -2057,30 +2548,15 @@ private:
 
         /* Font rendering */
         if (console.isEnabled()) {
-            VkBuffer textVertexBuffers[] = {textBuffer};
-            VkDeviceSize textOffsets[] = {0};
-            vkCmdBindVertexBuffers(commandBuffer, 0, 1, textVertexBuffers, textOffsets);
-
-            vkCmdBindIndexBuffer(commandBuffer, textIndexBuffer, 0, VK_INDEX_TYPE_UINT16);
-            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    pipelineLayout, 0, 1, &fontDescriptorSets[currentFrame], 0,
-                                    nullptr);
-            vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(renderedFont.ind.size()), 1, 0, 0, 0);
+            recordOverlayDraw(commandBuffer, consoleDraw);
         }
 
         if (fpsCounterEnabled) {
-            VkBuffer textVertexBuffers[] = {fpsCounterBuffer};
-            VkDeviceSize textOffsets[] = {0};
-            vkCmdBindVertexBuffers(commandBuffer, 0, 1, textVertexBuffers, textOffsets);
-
-            vkCmdBindIndexBuffer(commandBuffer, fpsCounterIndexBuffer, 0, VK_INDEX_TYPE_UINT16);
-            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    pipelineLayout, 0, 1, &fontDescriptorSets[currentFrame], 0,
-                                    nullptr);
-            vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(renderedFpsCounter.ind.size()), 1, 0, 0, 0);
+            recordOverlayDraw(commandBuffer, fpsCounterDraw);
         }
 
         vkCmdEndRenderPass(commandBuffer);
+        gpuProfiler.end(commandBuffer, currentFrame, GPUProfiler::Blit);
 
         if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
             throw std::runtime_error("failed to record command buffer!");
@@ -2482,11 +2958,27 @@ private:
         }
     }
 
+    /*
+    Stands in for createSwapChain in headless mode. Only the extent matters,
+    the render pass and graphics pipeline are still created with this format
+    but never used.
+    */
+    void createHeadlessTarget() {
+        swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+        swapChainExtent = {WIDTH, HEIGHT};
+        fontRenderer.updateResolution(swapChainExtent.width, swapChainExtent.height);
+    }
+
+    const std::vector<const char*>& requiredDeviceExtensions() {
+        return headless ? headlessDeviceExtensions : deviceExtensions;
+    }
+
     void createLogicalDevice() {
         QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
         std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-        std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsAndComputeFamily.value(), indices.presentFamily.value()};
+        std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsAndComputeFamily.value(), indices.presentFamily.value(),
+                                                  indices.transferFamily.value()};
 
         float queuePriority = 1.0f;
         for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -2507,8 +2999,9 @@ private:
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
         createInfo.pEnabledFeatures = &deviceFeatures;
 
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        const std::vector<const char*>& extensions = requiredDeviceExtensions();
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+        createInfo.ppEnabledExtensionNames = extensions.data();
 
         if (enableValidationLayers) {
             createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -2523,6 +3016,8 @@ private:
         enable8BitStorage.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
         enable8BitStorage.uniformAndStorageBuffer8BitAccess = VK_TRUE;
         enable8BitStorage.shaderInt8 = VK_TRUE;
+        /* For chunk uploads */
+        enable8BitStorage.timelineSemaphore = VK_TRUE;
 
         createInfo.pNext = &enable8BitStorage;
 
@@ -2533,6 +3028,7 @@ private:
         vkGetDeviceQueue(device, indices.graphicsAndComputeFamily.value(), 0, &graphicsQueue);
         vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
         vkGetDeviceQueue(device, indices.graphicsAndComputeFamily.value(), 0, &computeQueue);
+        vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
     }
 
     void pickPhysicalDevice() {
@@ -2566,6 +3062,8 @@ private:
     struct QueueFamilyIndices {
         std::optional<uint32_t> graphicsAndComputeFamily;
         std::optional<uint32_t> presentFamily;
+        /* A transfer only family if there is one, otherwise graphicsAndComputeFamily */
+        std::optional<uint32_t> transferFamily;
 
         bool isComplete() {
             return graphicsAndComputeFamily.has_value() && presentFamily.has_value();
@@ -2584,22 +3082,35 @@ private:
         int i = 0;
         for (const auto& queueFamily : queueFamilies) {
             if ((queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
-                (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+                (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+                !indices.graphicsAndComputeFamily.has_value()) {
                 indices.graphicsAndComputeFamily = i;
             }
 
             VkBool32 presentSupport = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-            if (presentSupport) {
+            if (!headless) {
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+            }
+            if (presentSupport && !indices.presentFamily.has_value()) {
                 indices.presentFamily = i;
             }
 
-            if (indices.isComplete()) {
-                break;
+            /* Dedicated transfer families are usually backed by DMA engines that run alongside rendering */
+            if ((queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+                !(queueFamily.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+                !indices.transferFamily.has_value()) {
+                indices.transferFamily = i;
             }
 
             i++;
         }
+        if (!indices.transferFamily.has_value()) {
+            indices.transferFamily = indices.graphicsAndComputeFamily;
+        }
+        /* Nothing is presented, so the present queue is just another handle to the compute queue */
+        if (headless) {
+            indices.presentFamily = indices.graphicsAndComputeFamily;
+        }
 
         return indices;
     }
@@ -2609,17 +3120,21 @@ private:
 
         bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-        bool swapChainAdequate = false;
-        if (extensionsSupported) {
+        bool swapChainAdequate = headless;
+        if (extensionsSupported && !headless) {
             SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
             swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
         }
 
-        VkPhysicalDeviceFeatures supportedFeatures;
-        vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
+        VkPhysicalDeviceVulkan12Features supportedFeatures12 {};
+        supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        VkPhysicalDeviceFeatures2 supportedFeatures {};
+        supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        supportedFeatures.pNext = &supportedFeatures12;
+        vkGetPhysicalDeviceFeatures2(device, &supportedFeatures);
 
         return indices.isComplete() && extensionsSupported && swapChainAdequate &&
-                supportedFeatures.samplerAnisotropy;
+                supportedFeatures.features.samplerAnisotropy && supportedFeatures12.timelineSemaphore;
         /*
         VkPhysicalDeviceProperties deviceProperties;
         VkPhysicalDeviceFeatures deviceFeatures;
@@ -2633,11 +3148,14 @@ private:
     }
 
     std::vector<const char*> getRequiredExtensions() {
-        uint32_t glfwExtensionCount = 0;
-        const char** glfwExtensions;
-        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-        std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+        std::vector<const char*> extensions;
+        /* GLFW isn't initialized in headless mode, and no surface extensions are needed */
+        if (!headless) {
+            uint32_t glfwExtensionCount = 0;
+            const char** glfwExtensions;
+            glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+            extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+        }
 
         if (enableValidationLayers) {
             extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -2652,7 +3170,8 @@ private:
         std::vector<VkExtensionProperties> availableExtensions(extensionCount);
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-        std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        const std::vector<const char*>& required = requiredDeviceExtensions();
+        std::set<std::string> requiredExtensions(required.begin(), required.end());
 
         for (const auto& extension : availableExtensions) {
             requiredExtensions.erase(extension.extensionName);
@@ -2806,7 +3325,11 @@ private:
         lastFrameStart = std::chrono::high_resolution_clock::now();
         double timeSpentRendering = 0.0;
         while (!glfwWindowShouldClose(window) && !shouldQuit) {
-            glfwPollEvents();
+            PROFILE_ZONE("frame");
+            {
+                PROFILE_ZONE("pollEvents");
+                glfwPollEvents();
+            }
             /** Avoid putting syscalls here - they seem to break the timer **/
             const auto start = std::chrono::high_resolution_clock::now();
             drawFrame();
@@ -2814,32 +3337,236 @@ private:
             const auto end_time = std::chrono::high_resolution_clock::now();
             const float frameTime = std::chrono::duration<float, std::chrono::seconds::period>(end_time - start).count();
             lastFrameFps = 1 / frameTime;
+            timeSpentRendering += frameTime;
         }
         std::cout << "Frames rendered: " << frameCounter << std::endl;
         std::cout << "Time taken: " << timeSpentRendering << std::endl;
         std::cout << "Avg FPS: " << 1 / (timeSpentRendering / double(frameCounter)) << std::endl;
 
+        stopGenerating = true;
         vkDeviceWaitIdle(device);
     }
 
-    void drawFrame() {
-        if (!console.latestTextRendered()) {
-            recreateTextBuffers();
-            console.setRenderedText();
+    /*
+    Renders headlessFrames compute passes one at a time, waiting for each so
+    its GPU time (from timestamps around the dispatch) and image can be read
+    back. The graphics pass only blits the render image to the swapchain, so
+    it's skipped along with everything else that needs a window.
+    */
+    void headlessLoop() {
+        const uint32_t width = swapChainExtent.width / RENDER_SCALE;
+        const uint32_t height = swapChainExtent.height / RENDER_SCALE;
+        const VkDeviceSize imageSize = VkDeviceSize(width) * height * 4;
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (!gpuProfiler.enabled()) {
+            std::cout << "Compute queue doesn't support timestamps, only CPU times will be printed." << std::endl;
         }
-        if (fpsCounterEnabled) {
-            recreateFpsBuffers();
+
+        VkBuffer readbackBuffer = VK_NULL_HANDLE;
+        DeviceAllocation readbackAllocation;
+        if (!headlessOutputPrefix.empty() || compareWithCpu) {
+            createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         readbackBuffer, readbackAllocation);
+        }
+
+        std::cout << "Rendering " << headlessFrames << " frames at " << width << "x" << height << " on "
+                  << properties.deviceName << std::endl;
+
+        updateCameraVectors();
+        std::vector<double> gpuTimes;
+        std::vector<double> cpuTimes;
+        for (int frame = 0; frame < headlessFrames; frame++) {
+            PROFILE_ZONE("frame");
+            const auto start = std::chrono::high_resolution_clock::now();
+            camera.cur_time = float(frame) * headlessFrameTime;
+            updateSunDirection();
+
+            vkResetFences(device, 1, &inFlightFences[currentFrame]);
+            vkResetCommandBuffer(computeCommandBuffers[currentFrame], 0);
+            recordComputeCommandBuffer(computeCommandBuffers[currentFrame], 0, readbackBuffer);
+
+            VkSubmitInfo submitInfo {};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+            /* Same timeline handshake with voxel uploads as drawFrame */
+            VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+            uint64_t signalValue = ++frameTimelineValue;
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &uploadTimeline;
+            submitInfo.pWaitDstStageMask = &waitStage;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &computeCommandBuffers[currentFrame];
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &frameTimeline;
+
+            VkTimelineSemaphoreSubmitInfo timelineInfo {};
+            timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+            timelineInfo.waitSemaphoreValueCount = 1;
+            timelineInfo.pWaitSemaphoreValues = &uploadTimelineValue;
+            timelineInfo.signalSemaphoreValueCount = 1;
+            timelineInfo.pSignalSemaphoreValues = &signalValue;
+            submitInfo.pNext = &timelineInfo;
+
+            VkResult result;
+            if ((result = vkQueueSubmit(computeQueue, 1, &submitInfo, inFlightFences[currentFrame])) != VK_SUCCESS) {
+                std::cerr << string_VkResult(result) << std::endl;
+                throw std::runtime_error("failed to submit compute command buffer!");
+            }
+            vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+
+            const auto end = std::chrono::high_resolution_clock::now();
+            const double cpuMs = std::chrono::duration<double, std::milli>(end - start).count();
+            cpuTimes.push_back(cpuMs);
+
+            gpuProfiler.collect(currentFrame, frameCounter);
+            if (gpuProfiler.enabled()) {
+                const double gpuMs = gpuProfiler.latest(GPUProfiler::Raytrace);
+                gpuTimes.push_back(gpuMs);
+                printf("Frame %d: %.3f ms GPU, %.3f ms CPU\n", frame, gpuMs, cpuMs);
+            } else {
+                printf("Frame %d: %.3f ms CPU\n", frame, cpuMs);
+            }
+
+            if (!headlessOutputPrefix.empty()) {
+                char filename[32];
+                snprintf(filename, sizeof(filename), "_%04d.ppm", frame);
+                writePPM(headlessOutputPrefix + filename, static_cast<const uint8_t*>(readbackAllocation.mapped), width, height);
+            }
+            if (compareWithCpu) {
+                compareFrameWithCpu(frame, static_cast<const uint8_t*>(readbackAllocation.mapped), width, height);
+            }
+
+            updateChunks();
+            frameCounter++;
+            currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        }
+
+        printFrameTimeSummary("GPU", gpuTimes);
+        printFrameTimeSummary("CPU", cpuTimes);
+
+        stopGenerating = true;
+        vkDeviceWaitIdle(device);
+
+        if (readbackBuffer != VK_NULL_HANDLE) {
+            destroyBuffer(readbackBuffer, readbackAllocation);
+        }
+    }
+
+    CPURenderer::Settings cpuRenderSettings() const {
+        CPURenderer::Settings settings;
+        settings.samples = shaderConstants.samples;
+        settings.maxSteps = shaderConstants.maxSteps;
+        settings.maxBounces = shaderConstants.maxBounces;
+        return settings;
+    }
+
+    /* Like headlessLoop, but on CPURenderer at the size the render image would have with a window */
+    void cpuRenderLoop() {
+        loadStartupChunks();
+        const uint32_t width = WIDTH / RENDER_SCALE;
+        const uint32_t height = HEIGHT / RENDER_SCALE;
+        std::vector<uint8_t> pixels(size_t(width) * height * 4);
+        const CPURenderer renderer(*chunks, cpuRenderSettings());
+
+        std::cout << "Rendering " << cpuRenderFrames << " frames at " << width << "x" << height << " on "
+                  << generatorPool.size() << " CPU threads" << std::endl;
+
+        updateCameraVectors();
+        std::vector<double> cpuTimes;
+        for (int frame = 0; frame < cpuRenderFrames; frame++) {
+            PROFILE_ZONE("frame");
+            const auto start = std::chrono::high_resolution_clock::now();
+            camera.cur_time = float(frame) * headlessFrameTime;
+            updateSunDirection();
+            renderer.render(camera, width, height, pixels.data(), &generatorPool);
+            const auto end = std::chrono::high_resolution_clock::now();
+            const double cpuMs = std::chrono::duration<double, std::milli>(end - start).count();
+            cpuTimes.push_back(cpuMs);
+            printf("Frame %d: %.3f ms CPU\n", frame, cpuMs);
+
+            if (!headlessOutputPrefix.empty()) {
+                char filename[32];
+                snprintf(filename, sizeof(filename), "_%04d.ppm", frame);
+                writePPM(headlessOutputPrefix + filename, pixels.data(), width, height);
+            }
+        }
+        printFrameTimeSummary("CPU", cpuTimes);
+
+        stopGenerating = true;
+        generatorPool.waitIdle();
+        if (CPUProfiler::enabled) {
+            size_t events = CPUProfiler::writeChromeTrace(cpuTraceFile);
+            std::cout << "Wrote " << events << " CPU profiler events to " << cpuTraceFile << std::endl;
+        }
+    }
+
+    void rayBench() {
+        loadStartupChunks();
+        std::cout << "Tracing " << rayBenchRays << " rays with each traversal" << std::endl;
+        CPURenderer::benchmarkTraversal(*chunks, camera.position, rayBenchRays, WorldGenerator::getSeed());
+        std::cout << "Tracing " << rayBenchRays << " rays and a frame in each direction" << std::endl;
+        CPURenderer::benchmarkDirections(*chunks, camera.position, rayBenchRays, WorldGenerator::getSeed(),
+                                         WIDTH / RENDER_SCALE, HEIGHT / RENDER_SCALE);
+        stopGenerating = true;
+        generatorPool.waitIdle();
+    }
+
+    /* Render the frame the GPU just did with CPURenderer and print how far apart they are */
+    void compareFrameWithCpu(int frame, const uint8_t* gpuPixels, uint32_t width, uint32_t height) {
+        std::vector<uint8_t> cpuPixels(size_t(width) * height * 4);
+        const auto start = std::chrono::high_resolution_clock::now();
+        CPURenderer(*chunks, cpuRenderSettings()).render(camera, width, height, cpuPixels.data(), &generatorPool);
+        const auto end = std::chrono::high_resolution_clock::now();
+
+        const CPURenderer::Difference difference = CPURenderer::compareImages(gpuPixels, cpuPixels.data(), width, height,
+                                                                              cpuCompareTolerance);
+        printf("Frame %d on the CPU: %.3f ms, mean error %.3f, %zu / %zu pixels off by more than %d (%.2f%%)\n",
+               frame, std::chrono::duration<double, std::milli>(end - start).count(), difference.meanError,
+               difference.pixelsOver, difference.pixels, cpuCompareTolerance,
+               100.0 * double(difference.pixelsOver) / double(difference.pixels));
+        if (!headlessOutputPrefix.empty()) {
+            char filename[32];
+            snprintf(filename, sizeof(filename), "_%04d_cpu.ppm", frame);
+            writePPM(headlessOutputPrefix + filename, cpuPixels.data(), width, height);
+        }
+    }
+
+    static void printFrameTimeSummary(const char* label, std::vector<double> times) {
+        if (times.empty()) {
+            return;
+        }
+        std::sort(times.begin(), times.end());
+        double total = 0.0;
+        for (double t : times) {
+            total += t;
         }
+        printf("%s frame time over %zu frames: min %.3f ms, median %.3f ms, mean %.3f ms, max %.3f ms\n",
+               label, times.size(), times.front(), times[times.size() / 2], total / double(times.size()), times.back());
+    }
 
+    void drawFrame() {
+        PROFILE_FUNCTION();
         auto currentTime = std::chrono::high_resolution_clock::now();
         float deltaTime = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - lastFrameStart).count();
         camera.cur_time += deltaTime;
         lastFrameStart = std::chrono::high_resolution_clock::now();
-        vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        {
+            PROFILE_ZONE("waitForFrameFence");
+            vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        }
+        /* This slot's previous frame is done, both passes included since graphics waits on compute */
+        gpuProfiler.collect(currentFrame, frameCounter);
         uint32_t imageIndex;
-        VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
-                              imageAvailableSemaphores[currentFrame],
-                              VK_NULL_HANDLE, &imageIndex);
+        VkResult result;
+        {
+            PROFILE_ZONE("acquireNextImage");
+            result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
+                                           imageAvailableSemaphores[currentFrame],
+                                           VK_NULL_HANDLE, &imageIndex);
+        }
 
         if (result == VK_ERROR_OUT_OF_DATE_KHR) {
             recreateSwapChain();
@@ -2852,63 +3579,10 @@ private:
             throw std::runtime_error("Failed to reset fence!");
         }
 
-        /* Update camera */
-        cursorLastX = cursorX;
-        cursorLastY = cursorY;
-        glfwGetCursorPos(window, &cursorX, &cursorY);
-        double cursorDeltaX = cursorX - cursorLastX;
-        double cursorDeltaY = cursorY - cursorLastY;
-        // Normalize for DPI ?
-        cursorDeltaX /= double(swapChainExtent.width);
-        cursorDeltaY /= double(swapChainExtent.height);
-        cursorDeltaX *= sensitivity;
-        cursorDeltaY *= sensitivity;
-
-        /* Gravity */
-        /*
-        if (camera.position.z > 1.8f) {
-            camera.position.z -= 9.8f * deltaTime;
-        }
-        if (camera.position.z < 1.8f) {
-            camera.position.z = 1.8f;
-        }
-        */
-
-        /* Camera rotation */
-        if (!console.isEnabled()) {
-            cameraRotY -= cursorDeltaY;
-            cameraRotZ += cursorDeltaX;
-
-            cameraRotY = glm::clamp(cameraRotY, minPitch, maxPitch);
-
-            camera.forward = glm::normalize(glm::vec3(glm::cos(cameraRotZ) * glm::cos(cameraRotY), glm::sin(cameraRotZ) * glm::cos(cameraRotY), glm::sin(cameraRotY)));
-            camera.up = glm::normalize(glm::vec3(glm::cos(cameraRotZ) * glm::cos(cameraRotY + glm::radians(90.0f)), glm::sin(cameraRotZ) * glm::cos(cameraRotY + glm::radians(90.0f)), glm::sin(cameraRotY + glm::radians(90.0f))));
-            camera.right = -glm::cross(camera.forward, camera.up);
+        updateOverlayMeshes();
 
-            //printf("Fwd: (%f, %f, %f)\n", camera.forward.x, camera.forward.y, camera.forward.z);
-            //printf("Up: (%f, %f, %f)\n", camera.up.x, camera.up.y, camera.up.z);
-            //printf("Right: (%f, %f, %f)\n", camera.right.x, camera.right.y, camera.right.z);
-
-            /* Camera position */
-            glm::vec3 moveDirection(0, 0, 0);
-            float moveSpeed = 1.0;
-            if (keyPressed[GLFW_KEY_W])
-                moveDirection += camera.forward;
-            if (keyPressed[GLFW_KEY_S])
-                moveDirection -= camera.forward;
-            if (keyPressed[GLFW_KEY_A])
-                moveDirection -= camera.right;
-            if (keyPressed[GLFW_KEY_D])
-                moveDirection += camera.right;
-            if (keyPressed[GLFW_KEY_LEFT_SHIFT])
-                moveSpeed = 10.0f;
-            //moveDirection.z = 0.0f;
-            camera.position += moveDirection * deltaTime * moveSpeed;
-            //std::cout << "Camera: " << camera.position.x << ", " << camera.position.y << ", " << camera.position.z << std::endl;
-            //std::cout << "Rot Z: " << cameraRotZ << " Rot Y: " << cameraRotY << std::endl;
-            //std::cout << "x: " << cursorDeltaX << " y: " << cursorDeltaY << std::endl;
-        }
-        camera.sunDirection = glm::normalize(glm::vec3(0.1 * glm::sin(camera.cur_time) + 1, 0.1 * glm::cos(camera.cur_time) + 1, 0.1 * glm::sin(camera.cur_time) - 1));
+        updateCamera(deltaTime);
+        updateSunDirection();
 
         /* Compute shader block */
         vkResetCommandBuffer(computeCommandBuffers[currentFrame], 0);
@@ -2917,20 +3591,35 @@ private:
         VkSubmitInfo computeSubmitInfo {};
         computeSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-        VkSemaphore computeWaitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-        VkPipelineStageFlags computeWaitStages[] = {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT};
-        computeSubmitInfo.waitSemaphoreCount = 1;
+        /* Also wait for the latest voxel upload, and tell uploads when this frame is done with the voxels */
+        VkSemaphore computeWaitSemaphores[] = {imageAvailableSemaphores[currentFrame], uploadTimeline};
+        VkPipelineStageFlags computeWaitStages[] = {VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT};
+        uint64_t computeWaitValues[] = {0, uploadTimelineValue};
+        computeSubmitInfo.waitSemaphoreCount = 2;
         computeSubmitInfo.pWaitSemaphores = computeWaitSemaphores;
         computeSubmitInfo.pWaitDstStageMask = computeWaitStages;
 
         computeSubmitInfo.commandBufferCount = 1;
         computeSubmitInfo.pCommandBuffers = &computeCommandBuffers[currentFrame];
 
-        VkSemaphore computeSignalSemaphores[] = {computeFinishedSemaphores[currentFrame]};
-        computeSubmitInfo.signalSemaphoreCount = 1;
+        VkSemaphore computeSignalSemaphores[] = {computeFinishedSemaphores[currentFrame], frameTimeline};
+        uint64_t computeSignalValues[] = {0, ++frameTimelineValue};
+        computeSubmitInfo.signalSemaphoreCount = 2;
         computeSubmitInfo.pSignalSemaphores = computeSignalSemaphores;
 
-        if ((result = vkQueueSubmit(computeQueue, 1, &computeSubmitInfo, VK_NULL_HANDLE)) != VK_SUCCESS) {
+        VkTimelineSemaphoreSubmitInfo computeTimelineInfo {};
+        computeTimelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        computeTimelineInfo.waitSemaphoreValueCount = 2;
+        computeTimelineInfo.pWaitSemaphoreValues = computeWaitValues;
+        computeTimelineInfo.signalSemaphoreValueCount = 2;
+        computeTimelineInfo.pSignalSemaphoreValues = computeSignalValues;
+        computeSubmitInfo.pNext = &computeTimelineInfo;
+
+        {
+            PROFILE_ZONE("submitCompute");
+            result = vkQueueSubmit(computeQueue, 1, &computeSubmitInfo, VK_NULL_HANDLE);
+        }
+        if (result != VK_SUCCESS) {
             std::cerr << string_VkResult(result) << std::endl;
             throw std::runtime_error("failed to submit compute command buffer!");
         }
@@ -2964,7 +3653,11 @@ private:
         submitInfo.signalSemaphoreCount = 1;
         submitInfo.pSignalSemaphores = signalSemaphores;
 
-        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
+        {
+            PROFILE_ZONE("submitGraphics");
+            result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]);
+        }
+        if (result != VK_SUCCESS) {
             throw std::runtime_error("failed to submit draw command buffer!");
         }
 
@@ -2981,7 +3674,10 @@ private:
         presentInfo.pImageIndices = &imageIndex;
         // Array of VkResults from presenting to the swapchain (optional)
         presentInfo.pResults = nullptr;
-        result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        {
+            PROFILE_ZONE("present");
+            result = vkQueuePresentKHR(presentQueue, &presentInfo);
+        }
 
         if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
             framebufferResized = false;
@@ -2991,6 +3687,75 @@ private:
         }
         //std::cout << "End frame " << currentFrame << std::endl;
         currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        frameCounter++;
+    }
+
+    /* Mouse look and movement */
+    void updateCamera(float deltaTime) {
+        PROFILE_FUNCTION();
+        cursorLastX = cursorX;
+        cursorLastY = cursorY;
+        glfwGetCursorPos(window, &cursorX, &cursorY);
+        double cursorDeltaX = cursorX - cursorLastX;
+        double cursorDeltaY = cursorY - cursorLastY;
+        // Normalize for DPI ?
+        cursorDeltaX /= double(swapChainExtent.width);
+        cursorDeltaY /= double(swapChainExtent.height);
+        cursorDeltaX *= sensitivity;
+        cursorDeltaY *= sensitivity;
+
+        /* Gravity */
+        /*
+        if (camera.position.z > 1.8f) {
+            camera.position.z -= 9.8f * deltaTime;
+        }
+        if (camera.position.z < 1.8f) {
+            camera.position.z = 1.8f;
+        }
+        */
+
+        /* Camera rotation */
+        if (!console.isEnabled()) {
+            cameraRotY -= cursorDeltaY;
+            cameraRotZ += cursorDeltaX;
+
+            cameraRotY = glm::clamp(cameraRotY, minPitch, maxPitch);
+
+            updateCameraVectors();
+
+            //printf("Fwd: (%f, %f, %f)\n", camera.forward.x, camera.forward.y, camera.forward.z);
+            //printf("Up: (%f, %f, %f)\n", camera.up.x, camera.up.y, camera.up.z);
+            //printf("Right: (%f, %f, %f)\n", camera.right.x, camera.right.y, camera.right.z);
+
+            /* Camera position */
+            glm::vec3 moveDirection(0, 0, 0);
+            float moveSpeed = 1.0;
+            if (keyPressed[GLFW_KEY_W])
+                moveDirection += camera.forward;
+            if (keyPressed[GLFW_KEY_S])
+                moveDirection -= camera.forward;
+            if (keyPressed[GLFW_KEY_A])
+                moveDirection -= camera.right;
+            if (keyPressed[GLFW_KEY_D])
+                moveDirection += camera.right;
+            if (keyPressed[GLFW_KEY_LEFT_SHIFT])
+                moveSpeed = 10.0f;
+            //moveDirection.z = 0.0f;
+            camera.position += moveDirection * deltaTime * moveSpeed;
+            //std::cout << "Camera: " << camera.position.x << ", " << camera.position.y << ", " << camera.position.z << std::endl;
+            //std::cout << "Rot Z: " << cameraRotZ << " Rot Y: " << cameraRotY << std::endl;
+            //std::cout << "x: " << cursorDeltaX << " y: " << cursorDeltaY << std::endl;
+        }
+    }
+
+    void updateCameraVectors() {
+        camera.forward = glm::normalize(glm::vec3(glm::cos(cameraRotZ) * glm::cos(cameraRotY), glm::sin(cameraRotZ) * glm::cos(cameraRotY), glm::sin(cameraRotY)));
+        camera.up = glm::normalize(glm::vec3(glm::cos(cameraRotZ) * glm::cos(cameraRotY + glm::radians(90.0f)), glm::sin(cameraRotZ) * glm::cos(cameraRotY + glm::radians(90.0f)), glm::sin(cameraRotY + glm::radians(90.0f))));
+        camera.right = -glm::cross(camera.forward, camera.up);
+    }
+
+    void updateSunDirection() {
+        camera.sunDirection = glm::normalize(glm::vec3(0.1 * glm::sin(camera.cur_time) + 1, 0.1 * glm::cos(camera.cur_time) + 1, 0.1 * glm::sin(camera.cur_time) - 1));
     }
 
     void updateUniformBuffer(uint32_t currentImage) {
@@ -3014,6 +3779,16 @@ private:
     }
 
     void cleanup() {
+        if (CPUProfiler::enabled) {
+            size_t events = CPUProfiler::writeChromeTrace(cpuTraceFile);
+            std::cout << "Wrote " << events << " CPU profiler events to " << cpuTraceFile << std::endl;
+        }
+        if (gpuProfiler.enabled()) {
+            gpuProfiler.writeCSV(gpuTimingsFile);
+            std::cout << "Wrote GPU timings to " << gpuTimingsFile << std::endl;
+        }
+        gpuProfiler.destroy();
+
         cleanupSwapChain();
 
         /* Clean up compute distances pipeline */
@@ -3022,12 +3797,12 @@ private:
 
         vkDestroyDescriptorPool(device, computeDistancesPool, nullptr);
         vkDestroyDescriptorSetLayout(device, computeDistancesSetLayout, nullptr);
+        destroyBuffer(distanceWindowBuffer, distanceWindowAllocation);
 
         /* Clean up compute pipeline and related structures */
         /*
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            vkDestroyBuffer(device, computeUniformBuffers[i], nullptr);
-            vkFreeMemory(device, computeUniformsMemory[i], nullptr);
+            destroyBuffer(computeUniformBuffers[i], computeUniformsAllocations[i]);
         }
         */
 
@@ -3040,40 +3815,22 @@ private:
         vkDestroySampler(device, fontSampler, nullptr);
         vkDestroyImageView(device, fontImageView, nullptr);
 
-        vkDestroyImage(device, fontImage, nullptr);
-        vkFreeMemory(device, fontImageMemory, nullptr);
+        destroyImage(fontImage, fontImageAllocation);
 
         vkDestroySampler(device, textureSampler, nullptr);
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            vkDestroyBuffer(device, uniformBuffers[i], nullptr);
-            vkFreeMemory(device, uniformBuffersMemory[i], nullptr);
-
-            vkDestroyBuffer(device, voxelBuffers[i], nullptr);
-            vkFreeMemory(device, voxelBuffersMemory[i], nullptr);
+            destroyBuffer(uniformBuffers[i], uniformBuffersAllocations[i]);
         }
+        destroyBuffer(voxelBuffer, voxelBufferAllocation);
 
         vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
         vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
-        vkDestroyBuffer(device, fpsCounterBuffer, nullptr);
-        vkFreeMemory(device, fpsCounterMemory, nullptr);
-
-        vkDestroyBuffer(device, fpsCounterIndexBuffer, nullptr);
-        vkFreeMemory(device, fpsCounterIndexMemory, nullptr);
-
-        vkDestroyBuffer(device, textBuffer, nullptr);
-        vkFreeMemory(device, textBufferMemory, nullptr);
-
-        vkDestroyBuffer(device, textIndexBuffer, nullptr);
-        vkFreeMemory(device, textIndexBufferMemory, nullptr);
-
-        vkDestroyBuffer(device, vertexBuffer, nullptr);
-        vkFreeMemory(device, vertexBufferMemory, nullptr);
-
-        vkDestroyBuffer(device, indexBuffer, nullptr);
-        vkFreeMemory(device, indexBufferMemory, nullptr);
+        destroyBuffer(overlayBuffer, overlayBufferAllocation);
+        destroyBuffer(vertexBuffer, vertexBufferAllocation);
+        destroyBuffer(indexBuffer, indexBufferAllocation);
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
@@ -3085,25 +3842,129 @@ private:
 
         vkDestroyCommandPool(device, commandPool, nullptr);
 
+        voxelUploads.destroy();
+        uploads.destroy();
+        vkDestroySemaphore(device, frameTimeline, nullptr);
+        vkDestroySemaphore(device, uploadTimeline, nullptr);
+
         vkDestroyPipeline(device, graphicsPipeline, nullptr);
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
         vkDestroyRenderPass(device, renderPass, nullptr);
+        deviceAllocator.destroy();
         vkDestroyDevice(device, nullptr);
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        if (!headless) {
+            vkDestroySurfaceKHR(instance, surface, nullptr);
+        }
 
         if (enableValidationLayers) {
             DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
         }
 
         vkDestroyInstance(instance, nullptr);
-        glfwDestroyWindow(window);
-        glfwTerminate();
+        if (!headless) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
     }
 };
 
-int main() {
+/* A whole decimal number of at least min with nothing after it, unlike atoi which takes "abc" or "-5" as well */
+static bool parseCount(const char* text, int min, int& result) {
+    char* end = nullptr;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || value < min || value > INT_MAX) {
+        return false;
+    }
+    result = int(value);
+    return true;
+}
+
+int main(int argc, char** argv) {
     std::cout << ANSI::escape("--------------------------------------------------------------------------------", BOLD, FG_DEFAULT) << std::endl;
+    uint32_t seed = std::random_device{}();
+    int headlessFrames = 0;
+    std::string outputPrefix;
+    ShaderConstants defaults;
+    int samples = defaults.samples;
+    int maxBounces = defaults.maxBounces;
+    bool gpuDistances = false;
+    int cpuFrames = 0;
+    bool compareWithCpu = false;
+    int rayBenchRays = 0;
+    auto usage = [&]() {
+        std::cerr << "Usage: " << argv[0] << " [--seed <n>] [--headless <frames> [--output <prefix>]] [--samples <n>] [--bounces <n>] [--gpu-distances]"
+                  << " [--cpu-render <frames> [--output <prefix>]] [--compare-cpu] [--ray-bench <rays>]" << std::endl;
+        std::cerr << "Frames, rays and samples are at least 1, bounces at least 0" << std::endl;
+        return EXIT_FAILURE;
+    };
+    for (int i = 1; i < argc; i++) {
+        bool valid = true;
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            char* end = nullptr;
+            seed = uint32_t(strtoul(argv[++i], &end, 10));
+            valid = end != argv[i] && *end == '\0';
+        } else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            valid = parseCount(argv[++i], 1, headlessFrames);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputPrefix = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            valid = parseCount(argv[++i], 1, samples);
+        } else if (strcmp(argv[i], "--bounces") == 0 && i + 1 < argc) {
+            valid = parseCount(argv[++i], 0, maxBounces);
+        } else if (strcmp(argv[i], "--gpu-distances") == 0) {
+            gpuDistances = true;
+        } else if (strcmp(argv[i], "--cpu-render") == 0 && i + 1 < argc) {
+            valid = parseCount(argv[++i], 1, cpuFrames);
+        } else if (strcmp(argv[i], "--compare-cpu") == 0) {
+            compareWithCpu = true;
+        } else if (strcmp(argv[i], "--ray-bench") == 0 && i + 1 < argc) {
+            valid = parseCount(argv[++i], 1, rayBenchRays);
+        } else {
+            std::cerr << "Unknown argument: " << argv[i] << std::endl;
+            return usage();
+        }
+        if (!valid) {
+            std::cerr << "Invalid value for " << argv[i - 1] << ": " << argv[i] << std::endl;
+            return usage();
+        }
+    }
+    /* Game::run only does one of these, the others would be silently ignored */
+    if ((headlessFrames > 0 ? 1 : 0) + (cpuFrames > 0 ? 1 : 0) + (rayBenchRays > 0 ? 1 : 0) > 1) {
+        std::cerr << "--headless, --cpu-render and --ray-bench can't be used together" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (compareWithCpu && (cpuFrames > 0 || rayBenchRays > 0)) {
+        std::cerr << "--compare-cpu can't be used with --cpu-render or --ray-bench" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!outputPrefix.empty() && headlessFrames <= 0 && cpuFrames <= 0) {
+        std::cerr << "--output needs --headless <frames> or --cpu-render <frames>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (compareWithCpu && headlessFrames <= 0) {
+        std::cerr << "--compare-cpu needs --headless <frames>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    /* CPURenderer reads LoadedChunks, which only has distances across chunk borders when they're stitched on the CPU */
+    if (gpuDistances && (cpuFrames > 0 || compareWithCpu || rayBenchRays > 0)) {
+        std::cerr << "--gpu-distances can't be used with --cpu-render, --compare-cpu or --ray-bench" << std::endl;
+        return EXIT_FAILURE;
+    }
+    WorldGenerator::setSeed(seed);
     Game app;
+    if (headlessFrames > 0) {
+        app.setHeadless(headlessFrames, outputPrefix);
+    }
+    if (cpuFrames > 0) {
+        app.setCpuRender(cpuFrames, outputPrefix);
+    }
+    if (rayBenchRays > 0) {
+        app.setRayBench(rayBenchRays);
+    }
+    app.setCompareWithCpu(compareWithCpu);
+    app.setRenderQuality(samples, maxBounces);
+    app.setGpuDistances(gpuDistances);
 
     try {
         app.run();
@@ -1,11 +1,32 @@
 #ifndef SDFCOMBINEOP_H
 #define SDFCOMBINEOP_H
 #include "sdf.h"
+#include "sdftape.h"
+#include "simd.h"
+#include <limits>
 
 class SDFCombineOp
 {
 public:
     virtual float combinedDist(float s1, float s2) = 0;
+    /* out[i] = combinedDist(s1[i], s2[i]), out may alias s1 or s2 */
+    virtual void combinedDist(const float* s1, const float* s2, float* out, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = combinedDist(s1[i], s2[i]);
+        }
+    }
+    /* Append an instruction combining two distance slots, see SDF::compile */
+    virtual int compile(SDFTape& tape, int s1, int s2) { return tape.emitBinary(SDFTape::CombineCall, s1, s2, this); }
+    /*
+    True if the result can only be <= 0 where this operand (0 for s1, 1 for s2)
+    is, or where the other one is and it's also true for that one, and while
+    this operand is > 0, changing it to any other value > 0 doesn't change the
+    result wherever that is <= 0. SDFChain relies on this to skip links outside
+    their bounds, see SDFChain::setCulling.
+    */
+    virtual bool ignoresOutside(int operand) { return false; }
+    /* Lipschitz bound of the result given ones for s1 and s2, see SDF::lipschitz */
+    virtual float lipschitz(float l1, float l2) { return std::numeric_limits<float>::infinity(); }
 };
 
 class SDFUnion : public SDFCombineOp
@@ -14,6 +35,19 @@ public:
     float combinedDist(float s1, float s2) {
         return glm::min(s1, s2);
     }
+    void combinedDist(const float* s1, const float* s2, float* out, size_t n) {
+        size_t i = 0;
+        for (; i + simd::width <= n; i += simd::width) {
+            simd::Float a = simd::load(s1 + i), b = simd::load(s2 + i);
+            simd::store(out + i, simd::min(a, b));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFUnion::combinedDist(s1[i], s2[i]);
+        }
+    }
+    int compile(SDFTape& tape, int s1, int s2) { return tape.emitBinary(SDFTape::Union, s1, s2, this); }
+    bool ignoresOutside(int operand) { return true; }
+    float lipschitz(float l1, float l2) { return glm::max(l1, l2); }
 };
 
 /*
@@ -29,9 +63,26 @@ public:
     ~SDFSmoothUnion() {}
 
     float combinedDist(float s1, float s2) {
-        float h = glm::clamp( 0.5 + 0.5*(s2-s1)/smoothAmount, 0.0, 1.0 );
-        return glm::mix( s2, s1, h ) - smoothAmount*h*(1.0-h);
+        float h = glm::clamp( 0.5f + 0.5f*(s2-s1)/smoothAmount, 0.0f, 1.0f );
+        return glm::mix( s2, s1, h ) - smoothAmount*h*(1.0f-h);
+    }
+    void combinedDist(const float* s1, const float* s2, float* out, size_t n) {
+        using namespace simd;
+        const Float half = set(0.5f), one = set(1.0f), k = set(smoothAmount);
+        size_t i = 0;
+        for (; i + width <= n; i += width) {
+            Float a = load(s1 + i), b = load(s2 + i);
+            Float h = clamp(half + half * (b - a) / k, set(0.0f), one);
+            /* glm::mix(x, y, a) is x * (1 - a) + y * a */
+            store(out + i, b * (one - h) + a * h - k * h * (one - h));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFSmoothUnion::combinedDist(s1[i], s2[i]);
+        }
     }
+    int compile(SDFTape& tape, int s1, int s2) { return tape.emitBinary(SDFTape::SmoothUnion, s1, s2, this); }
+    /* The gradient is h times s1's plus (1 - h) times s2's */
+    float lipschitz(float l1, float l2) { return glm::max(l1, l2); }
 private:
     float smoothAmount;
 };
@@ -45,6 +96,20 @@ public:
     float combinedDist(float s1, float s2) {
         return glm::max(s1, -s2);
     }
+    void combinedDist(const float* s1, const float* s2, float* out, size_t n) {
+        size_t i = 0;
+        for (; i + simd::width <= n; i += simd::width) {
+            simd::Float a = simd::load(s1 + i), b = simd::load(s2 + i);
+            simd::store(out + i, simd::max(a, -b));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFSubtract::combinedDist(s1[i], s2[i]);
+        }
+    }
+    int compile(SDFTape& tape, int s1, int s2) { return tape.emitBinary(SDFTape::Subtract, s1, s2, this); }
+    /* Where s2 > 0, -s2 still decides the result whenever it's more than s1 */
+    bool ignoresOutside(int operand) { return operand == 0; }
+    float lipschitz(float l1, float l2) { return glm::max(l1, l2); }
 };
 
 class SDFIntersection : public SDFCombineOp
@@ -56,6 +121,19 @@ public:
     float combinedDist(float s1, float s2) {
         return glm::max(s1, s2);
     }
+    void combinedDist(const float* s1, const float* s2, float* out, size_t n) {
+        size_t i = 0;
+        for (; i + simd::width <= n; i += simd::width) {
+            simd::Float a = simd::load(s1 + i), b = simd::load(s2 + i);
+            simd::store(out + i, simd::max(a, b));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFIntersection::combinedDist(s1[i], s2[i]);
+        }
+    }
+    int compile(SDFTape& tape, int s1, int s2) { return tape.emitBinary(SDFTape::Intersection, s1, s2, this); }
+    bool ignoresOutside(int operand) { return true; }
+    float lipschitz(float l1, float l2) { return glm::max(l1, l2); }
 };
 
 /*
@@ -68,6 +146,18 @@ public:
     ~SDFDisplace() {}
 
     float combinedDist(float s1, float s2) { return s1 + s2; }
+    void combinedDist(const float* s1, const float* s2, float* out, size_t n) {
+        size_t i = 0;
+        for (; i + simd::width <= n; i += simd::width) {
+            simd::Float a = simd::load(s1 + i), b = simd::load(s2 + i);
+            simd::store(out + i, a + b);
+        }
+        for (; i < n; i++) {
+            out[i] = SDFDisplace::combinedDist(s1[i], s2[i]);
+        }
+    }
+    int compile(SDFTape& tape, int s1, int s2) { return tape.emitBinary(SDFTape::Displace, s1, s2, this); }
+    float lipschitz(float l1, float l2) { return l1 + l2; }
 };
 
 #endif // SDFCOMBINEOP_H
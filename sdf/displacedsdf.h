@@ -1,6 +1,7 @@
 #ifndef DISPLACEDSDF_H
 #define DISPLACEDSDF_H
 #include "combineop.h"
+#include "sdftape.h"
 
 class DisplacedSDF : public SDF
 {
@@ -11,9 +12,18 @@ public:
     }
     virtual ~DisplacedSDF() {}
 
+    using SDF::dist;
     float dist(const glm::vec3& point) {
         return surface->dist(point) + displacement->dist(point);
     }
+    int compile(SDFTape& tape, int point) {
+        int s = surface->compile(tape, point);
+        int d = displacement->compile(tape, point);
+        return tape.emitBinary(SDFTape::Add, s, d);
+    }
+    float lipschitz() {
+        return surface->lipschitz() + displacement->lipschitz();
+    }
 private:
     SDF* surface;
     SDF* displacement;
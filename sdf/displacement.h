@@ -5,6 +5,7 @@ This file defines displacement SDF functions to be used with a combine op - not
 #ifndef SDFDISPLACEMENT_H
 #define SDFDISPLACEMENT_H
 #include "sdf.h"
+#include "sdftape.h"
 
 class SDFSineDisplacement : public SDF
 {
@@ -20,6 +21,15 @@ public:
                glm::sin(point.y * scale.y) +
                glm::sin(point.z * scale.z));
     }
+    /* No vector sin, so this is just the single point version in a loop */
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = SDFSineDisplacement::dist(glm::vec3(xs[i], ys[i], zs[i]));
+        }
+    }
+    int compile(SDFTape& tape, int point) { return tape.emitPrimitive(SDFTape::SineDisplacement, this, point); }
+    /* The gradient is amount * scale * cos(point * scale) */
+    float lipschitz() { return glm::abs(amount) * glm::length(scale); }
 
 private:
     glm::vec3 scale;
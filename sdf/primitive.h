@@ -1,10 +1,16 @@
 #ifndef PRIMITIVE_H
 #define PRIMITIVE_H
 #include "sdf.h"
+#include "sdftape.h"
+#include "simd.h"
+#include <utility>
 
 /*
 Definitions for simple SDF functions
 SDF functions from Inigo Quilez (https://iquilezles.org/articles/distfunctions/)
+
+The batch versions do the same float operations in the same order as the
+single point ones, so both give the same result for the same point.
 */
 
 /* Simple sphere at origin */
@@ -15,6 +21,22 @@ public:
     ~SDFSphere() {}
 
     float dist(const glm::vec3& point) { return glm::length(point) - radius; }
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+        size_t i = 0;
+        for (; i + simd::width <= n; i += simd::width) {
+            simd::Float x = simd::load(xs + i), y = simd::load(ys + i), z = simd::load(zs + i);
+            simd::store(out + i, simd::sqrt(x * x + y * y + z * z) - simd::set(radius));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFSphere::dist(glm::vec3(xs[i], ys[i], zs[i]));
+        }
+    }
+    int compile(SDFTape& tape, int point) { return tape.emitPrimitive(SDFTape::Sphere, this, point); }
+    float lipschitz() { return 1.0f; }
+    bool bounds(SDFBounds& result) {
+        result = {glm::vec3(-radius), glm::vec3(radius)};
+        return true;
+    }
 private:
     float radius;
 };
@@ -35,6 +57,26 @@ public:
         glm::vec3 q = glm::abs(point) - dimensions;
         return glm::length(glm::max(glm::max(q.x, glm::max(q.y, q.z)),0.0f)) + glm::min(glm::max(q.x,glm::max(q.y,q.z)),0.0f);
     }
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+        const simd::Float zero = simd::set(0.0f);
+        size_t i = 0;
+        for (; i + simd::width <= n; i += simd::width) {
+            simd::Float qx = simd::abs(simd::load(xs + i)) - simd::set(dimensions.x);
+            simd::Float qy = simd::abs(simd::load(ys + i)) - simd::set(dimensions.y);
+            simd::Float qz = simd::abs(simd::load(zs + i)) - simd::set(dimensions.z);
+            simd::Float m = simd::max(qx, simd::max(qy, qz));
+            simd::store(out + i, simd::abs(simd::max(m, zero)) + simd::min(m, zero));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFAABB::dist(glm::vec3(xs[i], ys[i], zs[i]));
+        }
+    }
+    int compile(SDFTape& tape, int point) { return tape.emitPrimitive(SDFTape::AABB, this, point); }
+    float lipschitz() { return 1.0f; }
+    bool bounds(SDFBounds& result) {
+        result = {-dimensions, dimensions};
+        return true;
+    }
 private:
     glm::vec3 dimensions;
 };
@@ -58,12 +100,42 @@ public:
         float baba = glm::dot(ba,ba);
         float paba = glm::dot(pa,ba);
         float x = glm::length(pa*baba-ba*paba) - radius*baba;
-        float y = glm::abs(paba-baba*0.5)-baba*0.5;
+        float y = glm::abs(paba-baba*0.5f)-baba*0.5f;
         float x2 = x*x;
         float y2 = y*y*baba;
-        float d = (glm::max(x,y)<0.0)?-glm::min(x2,y2):(((x>0.0)?x2:0.0)+((y>0.0)?y2:0.0));
+        float d = (glm::max(x,y)<0.0f)?-glm::min(x2,y2):(((x>0.0f)?x2:0.0f)+((y>0.0f)?y2:0.0f));
         return glm::sign(d)*glm::sqrt(glm::abs(d))/baba;
     }
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+        using namespace simd;
+        const glm::vec3 ba = b - a;
+        const float baba = glm::dot(ba,ba);
+        const Float zero = set(0.0f), vbaba = set(baba), halfBaba = set(baba*0.5f);
+        size_t i = 0;
+        for (; i + width <= n; i += width) {
+            Float pax = load(xs + i) - set(a.x), pay = load(ys + i) - set(a.y), paz = load(zs + i) - set(a.z);
+            Float paba = pax * set(ba.x) + pay * set(ba.y) + paz * set(ba.z);
+            Float vx = pax * vbaba - set(ba.x) * paba;
+            Float vy = pay * vbaba - set(ba.y) * paba;
+            Float vz = paz * vbaba - set(ba.z) * paba;
+            Float x = simd::sqrt(vx * vx + vy * vy + vz * vz) - set(radius * baba);
+            Float y = simd::abs(paba - halfBaba) - halfBaba;
+            Float x2 = x * x;
+            Float y2 = y * y * vbaba;
+            Float outside = select(zero < x, x2, zero) + select(zero < y, y2, zero);
+            Float d = select(simd::max(x, y) < zero, -simd::min(x2, y2), outside);
+            store(out + i, sign(d) * simd::sqrt(simd::abs(d)) / vbaba);
+        }
+        for (; i < n; i++) {
+            out[i] = SDFCylinder::dist(glm::vec3(xs[i], ys[i], zs[i]));
+        }
+    }
+    int compile(SDFTape& tape, int point) { return tape.emitPrimitive(SDFTape::Cylinder, this, point); }
+    float lipschitz() { return 1.0f; }
+    bool bounds(SDFBounds& result) {
+        result = {glm::min(a, b) - radius, glm::max(a, b) + radius};
+        return true;
+    }
 private:
     glm::vec3 a;
     glm::vec3 b;
@@ -90,16 +162,49 @@ public:
       float papa = glm::dot(point-a,point-a);
       float paba = glm::dot(point-a,b-a)/baba;
       float x = glm::sqrt( papa - paba*paba*baba );
-      float cax = glm::max(0.0f,x-((paba<0.5)?ra:rb));
-      float cay = glm::abs(paba-0.5)-0.5;
+      float cax = glm::max(0.0f,x-((paba<0.5f)?ra:rb));
+      float cay = glm::abs(paba-0.5f)-0.5f;
       float k = rba*rba + baba;
       float f = glm::clamp( (rba*(x-ra)+paba*baba)/k, 0.0f, 1.0f );
       float cbx = x-ra - f*rba;
       float cby = paba - f;
-      float s = (cbx<0.0 && cay<0.0) ? -1.0 : 1.0;
+      float s = (cbx<0.0f && cay<0.0f) ? -1.0f : 1.0f;
       return s*glm::sqrt( glm::min(cax*cax + cay*cay*baba,
                          cbx*cbx + cby*cby*baba) );
     }
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+        using namespace simd;
+        const glm::vec3 ba = b - a;
+        const float baba = glm::dot(ba,ba);
+        const float rba = rb-ra;
+        const Float zero = set(0.0f), one = set(1.0f), half = set(0.5f), vbaba = set(baba), vra = set(ra), vrba = set(rba);
+        const Float k = set(rba*rba + baba);
+        size_t i = 0;
+        for (; i + width <= n; i += width) {
+            Float pax = load(xs + i) - set(a.x), pay = load(ys + i) - set(a.y), paz = load(zs + i) - set(a.z);
+            Float papa = pax * pax + pay * pay + paz * paz;
+            Float paba = (pax * set(ba.x) + pay * set(ba.y) + paz * set(ba.z)) / vbaba;
+            Float x = simd::sqrt(papa - paba * paba * vbaba);
+            Float cax = simd::max(zero, x - select(paba < half, vra, set(rb)));
+            Float cay = simd::abs(paba - half) - half;
+            Float f = clamp((vrba * (x - vra) + paba * vbaba) / k, zero, one);
+            Float cbx = x - vra - f * vrba;
+            Float cby = paba - f;
+            Float s = select(cbx < zero && cay < zero, set(-1.0f), one);
+            store(out + i, s * simd::sqrt(simd::min(cax * cax + cay * cay * vbaba,
+                                                     cbx * cbx + cby * cby * vbaba)));
+        }
+        for (; i < n; i++) {
+            out[i] = SDFCappedCone::dist(glm::vec3(xs[i], ys[i], zs[i]));
+        }
+    }
+    int compile(SDFTape& tape, int point) { return tape.emitPrimitive(SDFTape::CappedCone, this, point); }
+    float lipschitz() { return 1.0f; }
+    bool bounds(SDFBounds& result) {
+        float r = glm::max(ra, rb);
+        result = {glm::min(a, b) - r, glm::max(a, b) + r};
+        return true;
+    }
 private:
     glm::vec3 a;
     glm::vec3 b;
@@ -120,6 +225,7 @@ public:
         rb = _rb;
         curveAmount = _curveAmount;
         curvePower = _curvePower;
+        maxRotation = glm::radians(30.0f) * curveAmount;
     }
     ~SDFCurvedXYCone() {}
 
@@ -129,17 +235,43 @@ public:
         }
         //glm::vec3 lv(0, point.y, point.z);
         //return glm::length(lv) - ra;
-        glm::mat4 curTransform(1.0);
         float distanceAlongCone = (point.x / length);
         float curRadius = ra;//ra + (rb - ra) * distanceAlongCone;
         //float curveFunction = glm::pow(distanceAlongCone, curvePower); // sample of curve function - dependent on length
-        float rotationAmount = (glm::radians(30.0) * curveAmount) * distanceAlongCone;
-        curTransform = glm::rotate(curTransform, rotationAmount, glm::vec3(0, 1, 0));
-        glm::vec4 transformedPoint4 = glm::vec4(point, 1.0);
-        transformedPoint4 = curTransform * transformedPoint4;
-        glm::vec3 transformedPoint(transformedPoint4.x, transformedPoint4.y, transformedPoint4.z);
-        transformedPoint.x = 0.0;
-        return glm::length(transformedPoint) - curRadius;
+        float rotationAmount = maxRotation * distanceAlongCone;
+        /* Rotating about Y leaves y alone, and x is thrown away, so only z is needed */
+        float rotatedZ = glm::cos(rotationAmount) * point.z - glm::sin(rotationAmount) * point.x;
+        return glm::sqrt(point.y * point.y + rotatedZ * rotatedZ) - curRadius;
+    }
+    /* Needs a sin and cos per point, which have no vector versions that match the scalar ones */
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = SDFCurvedXYCone::dist(glm::vec3(xs[i], ys[i], zs[i]));
+        }
+    }
+    int compile(SDFTape& tape, int point) { return tape.emitPrimitive(SDFTape::CurvedXYCone, this, point); }
+    /* No lipschitz(), the distance jumps to |x| past either end of the cone */
+    /*
+    Inside, x is in [0, length] and y and rotatedZ in [-ra, ra]. Solving for z,
+    cos(rotation) * z = rotatedZ + sin(rotation) * x, where the rotation runs from 0
+    to maxRotation. Once it reaches 90 degrees z can be anything.
+    */
+    bool bounds(SDFBounds& result) {
+        float rotation = glm::abs(maxRotation);
+        if (rotation >= glm::half_pi<float>()) {
+            return false;
+        }
+        float minCos = glm::cos(rotation);
+        float up = ra + glm::sin(rotation) * length;
+        float lowZ = -ra / minCos;
+        float highZ = up / minCos;
+        if (maxRotation < 0.0f) {
+            std::swap(lowZ, highZ);
+            lowZ = -lowZ;
+            highZ = -highZ;
+        }
+        result = {glm::vec3(0.0f, -ra, lowZ), glm::vec3(length, ra, highZ)};
+        return true;
     }
 private:
     float length;
@@ -147,6 +279,8 @@ private:
     float rb;
     float curveAmount;
     float curvePower;
+    /* Rotation at the end of the cone, in radians */
+    float maxRotation;
 };
 
 #endif // PRIMITIVE_H
@@ -1 +1,21 @@
 #include "sdf.h"
+#include "sdftape.h"
+#include <limits>
+
+void SDF::dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = dist(glm::vec3(xs[i], ys[i], zs[i]));
+    }
+}
+
+int SDF::compile(SDFTape& tape, int point) {
+    return tape.emitPrimitive(SDFTape::Call, this, point);
+}
+
+bool SDF::bounds(SDFBounds& result) {
+    return false;
+}
+
+float SDF::lipschitz() {
+    return std::numeric_limits<float>::infinity();
+}
@@ -3,11 +3,42 @@
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <cstddef>
+
+class SDFTape;
+
+/* Axis aligned box from lo to hi */
+struct SDFBounds {
+    glm::vec3 lo;
+    glm::vec3 hi;
+
+    bool overlaps(const SDFBounds& other) const {
+        return lo.x <= other.hi.x && other.lo.x <= hi.x &&
+               lo.y <= other.hi.y && other.lo.y <= hi.y &&
+               lo.z <= other.hi.z && other.lo.z <= hi.z;
+    }
+    void extend(const SDFBounds& other) {
+        lo = glm::min(lo, other.lo);
+        hi = glm::max(hi, other.hi);
+    }
+    glm::vec3 center() const { return (lo + hi) * 0.5f; }
+};
 
 class SDF
 {
 public:
     virtual float dist(const glm::vec3& point) = 0;
+    /* out[i] = dist(xs[i], ys[i], zs[i]). The default evaluates one point at a time. */
+    virtual void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n);
+    /* Append instructions evaluating this SDF at the given point slot to the tape.
+       Returns the distance slot. The default calls dist() through the vtable. */
+    virtual int compile(SDFTape& tape, int point);
+    /* Box around every point where dist() <= 0, in the SDF's own space.
+       Returns false if there isn't one, which is the default. */
+    virtual bool bounds(SDFBounds& result);
+    /* How fast dist() can change, |dist(a) - dist(b)| <= lipschitz() * |a - b|.
+       Infinite by default, for SDFs that can't promise anything. */
+    virtual float lipschitz();
 };
 
 #endif // SDF_H
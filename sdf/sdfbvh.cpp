@@ -0,0 +1,67 @@
+#include "sdfbvh.h"
+#include <algorithm>
+#include <stdexcept>
+
+void SDFBVH::build(const std::vector<SDFBounds>& bounds, const std::vector<int>& _ids) {
+    if (bounds.size() != _ids.size()) {
+        throw std::runtime_error("SDFBVH needs one id per box");
+    }
+    nodes.clear();
+    ids = _ids;
+    if (ids.empty()) {
+        return;
+    }
+    /* Sorted alongside ids while building */
+    std::vector<SDFBounds> sorted = bounds;
+    nodes.emplace_back();
+    buildNode(0, sorted, 0, int(ids.size()));
+}
+
+void SDFBVH::buildNode(int node, std::vector<SDFBounds>& bounds, int begin, int end) {
+    SDFBounds nodeBounds = bounds[begin];
+    SDFBounds centers = {bounds[begin].center(), bounds[begin].center()};
+    for (int i = begin + 1; i < end; i++) {
+        nodeBounds.extend(bounds[i]);
+        centers.extend({bounds[i].center(), bounds[i].center()});
+    }
+    nodes[node].bounds = nodeBounds;
+    if (end - begin <= leafSize) {
+        nodes[node].first = begin;
+        nodes[node].count = end - begin;
+        return;
+    }
+
+    /* Split at the median along the axis the centers are most spread out on */
+    glm::vec3 extent = centers.hi - centers.lo;
+    int axis = 0;
+    if (extent.y > extent[axis]) {
+        axis = 1;
+    }
+    if (extent.z > extent[axis]) {
+        axis = 2;
+    }
+    std::vector<int> order(end - begin);
+    for (int i = 0; i < end - begin; i++) {
+        order[i] = begin + i;
+    }
+    const int mid = (end - begin) / 2;
+    std::nth_element(order.begin(), order.begin() + mid, order.end(), [&](int a, int b) {
+        return bounds[a].center()[axis] < bounds[b].center()[axis];
+    });
+    std::vector<SDFBounds> sortedBounds(end - begin);
+    std::vector<int> sortedIds(end - begin);
+    for (int i = 0; i < end - begin; i++) {
+        sortedBounds[i] = bounds[order[i]];
+        sortedIds[i] = ids[order[i]];
+    }
+    std::copy(sortedBounds.begin(), sortedBounds.end(), bounds.begin() + begin);
+    std::copy(sortedIds.begin(), sortedIds.end(), ids.begin() + begin);
+
+    int left = int(nodes.size());
+    nodes.emplace_back();
+    nodes.emplace_back();
+    nodes[node].first = left;
+    nodes[node].count = 0;
+    buildNode(left, bounds, begin, begin + mid);
+    buildNode(left + 1, bounds, begin + mid, end);
+}
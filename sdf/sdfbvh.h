@@ -0,0 +1,64 @@
+#ifndef SDFBVH_H
+#define SDFBVH_H
+#include "sdf.h"
+#include <vector>
+#include <cstdint>
+
+/*
+Bounding volume hierarchy over a handful of boxes, each with an integer id.
+Chains only have tens of links, so it's built once with median splits and
+queried with a small fixed stack.
+*/
+class SDFBVH
+{
+public:
+    SDFBVH() {}
+
+    void build(const std::vector<SDFBounds>& bounds, const std::vector<int>& ids);
+    bool empty() const { return nodes.empty(); }
+
+    /* Calls visit(id) for every box that overlaps box */
+    template<typename Visit>
+    void query(const SDFBounds& box, Visit visit) const {
+        if (nodes.empty()) {
+            return;
+        }
+        int32_t stack[maxDepth];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if (!node.bounds.overlaps(box)) {
+                continue;
+            }
+            if (node.count > 0) {
+                for (int32_t i = node.first; i < node.first + node.count; i++) {
+                    visit(ids[i]);
+                }
+            } else {
+                stack[top++] = node.first;
+                stack[top++] = node.first + 1;
+            }
+        }
+    }
+
+private:
+    /* Leaves hold up to this many ids */
+    static constexpr int leafSize = 2;
+    static constexpr int maxDepth = 64;
+
+    struct Node {
+        SDFBounds bounds;
+        /* Index of the left child (right is next to it) or of the first id for leaves */
+        int32_t first;
+        /* Number of ids, 0 for inner nodes */
+        int32_t count;
+    };
+
+    void buildNode(int node, std::vector<SDFBounds>& bounds, int begin, int end);
+
+    std::vector<Node> nodes;
+    std::vector<int> ids;
+};
+
+#endif // SDFBVH_H
@@ -1,29 +1,65 @@
 #include "sdfchain.h"
+#include "sdftape.h"
+
+/* Added around link bounds, to cover rounding in transforms and dist() */
+static const float boundsPadding = 1.0f / 1024.0f;
+/*
+Chains hold tens of links, so distances go in a buffer on the stack. Nested
+chains are evaluated while it's in use, so it can't be shared per thread.
+*/
+static const size_t stackLinks = 64;
+/* With fewer cullable links than this, dist() checks each one's bounds rather than query the BVH */
+static const size_t minBVHLinks = 32;
 
 SDFChain::SDFChain() : chain() {}
 
 SDFChain::~SDFChain() {}
 
-float SDFChain::dist(const glm::vec3& point) {
+void SDFChain::linkDistances(const glm::vec3& point, float* distances)
+{
     size_t numLinks = chain.size();
-    float* distances = new float[numLinks];
+    if (!queryBVH) {
+        for (size_t i = 0; i < numLinks; i++) {
+            bool culled = linkCullable[i] && !linkBounds[i].overlaps({point, point});
+            distances[i] = culled ? farDistance : chain[i].s->dist(chain[i].t(point));
+        }
+        return;
+    }
     for (size_t i = 0; i < numLinks; i++) {
+        distances[i] = linkCullable[i] ? farDistance : chain[i].s->dist(chain[i].t(point));
+    }
+    bvh.query({point, point}, [&](int i) {
         distances[i] = chain[i].s->dist(chain[i].t(point));
+    });
+}
+
+float SDFChain::dist(const glm::vec3& point) {
+    size_t numLinks = chain.size();
+    float stackDistances[stackLinks];
+    std::vector<float> heapDistances;
+    float* distances = stackDistances;
+    if (numLinks > stackLinks) {
+        heapDistances.resize(numLinks);
+        distances = heapDistances.data();
     }
+    linkDistances(point, distances);
     float curDist = distances[0];
     for (size_t i = 1; i < numLinks; i++) {
         curDist = chain[i].c->combinedDist(curDist, distances[i]);
     }
-    delete[] distances;
     return curDist;
 }
 
 DistResult SDFChain::minDist(const glm::vec3& point) {
     size_t numLinks = chain.size();
-    float* distances = new float[numLinks];
-    for (size_t i = 0; i < numLinks; i++) {
-        distances[i] = chain[i].s->dist(chain[i].t(point));
+    float stackDistances[stackLinks];
+    std::vector<float> heapDistances;
+    float* distances = stackDistances;
+    if (numLinks > stackLinks) {
+        heapDistances.resize(numLinks);
+        distances = heapDistances.data();
     }
+    linkDistances(point, distances);
     float curDist = distances[0];
     int curMin = 0;
     for (size_t i = 1; i < numLinks; i++) {
@@ -32,11 +68,92 @@ DistResult SDFChain::minDist(const glm::vec3& point) {
             curMin = i;
         }
     }
-    delete[] distances;
     return {curDist, curMin};
 }
 
 void SDFChain::addLink(const SDFLink& l)
 {
     chain.push_back(l);
+    SDFBounds b;
+    bool bounded = l.s->bounds(b);
+    if (bounded) {
+        b = l.t.transformBounds(b);
+        b.lo -= glm::vec3(boundsPadding);
+        b.hi += glm::vec3(boundsPadding);
+    }
+    linkBounds.push_back(b);
+    linkBounded.push_back(bounded);
+    updateCulling();
+}
+
+int SDFChain::compile(SDFTape& tape, int point)
+{
+    return tape.emitChain(chain, point);
+}
+
+/* Follows the inside of the chain through each combine op, see SDFCombineOp::ignoresOutside */
+bool SDFChain::bounds(SDFBounds& result)
+{
+    if (chain.empty() || !linkBounded[0]) {
+        return false;
+    }
+    result = linkBounds[0];
+    for (size_t i = 1; i < chain.size(); i++) {
+        bool keepsRest = chain[i].c->ignoresOutside(0);
+        bool keepsLink = chain[i].c->ignoresOutside(1);
+        if (!keepsRest && !keepsLink) {
+            return false;
+        }
+        if (keepsLink) {
+            if (!linkBounded[i]) {
+                return false;
+            }
+            if (keepsRest) {
+                result.extend(linkBounds[i]);
+            } else {
+                result = linkBounds[i];
+            }
+        }
+    }
+    return true;
+}
+
+float SDFChain::lipschitz()
+{
+    float result = chain[0].s->lipschitz() * chain[0].t.maxStretch();
+    for (size_t i = 1; i < chain.size(); i++) {
+        result = chain[i].c->lipschitz(result, chain[i].s->lipschitz() * chain[i].t.maxStretch());
+    }
+    return result;
+}
+
+void SDFChain::setCulling(bool enabled)
+{
+    culling = enabled;
+    updateCulling();
+}
+
+/*
+A link can be culled if it's bounded, its own op ignores it outside its
+bounds, and every later op ignores the result of the links before it.
+*/
+void SDFChain::updateCulling()
+{
+    linkCullable.assign(chain.size(), false);
+    std::vector<SDFBounds> boxes;
+    std::vector<int> ids;
+    bool restIgnored = true;
+    for (size_t i = chain.size(); i-- > 0;) {
+        bool linkIgnored = i == 0 || chain[i].c->ignoresOutside(1);
+        linkCullable[i] = culling && linkBounded[i] && linkIgnored && restIgnored;
+        if (linkCullable[i]) {
+            boxes.push_back(linkBounds[i]);
+            ids.push_back(int(i));
+        }
+        if (i > 0) {
+            restIgnored = restIgnored && chain[i].c->ignoresOutside(0);
+        }
+    }
+    bvh.build(boxes, ids);
+    queryBVH = boxes.size() >= minBVHLinks;
 }
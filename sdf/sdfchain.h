@@ -2,7 +2,10 @@
 #define SDFCHAIN_H
 #include "transformop.h"
 #include "combineop.h"
+#include "sdfbvh.h"
 #include <vector>
+#include <limits>
+#include <cstdint>
 
 struct SDFLink {
     SDF* s;
@@ -15,18 +18,60 @@ struct DistResult {
     int minIndex;
 };
 
+/*
+Links are combined in order, each with its own combine op.
+
+With culling on (the default), links that have bounds are put in a BVH,
+and a point outside a link's bounds gets farDistance for that link rather
+than evaluating it. That's only done where the combine ops say it can't
+change the result anywhere it's <= 0 (see SDFCombineOp::ignoresOutside),
+so which points are inside, and their distances and minIndex, stay the
+same, but distances outside can come out larger. Turn it off for chains
+whose positive distances matter, like ones under a smooth union or a
+displacement.
+
+A link's bounds are worked out when it's added, so nested chains have to
+be complete by then.
+*/
 class SDFChain : public SDF
 {
 public:
     SDFChain();
     virtual ~SDFChain();
 
+    using SDF::dist;
     virtual float dist(const glm::vec3& point);
     DistResult minDist(const glm::vec3& point);
     void addLink(const SDFLink& l);
+    const std::vector<SDFLink>& getLinks() const { return chain; }
+    /* Nested chains are inlined into the parent's tape */
+    int compile(SDFTape& tape, int point);
+    bool bounds(SDFBounds& result);
+    /* For the chain without culling. With it, distances jump to farDistance at
+       the edges of link bounds, but only where they're > 0 either way. */
+    float lipschitz();
+
+    void setCulling(bool enabled);
+    bool isCullable(size_t link) const { return linkCullable[link]; }
+    /* Bounds of the links that can be culled, by index */
+    const SDFBVH& getBVH() const { return bvh; }
+
+    static constexpr float farDistance = std::numeric_limits<float>::max();
 
 protected:
+    void updateCulling();
+    /* Distance to each link, farDistance for culled ones. distances is chain.size() long. */
+    void linkDistances(const glm::vec3& point, float* distances);
+
     std::vector<SDFLink> chain;
+    /* Bounds of each link in the chain's space, if linkBounded */
+    std::vector<SDFBounds> linkBounds;
+    std::vector<bool> linkBounded;
+    std::vector<uint8_t> linkCullable;
+    SDFBVH bvh;
+    /* Only worth it past a few cullable links, the tape uses the BVH either way */
+    bool queryBVH = false;
+    bool culling = true;
 };
 
 #endif // SDFCHAIN_H
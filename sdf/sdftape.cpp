@@ -0,0 +1,349 @@
+#include "sdftape.h"
+#include "sdfchain.h"
+#include "primitive.h"
+#include "displacement.h"
+#include "combineop.h"
+#include "simd.h"
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+
+SDFTape::SDFTape(SDFChain& root)
+{
+    /* Point slot 0 is the input point */
+    points.resize(1);
+    result = emitChain(root.getLinks(), 0, &rootLinks);
+    bvh = root.getBVH();
+    for (size_t i = 0; i < rootLinks.size(); i++) {
+        rootCullable.push_back(root.isCullable(i));
+    }
+    linkActive.resize(rootLinks.size());
+    for (const SDFLink& link : root.getLinks()) {
+        rootLipschitz.push_back(link.s->lipschitz() * link.t.maxStretch());
+        rootOps.push_back(link.c);
+    }
+    distances.resize(instructions.size());
+    batchPoints.resize(points.size() * 3 * batchSize);
+    batchDistances.resize(instructions.size() * batchSize);
+}
+
+int SDFTape::emitTransform(const SDFTransformOp& transform, int point) {
+    /* Skipping identity transforms can only change the sign of zero coordinates,
+       which none of the primitives care about */
+    if (transform.inverseMatrix() == glm::mat4(1.0)) {
+        return point;
+    }
+    Instruction ins {};
+    ins.op = Transform;
+    ins.dst = int32_t(points.size());
+    ins.a = point;
+    ins.transform = int32_t(transforms.size());
+    transforms.push_back(transform);
+    points.emplace_back();
+    instructions.push_back(ins);
+    return ins.dst;
+}
+
+int SDFTape::emitPrimitive(Opcode op, void* sdf, int point) {
+    Instruction ins {};
+    ins.op = op;
+    /* Every instruction apart from Transform writes its own distance slot */
+    ins.dst = int32_t(instructions.size());
+    ins.a = point;
+    ins.object = sdf;
+    instructions.push_back(ins);
+    return ins.dst;
+}
+
+int SDFTape::emitBinary(Opcode op, int a, int b, void* combineOp) {
+    Instruction ins {};
+    ins.op = op;
+    ins.dst = int32_t(instructions.size());
+    ins.a = a;
+    ins.b = b;
+    ins.object = combineOp;
+    instructions.push_back(ins);
+    return ins.dst;
+}
+
+int SDFTape::emitChain(const std::vector<SDFLink>& links, int point, std::vector<LinkRange>* linkRanges) {
+    if (links.empty()) {
+        throw std::runtime_error("Can't compile an empty SDFChain");
+    }
+    std::vector<LinkRange> ranges(links.size());
+    for (size_t i = 0; i < links.size(); i++) {
+        ranges[i].begin = int32_t(instructions.size());
+        int linkPoint = emitTransform(links[i].t, point);
+        ranges[i].slot = links[i].s->compile(*this, linkPoint);
+        ranges[i].end = int32_t(instructions.size());
+    }
+    int cur = ranges[0].slot;
+    for (size_t i = 1; i < links.size(); i++) {
+        cur = links[i].c->compile(*this, cur, ranges[i].slot);
+    }
+    if (linkRanges) {
+        *linkRanges = ranges;
+    }
+    return cur;
+}
+
+void SDFTape::cull(const SDFBounds& box) {
+    for (size_t i = 0; i < rootLinks.size(); i++) {
+        linkActive[i] = !rootCullable[i];
+    }
+    bvh.query(box, [&](int i) {
+        linkActive[i] = true;
+    });
+}
+
+void SDFTape::run(const glm::vec3& point, const SDFBounds& cullBox) {
+    points[0] = point;
+    cull(cullBox);
+    for (size_t i = 0; i < rootLinks.size(); i++) {
+        if (linkActive[i]) {
+            runInstructions(rootLinks[i].begin, rootLinks[i].end);
+        } else {
+            distances[rootLinks[i].slot] = SDFChain::farDistance;
+        }
+    }
+    runInstructions(rootLinks.back().end, instructions.size());
+}
+
+void SDFTape::runInstructions(size_t begin, size_t end) {
+    /* Qualified calls below are resolved statically, so they inline the same code dist() runs */
+    for (size_t index = begin; index < end; index++) {
+        const Instruction& ins = instructions[index];
+        switch (ins.op) {
+            case Transform:
+                points[ins.dst] = transforms[ins.transform](points[ins.a]);
+                break;
+            case Call:
+                distances[ins.dst] = static_cast<SDF*>(ins.object)->dist(points[ins.a]);
+                break;
+            case Sphere:
+                distances[ins.dst] = static_cast<SDFSphere*>(ins.object)->SDFSphere::dist(points[ins.a]);
+                break;
+            case AABB:
+                distances[ins.dst] = static_cast<SDFAABB*>(ins.object)->SDFAABB::dist(points[ins.a]);
+                break;
+            case Cylinder:
+                distances[ins.dst] = static_cast<SDFCylinder*>(ins.object)->SDFCylinder::dist(points[ins.a]);
+                break;
+            case CappedCone:
+                distances[ins.dst] = static_cast<SDFCappedCone*>(ins.object)->SDFCappedCone::dist(points[ins.a]);
+                break;
+            case CurvedXYCone:
+                distances[ins.dst] = static_cast<SDFCurvedXYCone*>(ins.object)->SDFCurvedXYCone::dist(points[ins.a]);
+                break;
+            case SineDisplacement:
+                distances[ins.dst] = static_cast<SDFSineDisplacement*>(ins.object)->SDFSineDisplacement::dist(points[ins.a]);
+                break;
+            case Add:
+                distances[ins.dst] = distances[ins.a] + distances[ins.b];
+                break;
+            case Union:
+                distances[ins.dst] = static_cast<SDFUnion*>(ins.object)->SDFUnion::combinedDist(distances[ins.a], distances[ins.b]);
+                break;
+            case SmoothUnion:
+                distances[ins.dst] = static_cast<SDFSmoothUnion*>(ins.object)->SDFSmoothUnion::combinedDist(distances[ins.a], distances[ins.b]);
+                break;
+            case Subtract:
+                distances[ins.dst] = static_cast<SDFSubtract*>(ins.object)->SDFSubtract::combinedDist(distances[ins.a], distances[ins.b]);
+                break;
+            case Intersection:
+                distances[ins.dst] = static_cast<SDFIntersection*>(ins.object)->SDFIntersection::combinedDist(distances[ins.a], distances[ins.b]);
+                break;
+            case Displace:
+                distances[ins.dst] = static_cast<SDFDisplace*>(ins.object)->SDFDisplace::combinedDist(distances[ins.a], distances[ins.b]);
+                break;
+            case CombineCall:
+                distances[ins.dst] = static_cast<SDFCombineOp*>(ins.object)->combinedDist(distances[ins.a], distances[ins.b]);
+                break;
+        }
+    }
+}
+
+float SDFTape::dist(const glm::vec3& point) {
+    run(point, {point, point});
+    return distances[result];
+}
+
+DistResult SDFTape::minDist(const glm::vec3& point) {
+    run(point, {point, point});
+    float curDist = distances[rootLinks[0].slot];
+    int curMin = 0;
+    for (size_t i = 1; i < rootLinks.size(); i++) {
+        if (curDist > distances[rootLinks[i].slot]) {
+            curDist = distances[rootLinks[i].slot];
+            curMin = i;
+        }
+    }
+    return {curDist, curMin};
+}
+
+SDFTape::BoxDist SDFTape::boxDist(const SDFBounds& box) {
+    run(box.center(), box);
+    BoxDist cell;
+    cell.distance = distances[result];
+    cell.minDistance = distances[rootLinks[0].slot];
+    cell.minIndex = 0;
+    cell.secondMin = SDFChain::farDistance;
+    for (size_t i = 1; i < rootLinks.size(); i++) {
+        float d = distances[rootLinks[i].slot];
+        if (cell.minDistance > d) {
+            cell.secondMin = cell.minDistance;
+            cell.minDistance = d;
+            cell.minIndex = i;
+        } else {
+            cell.secondMin = glm::min(cell.secondMin, d);
+        }
+    }
+    /* Culled links are constant within the box. minDist reads the links
+       directly, so the bound covers each of them as well as the fold. */
+    float lipschitz = linkActive[0] ? rootLipschitz[0] : 0.0f;
+    float largest = lipschitz;
+    for (size_t i = 1; i < rootLinks.size(); i++) {
+        float link = linkActive[i] ? rootLipschitz[i] : 0.0f;
+        lipschitz = rootOps[i]->lipschitz(lipschitz, link);
+        largest = glm::max(largest, link);
+    }
+    cell.lipschitz = glm::max(lipschitz, largest);
+    return cell;
+}
+
+/* Same instructions as run(), a whole batch at a time */
+void SDFTape::runBatch(const float* xs, const float* ys, const float* zs, size_t n) {
+    memcpy(batchPoint(0, 0), xs, n * sizeof(float));
+    memcpy(batchPoint(0, 1), ys, n * sizeof(float));
+    memcpy(batchPoint(0, 2), zs, n * sizeof(float));
+    SDFBounds box = {glm::vec3(xs[0], ys[0], zs[0]), glm::vec3(xs[0], ys[0], zs[0])};
+    /* Nothing to cull otherwise */
+    if (!bvh.empty()) {
+        for (size_t i = 1; i < n; i++) {
+            glm::vec3 p(xs[i], ys[i], zs[i]);
+            box.extend({p, p});
+        }
+    }
+    cull(box);
+    for (size_t i = 0; i < rootLinks.size(); i++) {
+        if (linkActive[i]) {
+            runBatchInstructions(rootLinks[i].begin, rootLinks[i].end, n);
+        } else {
+            std::fill(batchDistance(rootLinks[i].slot), batchDistance(rootLinks[i].slot) + n, SDFChain::farDistance);
+        }
+    }
+    runBatchInstructions(rootLinks.back().end, instructions.size(), n);
+}
+
+void SDFTape::runBatchInstructions(size_t begin, size_t end, size_t n) {
+    for (size_t index = begin; index < end; index++) {
+        const Instruction& ins = instructions[index];
+        /* Opcodes before Add read a point slot, Transform is the only one that writes one */
+        const float* px = nullptr;
+        const float* py = nullptr;
+        const float* pz = nullptr;
+        if (ins.op < Add) {
+            px = batchPoint(ins.a, 0);
+            py = batchPoint(ins.a, 1);
+            pz = batchPoint(ins.a, 2);
+        }
+        float* out = ins.op == Transform ? nullptr : batchDistance(ins.dst);
+        switch (ins.op) {
+            case Transform: {
+                const glm::mat4& m = transforms[ins.transform].inverseMatrix();
+                for (int axis = 0; axis < 3; axis++) {
+                    float* dst = batchPoint(ins.dst, axis);
+                    const simd::Float m0 = simd::set(m[0][axis]), m1 = simd::set(m[1][axis]);
+                    const simd::Float m2 = simd::set(m[2][axis]), m3 = simd::set(m[3][axis]);
+                    size_t i = 0;
+                    /* Summed in the same order as SDFTransformOp::operator() */
+                    for (; i + simd::width <= n; i += simd::width) {
+                        simd::store(dst + i, (m0 * simd::load(px + i) + m1 * simd::load(py + i)) +
+                                             (m2 * simd::load(pz + i) + m3));
+                    }
+                    for (; i < n; i++) {
+                        dst[i] = (m[0][axis] * px[i] + m[1][axis] * py[i]) + (m[2][axis] * pz[i] + m[3][axis]);
+                    }
+                }
+                break;
+            }
+            case Call:
+                static_cast<SDF*>(ins.object)->dist(px, py, pz, out, n);
+                break;
+            case Sphere:
+                static_cast<SDFSphere*>(ins.object)->SDFSphere::dist(px, py, pz, out, n);
+                break;
+            case AABB:
+                static_cast<SDFAABB*>(ins.object)->SDFAABB::dist(px, py, pz, out, n);
+                break;
+            case Cylinder:
+                static_cast<SDFCylinder*>(ins.object)->SDFCylinder::dist(px, py, pz, out, n);
+                break;
+            case CappedCone:
+                static_cast<SDFCappedCone*>(ins.object)->SDFCappedCone::dist(px, py, pz, out, n);
+                break;
+            case CurvedXYCone:
+                static_cast<SDFCurvedXYCone*>(ins.object)->SDFCurvedXYCone::dist(px, py, pz, out, n);
+                break;
+            case SineDisplacement:
+                static_cast<SDFSineDisplacement*>(ins.object)->SDFSineDisplacement::dist(px, py, pz, out, n);
+                break;
+            case Add: {
+                const float* s = batchDistance(ins.a);
+                const float* d = batchDistance(ins.b);
+                size_t i = 0;
+                for (; i + simd::width <= n; i += simd::width) {
+                    simd::store(out + i, simd::load(s + i) + simd::load(d + i));
+                }
+                for (; i < n; i++) {
+                    out[i] = s[i] + d[i];
+                }
+                break;
+            }
+            case Union:
+                static_cast<SDFUnion*>(ins.object)->SDFUnion::combinedDist(batchDistance(ins.a), batchDistance(ins.b), out, n);
+                break;
+            case SmoothUnion:
+                static_cast<SDFSmoothUnion*>(ins.object)->SDFSmoothUnion::combinedDist(batchDistance(ins.a), batchDistance(ins.b), out, n);
+                break;
+            case Subtract:
+                static_cast<SDFSubtract*>(ins.object)->SDFSubtract::combinedDist(batchDistance(ins.a), batchDistance(ins.b), out, n);
+                break;
+            case Intersection:
+                static_cast<SDFIntersection*>(ins.object)->SDFIntersection::combinedDist(batchDistance(ins.a), batchDistance(ins.b), out, n);
+                break;
+            case Displace:
+                static_cast<SDFDisplace*>(ins.object)->SDFDisplace::combinedDist(batchDistance(ins.a), batchDistance(ins.b), out, n);
+                break;
+            case CombineCall:
+                static_cast<SDFCombineOp*>(ins.object)->combinedDist(batchDistance(ins.a), batchDistance(ins.b), out, n);
+                break;
+        }
+    }
+}
+
+void SDFTape::dist(const float* xs, const float* ys, const float* zs, float* out, size_t n) {
+    for (size_t start = 0; start < n; start += batchSize) {
+        const size_t count = std::min(batchSize, n - start);
+        runBatch(xs + start, ys + start, zs + start, count);
+        memcpy(out + start, batchDistance(result), count * sizeof(float));
+    }
+}
+
+void SDFTape::minDist(const float* xs, const float* ys, const float* zs, DistResult* out, size_t n) {
+    for (size_t start = 0; start < n; start += batchSize) {
+        const size_t count = std::min(batchSize, n - start);
+        runBatch(xs + start, ys + start, zs + start, count);
+        for (size_t i = 0; i < count; i++) {
+            float curDist = batchDistance(rootLinks[0].slot)[i];
+            int curMin = 0;
+            for (size_t l = 1; l < rootLinks.size(); l++) {
+                if (curDist > batchDistance(rootLinks[l].slot)[i]) {
+                    curDist = batchDistance(rootLinks[l].slot)[i];
+                    curMin = l;
+                }
+            }
+            out[start + i] = {curDist, curMin};
+        }
+    }
+}
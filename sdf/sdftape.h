@@ -0,0 +1,140 @@
+#ifndef SDFTAPE_H
+#define SDFTAPE_H
+#include "sdf.h"
+#include "transformop.h"
+#include "sdfbvh.h"
+#include <vector>
+#include <cstdint>
+
+class SDFChain;
+class SDFCombineOp;
+struct SDFLink;
+struct DistResult;
+
+/*
+An SDFChain flattened into a list of instructions. Every link, nested
+chain, displacement and transform becomes one or more instructions that
+read and write numbered point and distance slots, and evaluating is a
+single loop over the list instead of a walk down the tree through
+virtual calls.
+
+Primitives are evaluated with the same code as their dist(), so results
+are bit-identical to SDFChain::dist and SDFChain::minDist. The root chain's
+links are culled the same way SDFChain does, by the bounds of the point or
+of the whole batch, so batches should be of points close together. Links of
+nested chains are always evaluated, which only changes distances outside,
+so inside points, their distances and minIndex still match. Like SDFLink,
+the tape points at the SDFs and combine ops it was compiled from, so they
+must outlive it. Evaluating writes to the slots, so each thread needs its
+own tape.
+*/
+class SDFTape
+{
+public:
+    enum Opcode : uint8_t {
+        /* point[dst] = transforms[transform](point[a]) */
+        Transform,
+        /* dist[dst] = object->dist(point[a]) through the vtable, for SDFs with no opcode */
+        Call,
+        Sphere,
+        AABB,
+        Cylinder,
+        CappedCone,
+        CurvedXYCone,
+        SineDisplacement,
+        /* dist[dst] = dist[a] + dist[b] */
+        Add,
+        /* dist[dst] = combine(dist[a], dist[b]) */
+        Union,
+        SmoothUnion,
+        Subtract,
+        Intersection,
+        Displace,
+        /* Combine op with no opcode, called through the vtable */
+        CombineCall
+    };
+
+    struct Instruction {
+        Opcode op;
+        int32_t dst;
+        int32_t a;
+        int32_t b;
+        /* Index into transforms for Transform */
+        int32_t transform;
+        /* The SDF or SDFCombineOp for everything else */
+        void* object;
+    };
+
+    /* Instructions [begin, end) of a chain link, whose distance ends up in slot */
+    struct LinkRange {
+        int32_t begin;
+        int32_t end;
+        int32_t slot;
+    };
+
+    explicit SDFTape(SDFChain& root);
+
+    float dist(const glm::vec3& point);
+    DistResult minDist(const glm::vec3& point);
+    /* Same results as above for n points at once. Each instruction runs over
+       up to batchSize points before moving to the next one, so primitives
+       and combine ops use their SIMD batch versions. */
+    void dist(const float* xs, const float* ys, const float* zs, float* out, size_t n);
+    void minDist(const float* xs, const float* ys, const float* zs, DistResult* out, size_t n);
+
+    /* Everything known about the distances in a box from evaluating its center */
+    struct BoxDist {
+        /* dist() and minDist() at the center */
+        float distance;
+        float minDistance;
+        int minIndex;
+        /* Smallest of the other root links' distances */
+        float secondMin;
+        /* Lipschitz bound for all of the above within the box, can be infinite */
+        float lipschitz;
+    };
+    /* Evaluates the center with links culled by the whole box, so the values
+       hold for every point in it rather than just the center */
+    BoxDist boxDist(const SDFBounds& box);
+
+    static constexpr size_t batchSize = 256;
+
+    size_t size() const { return instructions.size(); }
+
+    /* Used by SDF::compile implementations. Return the slot written to. */
+    int emitTransform(const SDFTransformOp& transform, int point);
+    int emitPrimitive(Opcode op, void* sdf, int point);
+    int emitBinary(Opcode op, int a, int b, void* combineOp = nullptr);
+    /* Evaluates every link and folds them with their combine ops, like SDFChain::dist */
+    int emitChain(const std::vector<SDFLink>& links, int point, std::vector<LinkRange>* linkRanges = nullptr);
+
+private:
+    /* Sets linkActive for the root links that overlap box */
+    void cull(const SDFBounds& box);
+    void run(const glm::vec3& point, const SDFBounds& cullBox);
+    void runInstructions(size_t begin, size_t end);
+    void runBatch(const float* xs, const float* ys, const float* zs, size_t n);
+    void runBatchInstructions(size_t begin, size_t end, size_t n);
+    float* batchPoint(int slot, int axis) { return &batchPoints[(size_t(slot) * 3 + axis) * batchSize]; }
+    float* batchDistance(int slot) { return &batchDistances[size_t(slot) * batchSize]; }
+
+    std::vector<Instruction> instructions;
+    std::vector<SDFTransformOp> transforms;
+    std::vector<glm::vec3> points;
+    std::vector<float> distances;
+    /* batchSize floats per axis per point slot, and per distance slot */
+    std::vector<float> batchPoints;
+    std::vector<float> batchDistances;
+    /* The root chain's links, for culling and minDist. Its combine ops come after all of them. */
+    std::vector<LinkRange> rootLinks;
+    /* Bytes rather than bools, these are read and written for every point */
+    std::vector<uint8_t> rootCullable;
+    std::vector<uint8_t> linkActive;
+    std::vector<float> rootLipschitz;
+    /* Combine op of each root link, the first is unused */
+    std::vector<SDFCombineOp*> rootOps;
+    SDFBVH bvh;
+    int result;
+};
+
+#endif // SDFTAPE_H
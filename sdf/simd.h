@@ -0,0 +1,131 @@
+#ifndef SDFSIMD_H
+#define SDFSIMD_H
+#include <cstddef>
+
+/*
+Just enough of a SIMD wrapper to write the batch SDF kernels and the CPU
+renderer's ray packets once for every instruction set. The widest one the compiler is allowed to use is
+picked at build time (AVX2 needs -mavx2 or -march=native, SSE2 is always
+there on x86-64, NEON on AArch64), falling back to one float at a time.
+
+min, max and select follow glm's operand order (glm::min(a, b) is
+b < a ? b : a), so a kernel doing the same operations in the same order
+as the scalar dist() gives bit-identical results.
+*/
+#if defined(__AVX2__)
+#include <immintrin.h>
+namespace simd {
+constexpr size_t width = 8;
+struct Float { __m256 v; };
+struct Mask { __m256 v; };
+inline Float load(const float* p) { return {_mm256_loadu_ps(p)}; }
+inline void store(float* p, Float a) { _mm256_storeu_ps(p, a.v); }
+inline Float set(float s) { return {_mm256_set1_ps(s)}; }
+inline Float operator+(Float a, Float b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline Float operator-(Float a) { return {_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))}; }
+inline Mask operator<(Float a, Float b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+inline Mask operator<=(Float a, Float b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+inline Mask operator&&(Mask a, Mask b) { return {_mm256_and_ps(a.v, b.v)}; }
+inline Mask operator!(Mask a) { return {_mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))}; }
+inline Float select(Mask m, Float a, Float b) { return {_mm256_blendv_ps(b.v, a.v, m.v)}; }
+inline Float min(Float a, Float b) { return {_mm256_min_ps(b.v, a.v)}; }
+inline Float max(Float a, Float b) { return {_mm256_max_ps(b.v, a.v)}; }
+inline Float sqrt(Float a) { return {_mm256_sqrt_ps(a.v)}; }
+inline Float abs(Float a) { return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)}; }
+inline Float floor(Float a) { return {_mm256_floor_ps(a.v)}; }
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+namespace simd {
+constexpr size_t width = 4;
+struct Float { __m128 v; };
+struct Mask { __m128 v; };
+inline Float load(const float* p) { return {_mm_loadu_ps(p)}; }
+inline void store(float* p, Float a) { _mm_storeu_ps(p, a.v); }
+inline Float set(float s) { return {_mm_set1_ps(s)}; }
+inline Float operator+(Float a, Float b) { return {_mm_add_ps(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {_mm_div_ps(a.v, b.v)}; }
+inline Float operator-(Float a) { return {_mm_xor_ps(a.v, _mm_set1_ps(-0.0f))}; }
+inline Mask operator<(Float a, Float b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+inline Mask operator<=(Float a, Float b) { return {_mm_cmple_ps(a.v, b.v)}; }
+inline Mask operator&&(Mask a, Mask b) { return {_mm_and_ps(a.v, b.v)}; }
+inline Mask operator!(Mask a) { return {_mm_xor_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(-1)))}; }
+inline Float select(Mask m, Float a, Float b) { return {_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))}; }
+inline Float min(Float a, Float b) { return {_mm_min_ps(b.v, a.v)}; }
+inline Float max(Float a, Float b) { return {_mm_max_ps(b.v, a.v)}; }
+inline Float sqrt(Float a) { return {_mm_sqrt_ps(a.v)}; }
+inline Float abs(Float a) { return {_mm_andnot_ps(_mm_set1_ps(-0.0f), a.v)}; }
+/* No roundps before SSE4.1: truncate, then step down where that rounded up. Only for |a| < 2^31 */
+inline Float floor(Float a) {
+    const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return {_mm_sub_ps(truncated, _mm_and_ps(_mm_cmplt_ps(a.v, truncated), _mm_set1_ps(1.0f)))};
+}
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+namespace simd {
+constexpr size_t width = 4;
+struct Float { float32x4_t v; };
+struct Mask { uint32x4_t v; };
+inline Float load(const float* p) { return {vld1q_f32(p)}; }
+inline void store(float* p, Float a) { vst1q_f32(p, a.v); }
+inline Float set(float s) { return {vdupq_n_f32(s)}; }
+inline Float operator+(Float a, Float b) { return {vaddq_f32(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {vsubq_f32(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {vmulq_f32(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {vdivq_f32(a.v, b.v)}; }
+inline Float operator-(Float a) { return {vnegq_f32(a.v)}; }
+inline Mask operator<(Float a, Float b) { return {vcltq_f32(a.v, b.v)}; }
+inline Mask operator<=(Float a, Float b) { return {vcleq_f32(a.v, b.v)}; }
+inline Mask operator&&(Mask a, Mask b) { return {vandq_u32(a.v, b.v)}; }
+inline Mask operator!(Mask a) { return {vmvnq_u32(a.v)}; }
+inline Float select(Mask m, Float a, Float b) { return {vbslq_f32(m.v, a.v, b.v)}; }
+/* vminq/vmaxq order signed zeros differently from glm, so select instead */
+inline Float min(Float a, Float b) { return select(b < a, b, a); }
+inline Float max(Float a, Float b) { return select(a < b, b, a); }
+inline Float sqrt(Float a) { return {vsqrtq_f32(a.v)}; }
+inline Float abs(Float a) { return {vabsq_f32(a.v)}; }
+inline Float floor(Float a) { return {vrndmq_f32(a.v)}; }
+}
+#else
+#include <cmath>
+namespace simd {
+constexpr size_t width = 1;
+struct Float { float v; };
+struct Mask { bool v; };
+inline Float load(const float* p) { return {*p}; }
+inline void store(float* p, Float a) { *p = a.v; }
+inline Float set(float s) { return {s}; }
+inline Float operator+(Float a, Float b) { return {a.v + b.v}; }
+inline Float operator-(Float a, Float b) { return {a.v - b.v}; }
+inline Float operator*(Float a, Float b) { return {a.v * b.v}; }
+inline Float operator/(Float a, Float b) { return {a.v / b.v}; }
+inline Float operator-(Float a) { return {-a.v}; }
+inline Mask operator<(Float a, Float b) { return {a.v < b.v}; }
+inline Mask operator<=(Float a, Float b) { return {a.v <= b.v}; }
+inline Mask operator&&(Mask a, Mask b) { return {a.v && b.v}; }
+inline Mask operator!(Mask a) { return {!a.v}; }
+inline Float select(Mask m, Float a, Float b) { return m.v ? a : b; }
+inline Float min(Float a, Float b) { return (b.v < a.v) ? b : a; }
+inline Float max(Float a, Float b) { return (a.v < b.v) ? b : a; }
+inline Float sqrt(Float a) { return {std::sqrt(a.v)}; }
+inline Float abs(Float a) { return {std::fabs(a.v)}; }
+inline Float floor(Float a) { return {std::floor(a.v)}; }
+}
+#endif
+
+namespace simd {
+/* glm::sign */
+inline Float sign(Float a) {
+    const Float zero = set(0.0f);
+    return select(zero < a, set(1.0f), zero) - select(a < zero, set(1.0f), zero);
+}
+inline Float clamp(Float a, Float lo, Float hi) { return min(max(a, lo), hi); }
+}
+
+#endif // SDFSIMD_H
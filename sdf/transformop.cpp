@@ -3,6 +3,7 @@
 SDFTransformOp::SDFTransformOp()
 {
     transformMat = glm::mat4(1.0);
+    inverseMat = glm::mat4(1.0);
 }
 
 SDFTransformOp::~SDFTransformOp()
@@ -3,29 +3,47 @@
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include "sdf.h"
 
+/*
+Translations, rotations and scales applied to an SDF. The inverse is kept
+up to date as they are added, since that's what gets applied to every
+point. All of them are affine, so the bottom row of both matrices is
+always (0, 0, 0, 1) and points only need the top 3 rows.
+*/
 class SDFTransformOp
 {
 public:
     SDFTransformOp();
     virtual ~SDFTransformOp();
 
+    /* Same sums in the same order as glm's mat4 * vec4 with w = 1, minus the w row */
     glm::vec3 operator()(const glm::vec3& point) const {
-        glm::vec4 tv(point, 1);
-        tv = glm::inverse(transformMat) * tv;
-        return glm::vec3(tv.x, tv.y, tv.z);
+        const glm::mat4& m = inverseMat;
+        return glm::vec3((m[0][0] * point.x + m[1][0] * point.y) + (m[2][0] * point.z + m[3][0]),
+                         (m[0][1] * point.x + m[1][1] * point.y) + (m[2][1] * point.z + m[3][1]),
+                         (m[0][2] * point.x + m[1][2] * point.y) + (m[2][2] * point.z + m[3][2]));
     }
 
+    /* Each of these appends to transformMat, so its inverse goes on the other side */
     void addTranslation(const glm::vec3& t) {
         transformMat = glm::translate(transformMat, t);
+        inverseMat = glm::translate(glm::mat4(1.0f), -t) * inverseMat;
     }
 
     void addRotation(float angle, const glm::vec3& axis) {
         transformMat = glm::rotate(transformMat, angle, axis);
+        inverseMat = glm::rotate(glm::mat4(1.0f), -angle, axis) * inverseMat;
     }
 
     void addScale(const glm::vec3& scale) {
         transformMat = glm::scale(transformMat, scale);
+        inverseMat = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f / scale.x, 1.0f / scale.y, 1.0f / scale.z)) * inverseMat;
+    }
+
+    /* What operator() applies to points */
+    const glm::mat4& inverseMatrix() const {
+        return inverseMat;
     }
 
     glm::vec3 transformPoint(const glm::vec3& point) const {
@@ -34,8 +52,41 @@ public:
         return glm::vec3(tv.x, tv.y, tv.z);
     }
 
+    /*
+    Bound on how much operator() can stretch the distance between two points,
+    so an SDF evaluated through it has its lipschitz() times this. That's the
+    largest singular value of the inverse, whose square is at most any row sum
+    of |M^T M| for the top left 3x3 M.
+    */
+    float maxStretch() const {
+        float maxRow = 0.0f;
+        for (int i = 0; i < 3; i++) {
+            float row = 0.0f;
+            for (int j = 0; j < 3; j++) {
+                float dot = inverseMat[i][0] * inverseMat[j][0] + inverseMat[i][1] * inverseMat[j][1] + inverseMat[i][2] * inverseMat[j][2];
+                row += glm::abs(dot);
+            }
+            maxRow = glm::max(maxRow, row);
+        }
+        return glm::sqrt(maxRow);
+    }
+
+    /* Box around the 8 corners of bounds after transformPoint */
+    SDFBounds transformBounds(const SDFBounds& bounds) const {
+        SDFBounds result = {transformPoint(bounds.lo), transformPoint(bounds.lo)};
+        for (int corner = 1; corner < 8; corner++) {
+            glm::vec3 p((corner & 1) ? bounds.hi.x : bounds.lo.x,
+                        (corner & 2) ? bounds.hi.y : bounds.lo.y,
+                        (corner & 4) ? bounds.hi.z : bounds.lo.z);
+            p = transformPoint(p);
+            result.extend({p, p});
+        }
+        return result;
+    }
+
 protected:
     glm::mat4 transformMat;
+    glm::mat4 inverseMat;
 };
 
 #endif // SDFTRANSFORMOP_H
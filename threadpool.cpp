@@ -0,0 +1,149 @@
+#include "threadpool.h"
+#include "cpuprofiler.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers.reserve(numThreads);
+    for (unsigned int i = 0; i < numThreads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::enqueue(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        jobs.push_back(std::move(job));
+    }
+    jobAvailable.notify_one();
+}
+
+/* Shared by everyone working on one parallelFor, outlives the call if a helper starts late */
+struct ParallelFor {
+    std::function<void(int)> body;
+    int count;
+    std::atomic<int> next;
+    std::atomic<int> remaining;
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::exception_ptr firstError = nullptr;
+};
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& body)
+{
+    if (count <= 0) {
+        return;
+    }
+    std::shared_ptr<ParallelFor> state = std::make_shared<ParallelFor>();
+    state->body = body;
+    state->count = count;
+    state->next = 0;
+    state->remaining = count;
+
+    /* Whoever is free takes the next index, so uneven work balances itself out */
+    auto work = [state]() {
+        for (;;) {
+            int i = state->next++;
+            if (i >= state->count) {
+                return;
+            }
+            try {
+                state->body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->firstError) {
+                    state->firstError = std::current_exception();
+                }
+            }
+            if (--state->remaining == 0) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+    const unsigned int helpers = std::min(size(), static_cast<unsigned int>(count - 1));
+    for (unsigned int i = 0; i < helpers; i++) {
+        enqueue(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&state] { return state->remaining == 0; });
+    if (state->firstError) {
+        std::rethrow_exception(state->firstError);
+    }
+}
+
+void ThreadPool::waitIdle()
+{
+    std::unique_lock<std::mutex> lock(jobsMutex);
+    jobsFinished.wait(lock, [this] { return jobs.empty() && activeJobs == 0; });
+    if (firstError) {
+        std::exception_ptr e = firstError;
+        firstError = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void ThreadPool::rethrowErrors()
+{
+    std::exception_ptr e = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        std::swap(e, firstError);
+    }
+    if (e) {
+        std::rethrow_exception(e);
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    PROFILE_THREAD_NAME("worker");
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(jobsMutex);
+            jobAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping && jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            activeJobs++;
+        }
+        try {
+            job();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            if (!firstError) {
+                firstError = std::current_exception();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            activeJobs--;
+            if (jobs.empty() && activeJobs == 0) {
+                jobsFinished.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <vector>
+#include <deque>
+
+/*
+Fixed size pool of worker threads pulling jobs off a shared FIFO queue.
+Jobs must not touch memory that another job in flight is writing to.
+*/
+class ThreadPool
+{
+public:
+    /* numThreads == 0 means one worker per hardware thread */
+    explicit ThreadPool(unsigned int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void enqueue(std::function<void()> job);
+    /* Run body(i) for every i in [0, count) on the workers and the calling thread, returning
+       once all of them are done. The caller takes indices itself instead of waiting for a
+       free worker, so this can be called from inside a job. Rethrows the first exception. */
+    void parallelFor(int count, const std::function<void(int)>& body);
+    /* Block until the queue is empty and no job is running.
+       Rethrows the first exception thrown by a job since the last wait. */
+    void waitIdle();
+    /* Rethrows the first exception thrown by a job since the last call, without waiting */
+    void rethrowErrors();
+    unsigned int size() const { return static_cast<unsigned int>(workers.size()); }
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex jobsMutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable jobsFinished;
+    unsigned int activeJobs = 0;
+    bool stopping = false;
+    std::exception_ptr firstError = nullptr;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,273 @@
+#include "uploadmanager.h"
+#include <cstring>
+#include <stdexcept>
+
+void UploadManager::init(VkDevice _device, DeviceAllocator* _allocator, VkQueue _queue, uint32_t queueFamily, VkDeviceSize _arenaSize) {
+    device = _device;
+    allocator = _allocator;
+    queue = _queue;
+    arenaSize = _arenaSize;
+
+    VkCommandPoolCreateInfo poolInfo {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = queueFamily;
+
+    if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upload command pool!");
+    }
+
+    arena = createStagingBuffer(arenaSize, arenaAllocation);
+}
+
+void UploadManager::destroy() {
+    if (commandPool == VK_NULL_HANDLE) {
+        return;
+    }
+    if (isOpen) {
+        submit();
+    }
+    waitIdle();
+    for (Batch& batch : spareBatches) {
+        vkDestroyFence(device, batch.fence, nullptr);
+    }
+    spareBatches.clear();
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    commandPool = VK_NULL_HANDLE;
+
+    vkDestroyBuffer(device, arena, nullptr);
+    allocator->free(arenaAllocation);
+    arena = VK_NULL_HANDLE;
+}
+
+VkBuffer UploadManager::createStagingBuffer(VkDeviceSize size, DeviceAllocation& allocation) {
+    VkBufferCreateInfo bufferInfo {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer buffer;
+    if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create staging buffer!");
+    }
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+    allocation = allocator->allocate(memRequirements,
+                                     allocator->findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
+                                     false);
+    vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+    return buffer;
+}
+
+UploadManager::Batch& UploadManager::openBatch() {
+    if (isOpen) {
+        return open;
+    }
+    if (!spareBatches.empty()) {
+        open = std::move(spareBatches.back());
+        spareBatches.pop_back();
+    } else {
+        VkCommandBufferAllocateInfo allocInfo {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = commandPool;
+        allocInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(device, &allocInfo, &open.commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate upload command buffer!");
+        }
+
+        VkFenceCreateInfo fenceInfo {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        if (vkCreateFence(device, &fenceInfo, nullptr, &open.fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upload fence!");
+        }
+    }
+    open.ringEnd = head;
+    open.ringConsumed = 0;
+    open.ownStaging.clear();
+
+    VkCommandBufferBeginInfo beginInfo {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(open.commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin upload command buffer!");
+    }
+    isOpen = true;
+    return open;
+}
+
+VkCommandBuffer UploadManager::commandBuffer() {
+    return openBatch().commandBuffer;
+}
+
+/* Free space is [head, tail) going around the end, empty or full when they meet */
+bool UploadManager::reserve(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) {
+    if (ringUsed == 0) {
+        head = tail = 0;
+    } else if (head == tail) {
+        return false;
+    }
+    VkDeviceSize start = (head + alignment - 1) / alignment * alignment;
+    if (head >= tail) {
+        if (start + size > arenaSize) {
+            /* Skip the end of the arena and start over at 0 */
+            if (size > tail) {
+                return false;
+            }
+            start = 0;
+            ringUsed += arenaSize - head;
+            open.ringConsumed += arenaSize - head;
+            head = 0;
+        }
+    } else if (start + size > tail) {
+        return false;
+    }
+    ringUsed += start + size - head;
+    open.ringConsumed += start + size - head;
+    head = start + size;
+    open.ringEnd = head;
+    offset = start;
+    return true;
+}
+
+UploadManager::Staging UploadManager::stage(VkDeviceSize size, VkDeviceSize alignment) {
+    openBatch();
+    if (size <= arenaSize) {
+        collect();
+        VkDeviceSize offset;
+        bool reserved = reserve(size, alignment, offset);
+        /* Arena's full, wait for the oldest batches to give some back */
+        while (!reserved && !inFlight.empty()) {
+            wait(inFlight.front().ticket);
+            reserved = reserve(size, alignment, offset);
+        }
+        if (reserved) {
+            return {static_cast<uint8_t*>(arenaAllocation.mapped) + offset, arena, offset};
+        }
+    }
+    /* Bigger than the arena, or the open batch has filled it by itself */
+    DeviceAllocation allocation;
+    VkBuffer buffer = createStagingBuffer(size, allocation);
+    open.ownStaging.push_back({buffer, allocation});
+    return {allocation.mapped, buffer, 0};
+}
+
+void UploadManager::copyToBuffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset) {
+    Staging staging = stage(size);
+    memcpy(staging.data, data, static_cast<size_t>(size));
+
+    VkBufferCopy region {};
+    region.srcOffset = staging.offset;
+    region.dstOffset = dstOffset;
+    region.size = size;
+    vkCmdCopyBuffer(open.commandBuffer, staging.buffer, dst, 1, &region);
+}
+
+void UploadManager::copyToImage(const void* pixels, VkDeviceSize size, VkImage image, uint32_t width, uint32_t height) {
+    Staging staging = stage(size);
+    memcpy(staging.data, pixels, static_cast<size_t>(size));
+
+    VkBufferImageCopy region {};
+    region.bufferOffset = staging.offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {width, height, 1};
+    vkCmdCopyBufferToImage(open.commandBuffer, staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+}
+
+uint64_t UploadManager::submit(TimelinePoint wait, TimelinePoint signal) {
+    if (!isOpen) {
+        return lastSubmitted;
+    }
+    if (vkEndCommandBuffer(open.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record upload command buffer!");
+    }
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.waitSemaphoreValueCount = 1;
+    timelineInfo.pWaitSemaphoreValues = &wait.value;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &signal.value;
+
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkSubmitInfo submitInfo {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &open.commandBuffer;
+    if (wait.semaphore != VK_NULL_HANDLE) {
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &wait.semaphore;
+        submitInfo.pWaitDstStageMask = &waitStage;
+    } else {
+        timelineInfo.waitSemaphoreValueCount = 0;
+    }
+    if (signal.semaphore != VK_NULL_HANDLE) {
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &signal.semaphore;
+    } else {
+        timelineInfo.signalSemaphoreValueCount = 0;
+    }
+    if (wait.semaphore != VK_NULL_HANDLE || signal.semaphore != VK_NULL_HANDLE) {
+        submitInfo.pNext = &timelineInfo;
+    }
+
+    if (vkQueueSubmit(queue, 1, &submitInfo, open.fence) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit uploads!");
+    }
+    open.ticket = ++lastSubmitted;
+    inFlight.push_back(std::move(open));
+    isOpen = false;
+    return lastSubmitted;
+}
+
+void UploadManager::retireOldest() {
+    Batch& batch = inFlight.front();
+    /* Batches that staged nothing in the arena mustn't move tail, head may have been reset since */
+    if (batch.ringConsumed > 0) {
+        tail = batch.ringEnd;
+        ringUsed -= batch.ringConsumed;
+    }
+    for (std::pair<VkBuffer, DeviceAllocation>& own : batch.ownStaging) {
+        vkDestroyBuffer(device, own.first, nullptr);
+        allocator->free(own.second);
+    }
+    batch.ownStaging.clear();
+    vkResetFences(device, 1, &batch.fence);
+    lastCompleted = batch.ticket;
+    spareBatches.push_back(std::move(batch));
+    inFlight.pop_front();
+}
+
+void UploadManager::collect() {
+    /* A queue finishes batches in the order they were submitted */
+    while (!inFlight.empty() && vkGetFenceStatus(device, inFlight.front().fence) == VK_SUCCESS) {
+        retireOldest();
+    }
+}
+
+bool UploadManager::isComplete(uint64_t ticket) {
+    collect();
+    return ticket <= lastCompleted;
+}
+
+void UploadManager::wait(uint64_t ticket) {
+    while (!inFlight.empty() && inFlight.front().ticket <= ticket) {
+        if (vkWaitForFences(device, 1, &inFlight.front().fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            throw std::runtime_error("failed to wait for uploads!");
+        }
+        retireOldest();
+    }
+}
+
+void UploadManager::waitIdle() {
+    wait(lastSubmitted);
+}
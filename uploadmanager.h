@@ -0,0 +1,103 @@
+#ifndef UPLOADMANAGER_H
+#define UPLOADMANAGER_H
+#include <vulkan/vulkan.h>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include "deviceallocator.h"
+
+/*
+Batches uploads through a persistently mapped staging arena.
+
+Callers stage data, record copies and barriers into commandBuffer() and
+submit() them all as one batch. Nothing waits for the GPU: every batch
+has a fence, and collect() hands its part of the arena back once that
+fence has signalled. The arena is used as a ring, so staging only blocks
+when it's full of batches still in flight. Anything too big for the
+arena gets a staging buffer of its own, freed along with its batch.
+
+A manager submits to a single queue, so whatever is recorded has to be
+valid on that queue's family. Not thread safe.
+*/
+class UploadManager
+{
+public:
+    struct Staging {
+        void* data;
+        VkBuffer buffer;
+        VkDeviceSize offset;
+    };
+
+    /* A timeline semaphore value, ignored if semaphore is VK_NULL_HANDLE */
+    struct TimelinePoint {
+        VkSemaphore semaphore;
+        uint64_t value;
+    };
+
+    void init(VkDevice device, DeviceAllocator* allocator, VkQueue queue, uint32_t queueFamily, VkDeviceSize arenaSize);
+    /* Waits for every batch, submitted or not, then frees everything */
+    void destroy();
+
+    /* size bytes of host visible memory in the open batch, valid until the batch completes */
+    Staging stage(VkDeviceSize size, VkDeviceSize alignment = 16);
+    /* Stage data and record a copy of it into dst */
+    void copyToBuffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset = 0);
+    /* Stage tightly packed pixels and record a copy into mip 0, the image must be in TRANSFER_DST_OPTIMAL by then */
+    void copyToImage(const void* pixels, VkDeviceSize size, VkImage image, uint32_t width, uint32_t height);
+    /* The open batch's command buffer, begun on first use */
+    VkCommandBuffer commandBuffer();
+
+    /*
+    Submit the open batch, waiting for and signalling the given timeline
+    values on the GPU. Returns a ticket for isComplete and wait, or the
+    previous one if nothing was recorded since.
+    */
+    uint64_t submit(TimelinePoint wait = {}, TimelinePoint signal = {});
+    /* Release the staging memory of finished batches, never blocks */
+    void collect();
+    bool isComplete(uint64_t ticket);
+    void wait(uint64_t ticket);
+    void waitIdle();
+
+    VkDeviceSize arenaUsed() const { return ringUsed; }
+    size_t batchesInFlight() const { return inFlight.size(); }
+
+private:
+    struct Batch {
+        VkCommandBuffer commandBuffer;
+        VkFence fence;
+        uint64_t ticket;
+        /* Where the arena's head was after this batch's last allocation, and what it took including padding */
+        VkDeviceSize ringEnd;
+        VkDeviceSize ringConsumed;
+        std::vector<std::pair<VkBuffer, DeviceAllocation>> ownStaging;
+    };
+
+    Batch& openBatch();
+    bool reserve(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+    void retireOldest();
+    VkBuffer createStagingBuffer(VkDeviceSize size, DeviceAllocation& allocation);
+
+    VkDevice device = VK_NULL_HANDLE;
+    DeviceAllocator* allocator = nullptr;
+    VkQueue queue = VK_NULL_HANDLE;
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+
+    VkBuffer arena = VK_NULL_HANDLE;
+    DeviceAllocation arenaAllocation;
+    VkDeviceSize arenaSize = 0;
+    /* Allocations go at head, finished batches free up space from tail */
+    VkDeviceSize head = 0;
+    VkDeviceSize tail = 0;
+    VkDeviceSize ringUsed = 0;
+
+    Batch open;
+    bool isOpen = false;
+    std::deque<Batch> inFlight;
+    std::vector<Batch> spareBatches;
+    uint64_t lastSubmitted = 0;
+    uint64_t lastCompleted = 0;
+};
+
+#endif // UPLOADMANAGER_H
@@ -1,15 +1,19 @@
 #include "worldgenerator.h"
+#include "cpuprofiler.h"
 #include <iostream>
 #include <random>
 #include <cstring>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <functional>
 
 constexpr int max_search_radius = 64;
 
-static std::random_device rd;
-static std::mt19937 rng{rd()};
+uint32_t WorldGenerator::seed = 0;
 
-static int randomStoneMutation() {
-    static std::uniform_int_distribution<int> uid(1,256);
+static int randomStoneMutation(std::mt19937& rng) {
+    std::uniform_int_distribution<int> uid(1,256);
     int rint = uid(rng);
     if (rint >= 250) {
         return rint % 3 + 4;
@@ -37,7 +41,7 @@ static int findClosestVoxel(int tx, int ty, int tz, VoxelChunk* chunkIn) {
                 for (z = std::max(0, tz - radius); (z <= tz + radius) && (z < CHUNK_HEIGHT_VOXELS); z++) {
                     boundsCheck(x, y, z);
                     std::cout << "Checking " << x << ", " << y << ", " << z << std::endl;
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
+                    if (chunkIn->isSolid(x, y, z)) {
                         std::cout << "Found closest voxel at " << x << ", " << y << ", " << z << ". radius = " << radius << std::endl;
                         return radius - 1;
                     }
@@ -51,7 +55,7 @@ static int findClosestVoxel(int tx, int ty, int tz, VoxelChunk* chunkIn) {
                 for (z = std::max(0, tz - radius); (z <= tz + radius) && (z < CHUNK_HEIGHT_VOXELS); z++) {
                     boundsCheck(x, y, z);
                     std::cout << "Checking " << x << ", " << y << ", " << z << std::endl;
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
+                    if (chunkIn->isSolid(x, y, z)) {
                         std::cout << "Found closest voxel at " << x << ", " << y << ", " << z << ". radius = " << radius << std::endl;
                         return radius - 1;
                     }
@@ -65,7 +69,7 @@ static int findClosestVoxel(int tx, int ty, int tz, VoxelChunk* chunkIn) {
                 for (z = std::max(0, tz - radius); (z < tz + radius) && (z < CHUNK_HEIGHT_VOXELS); z++) {
                     boundsCheck(x, y, z);
                     std::cout << "Checking " << x << ", " << y << ", " << z << std::endl;
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
+                    if (chunkIn->isSolid(x, y, z)) {
                         std::cout << "Found closest voxel at " << x << ", " << y << ", " << z << ". radius = " << radius << std::endl;
                         return radius - 1;
                     }
@@ -79,7 +83,7 @@ static int findClosestVoxel(int tx, int ty, int tz, VoxelChunk* chunkIn) {
                 for (z = std::max(0, tz - radius); (z < tz + radius) && (z < CHUNK_HEIGHT_VOXELS); z++) {
                     boundsCheck(x, y, z);
                     std::cout << "Checking " << x << ", " << y << ", " << z << std::endl;
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
+                    if (chunkIn->isSolid(x, y, z)) {
                         std::cout << "Found closest voxel at " << x << ", " << y << ", " << z << ". radius = " << radius << std::endl;
                         return radius - 1;
                     }
@@ -93,7 +97,7 @@ static int findClosestVoxel(int tx, int ty, int tz, VoxelChunk* chunkIn) {
                 for (y = std::max(0, ty - radius + 1); (y < ty + radius - 1) && (y < CHUNK_WIDTH_VOXELS); y++) {
                     boundsCheck(x, y, z);
                     std::cout << "Checking " << x << ", " << y << ", " << z << std::endl;
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
+                    if (chunkIn->isSolid(x, y, z)) {
                         std::cout << "Found closest voxel at " << x << ", " << y << ", " << z << ". radius = " << radius << std::endl;
                         return radius - 1;
                     }
@@ -107,7 +111,7 @@ static int findClosestVoxel(int tx, int ty, int tz, VoxelChunk* chunkIn) {
                 for (y = std::max(0, ty - radius + 1); (y < ty + radius - 1) && (y < CHUNK_WIDTH_VOXELS); y++) {
                     boundsCheck(x, y, z);
                     std::cout << "Checking " << x << ", " << y << ", " << z << std::endl;
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
+                    if (chunkIn->isSolid(x, y, z)) {
                         std::cout << "Found closest voxel at " << x << ", " << y << ", " << z << ". radius = " << radius << std::endl;
                         return radius - 1;
                     }
@@ -128,7 +132,7 @@ static int randomGrassBend(int b) {
     return 0;
 }
 
-static void grassTest(VoxelChunk* result, double minHeight) {
+static void grassTest(VoxelChunk* result, double minHeight, std::mt19937& rng) {
     const float allStoneHeight = minHeight * 0.1f; // Everything below 10% of minHeight is all stone
     std::uniform_int_distribution<int> stoneChance(0, 500);
     constexpr double stone_scale_factor = 32.0;
@@ -139,10 +143,10 @@ static void grassTest(VoxelChunk* result, double minHeight) {
                 if (z <= allStoneHeight) {
                     double stoneHeight = Perlin::perlin(x / stone_scale_factor, y / stone_scale_factor, 55);
                     if (z < (stoneHeight * allStoneHeight)) {
-                        result->setVoxel(x, y, z, -Stone);
+                        result->setMaterial(x, y, z, Stone);
                         continue;
                     } else {
-                        result->setVoxel(x, y, z, -Dirt);
+                        result->setMaterial(x, y, z, Dirt);
                     }
                 }
                 double height = minHeight;
@@ -150,12 +154,12 @@ static void grassTest(VoxelChunk* result, double minHeight) {
                 isStone *= isStone;
                 float stoneChanceForZ = float(z) / float(CHUNK_HEIGHT_VOXELS);
                 if (isStone > stoneChanceForZ) {
-                    result->setVoxel(x, y, z, -Stone);
+                    result->setMaterial(x, y, z, Stone);
                 } else {
-                    result->setVoxel(x, y, z, -Dirt);
+                    result->setMaterial(x, y, z, Dirt);
                 }
                 */
-                result->setVoxel(x, y, z, -Dirt);
+                result->setMaterial(x, y, z, Dirt);
             }
         }
         //std::cout << "\rGenerating dirt voxels: " << x + 1 << " / " << CHUNK_WIDTH_VOXELS;
@@ -168,22 +172,137 @@ static void grassTest(VoxelChunk* result, double minHeight) {
     std::uniform_int_distribution<int> randomCoord(0, CHUNK_WIDTH_VOXELS - 1);
     for (int x = 0; x < CHUNK_WIDTH_VOXELS; x++) {
         for (int y = 0; y < CHUNK_WIDTH_VOXELS; y++) {
-            result->setVoxel(x, y, minHeight - 1, -Grass);
+            result->setMaterial(x, y, minHeight - 1, Grass);
         }
     }
     for (int i = 0; i < num_grass_blades; i++) {
         int randomX = randomCoord(rng);
         int randomY = randomCoord(rng);
-        result->setVoxel(randomX, randomY, minHeight, -Grass);
+        result->setMaterial(randomX, randomY, minHeight, Grass);
     }
 }
 
 const glm::vec3 voxelCenter(0.5 / float(VOXELS_PER_METER), 0.5 / float(VOXELS_PER_METER), 0.5 / float(VOXELS_PER_METER));
 
+/* How voxelizers evaluate their SDF. Anything but Octree is only there for benchmarkSDFTape to compare against. */
+enum class SDFEvaluation {
+    /* SDFChain with culling turned off */
+    Unculled,
+    Chain,
+    Tape,
+    /* One block of voxels per call */
+    TapeBatch,
+    /* rasterizeOctree, with TapeBatch for the cells it can't fill */
+    Octree
+};
+
+static glm::vec3 voxelPosition(int x, int y, int z) {
+    return glm::vec3(float(x) / float(VOXELS_PER_METER) + voxelCenter.x,
+                     float(y) / float(VOXELS_PER_METER) + voxelCenter.y,
+                     float(z) / float(VOXELS_PER_METER) + voxelCenter.z);
+}
+
+/*
+Calls evaluate(xs, ys, zs, n) with the centers of the voxels in each small
+block of the voxels from lo to hi (exclusive), then store(x, y, z, i) for each
+of those voxels, where i is its index in xs, ys and zs. Batched tapes cull by
+the bounds of each call, so blocks are kept much smaller than whole columns.
+*/
+constexpr int VOXEL_BLOCK_XY = 4;
+constexpr int VOXEL_BLOCK_Z = 16;
+constexpr int VOXEL_BLOCK_SIZE = VOXEL_BLOCK_XY * VOXEL_BLOCK_XY * VOXEL_BLOCK_Z;
+
+template<typename Evaluate, typename Store>
+static void voxelizeBlocks(const glm::ivec3& lo, const glm::ivec3& hi, Evaluate evaluate, Store store) {
+    float xs[VOXEL_BLOCK_SIZE], ys[VOXEL_BLOCK_SIZE], zs[VOXEL_BLOCK_SIZE];
+    for (int bx = lo.x; bx < hi.x; bx += VOXEL_BLOCK_XY) {
+        for (int by = lo.y; by < hi.y; by += VOXEL_BLOCK_XY) {
+            for (int bz = lo.z; bz < hi.z; bz += VOXEL_BLOCK_Z) {
+                const int endX = std::min(bx + VOXEL_BLOCK_XY, hi.x);
+                const int endY = std::min(by + VOXEL_BLOCK_XY, hi.y);
+                const int endZ = std::min(bz + VOXEL_BLOCK_Z, hi.z);
+                int n = 0;
+                for (int x = bx; x < endX; x++) {
+                    for (int y = by; y < endY; y++) {
+                        for (int z = bz; z < endZ; z++) {
+                            glm::vec3 p = voxelPosition(x, y, z);
+                            xs[n] = p.x;
+                            ys[n] = p.y;
+                            zs[n] = p.z;
+                            n++;
+                        }
+                    }
+                }
+                evaluate(xs, ys, zs, n);
+                n = 0;
+                for (int x = bx; x < endX; x++) {
+                    for (int y = by; y < endY; y++) {
+                        for (int z = bz; z < endZ; z++) {
+                            store(x, y, z, n++);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Octree rasterizer for the voxels from lo to hi of a fragment.
+classify(box, radius, voxel) gets the box around a cell's voxel centers and
+the distance from its center to the furthest of them, and returns true if
+it can tell every voxel in the cell is the same, setting voxel to it. With a
+Lipschitz bound that's whenever the distance at the center is more than the
+bound times radius. Cells it can't tell are split in half along every axis
+longer than RASTER_LEAF_SIZE voxels, down to leaves that go through
+voxelizeBlocks. The work ends up following the surface rather than the
+volume, and the voxels are the same as sampling every one of them.
+*/
+constexpr int RASTER_LEAF_SIZE = 8;
+/* Slack for rounding when comparing distances to Lipschitz bounds */
+constexpr float RASTER_MARGIN = 1.0f / 1024.0f;
+
+template<typename Classify, typename Evaluate, typename Store>
+static void rasterizeOctree(VoxelFragment& fragment, const glm::ivec3& lo, const glm::ivec3& hi,
+                            Classify classify, Evaluate evaluate, Store store) {
+    const glm::vec3 first = voxelPosition(lo.x, lo.y, lo.z);
+    const glm::vec3 last = voxelPosition(hi.x - 1, hi.y - 1, hi.z - 1);
+    Material material;
+    if (classify(SDFBounds{first, last}, glm::length(last - first) * 0.5f, material)) {
+        for (int z = lo.z; z < hi.z; z++) {
+            for (int y = lo.y; y < hi.y; y++) {
+                for (int x = lo.x; x < hi.x; x++) {
+                    fragment.setMaterial(x, y, z, material);
+                }
+            }
+        }
+        return;
+    }
+    const int sizeX = hi.x - lo.x;
+    const int sizeY = hi.y - lo.y;
+    const int sizeZ = hi.z - lo.z;
+    if (sizeX <= RASTER_LEAF_SIZE && sizeY <= RASTER_LEAF_SIZE && sizeZ <= RASTER_LEAF_SIZE) {
+        voxelizeBlocks(lo, hi, evaluate, store);
+        return;
+    }
+    /* Axes that aren't split have mid == hi, so their second half is empty */
+    const glm::ivec3 mid(sizeX > RASTER_LEAF_SIZE ? lo.x + sizeX / 2 : hi.x,
+                         sizeY > RASTER_LEAF_SIZE ? lo.y + sizeY / 2 : hi.y,
+                         sizeZ > RASTER_LEAF_SIZE ? lo.z + sizeZ / 2 : hi.z);
+    for (int child = 0; child < 8; child++) {
+        glm::ivec3 childLo((child & 1) ? mid.x : lo.x, (child & 2) ? mid.y : lo.y, (child & 4) ? mid.z : lo.z);
+        glm::ivec3 childHi((child & 1) ? hi.x : mid.x, (child & 2) ? hi.y : mid.y, (child & 4) ? hi.z : mid.z);
+        if (childLo.x < childHi.x && childLo.y < childHi.y && childLo.z < childHi.z) {
+            rasterizeOctree(fragment, childLo, childHi, classify, evaluate, store);
+        }
+    }
+}
+
 /*
 Returns a voxel fragment contained within an AABB from origin to dimensions
 */
-static VoxelFragment* proceduralTree(const glm::vec3& dimensions) {
+static VoxelFragment* proceduralTree(const glm::vec3& dimensions, std::mt19937& rng,
+                                     SDFEvaluation evaluation = SDFEvaluation::Octree) {
     VoxelFragment* result = new VoxelFragment(VOXELS_PER_METER * glm::ceil(dimensions.x),
                                               VOXELS_PER_METER * glm::ceil(dimensions.y),
                                               VOXELS_PER_METER * glm::ceil(dimensions.z));
@@ -269,20 +388,43 @@ static VoxelFragment* proceduralTree(const glm::vec3& dimensions) {
         treeChain.addLink(curBranch);
     }
 
-    for (int x = 0; x < result->sizeX; x++) {
-        for (int y = 0; y < result->sizeY; y++) {
-            for (int z = 0; z < result->sizeZ; z++) {
-                glm::vec3 curPoint(float(x) / float(VOXELS_PER_METER) + voxelCenter.x,
-                                   float(y) / float(VOXELS_PER_METER) + voxelCenter.y,
-                                   float(z) / float(VOXELS_PER_METER) + voxelCenter.z);
-                float distSample = treeChain.dist(curPoint);
-                if (distSample < 0.0f) {
-                    result->setVoxel(x, y, z, -4);
-                } else {
-                    result->setVoxel(x, y, z, 0);
-                }
+    treeChain.setCulling(evaluation != SDFEvaluation::Unculled);
+    SDFTape treeTape(treeChain);
+    float block[VOXEL_BLOCK_SIZE];
+    auto evaluate = [&](const float* xs, const float* ys, const float* zs, int n) {
+        if (evaluation == SDFEvaluation::TapeBatch || evaluation == SDFEvaluation::Octree) {
+            treeTape.dist(xs, ys, zs, block, n);
+        } else {
+            for (int i = 0; i < n; i++) {
+                glm::vec3 curPoint(xs[i], ys[i], zs[i]);
+                block[i] = evaluation == SDFEvaluation::Tape ? treeTape.dist(curPoint) : treeChain.dist(curPoint);
             }
         }
+    };
+    auto store = [&](int x, int y, int z, int i) {
+        if (block[i] < 0.0f) {
+            result->setMaterial(x, y, z, Bark);
+        } else {
+            result->setMaterial(x, y, z, 0);
+        }
+    };
+    const glm::ivec3 size(result->sizeX, result->sizeY, result->sizeZ);
+    if (evaluation == SDFEvaluation::Octree) {
+        rasterizeOctree(*result, glm::ivec3(0, 0, 0), size, [&](const SDFBounds& box, float radius, Material& material) {
+            SDFTape::BoxDist cell = treeTape.boxDist(box);
+            const float margin = cell.lipschitz * radius + RASTER_MARGIN;
+            if (cell.distance > margin) {
+                material = 0;
+                return true;
+            }
+            if (cell.distance < -margin) {
+                material = Bark;
+                return true;
+            }
+            return false;
+        }, evaluate, store);
+    } else {
+        voxelizeBlocks(glm::ivec3(0, 0, 0), size, evaluate, store);
     }
     delete[] branchCones;
 
@@ -298,86 +440,320 @@ static void blitVoxels(VoxelChunk* dst, VoxelFragment* src, int sx, int sy, int
             for (int z = 0; (z + sz < CHUNK_HEIGHT_VOXELS) && (z < src->sizeZ); z++) {
                 //int dstIndex = (sx + x) + (sy + y) * CHUNK_WIDTH_VOXELS + (sz + z) * CHUNK_WIDTH_VOXELS * CHUNK_WIDTH_VOXELS;
                 int srcIndex = x + y * src->sizeX + z * src->sizeX * src->sizeY;
-                if (src->voxels[srcIndex] < 0) {
-                    dst->setVoxel(sx + x, sy + y, sz + z, src->voxels[srcIndex]);
+                if (src->materials[srcIndex] != 0) {
+                    dst->setMaterial(sx + x, sy + y, sz + z, src->materials[srcIndex]);
                 }
             }
         }
     }
 }
 
-static void forestTest(VoxelChunk* dst) {
+static void forestTest(VoxelChunk* dst, std::mt19937& rng) {
     double grassHeight = 128;
-    grassTest(dst, grassHeight);
+    grassTest(dst, grassHeight, rng);
     /*
     for (int x = 0; x < VOXELS_PER_METER; x++) {
         for (int y = 0; y < VOXELS_PER_METER; y++) {
             for (int z = 0; z < VOXELS_PER_METER; z++) {
                 if ((x * x + y * y) < 64) {
-                    result->setVoxel(x, y, z, -4);
+                    result->setMaterial(x, y, z, Bark);
                 } else {
-                    result->setVoxel(x, y, z, 0);
+                    result->setMaterial(x, y, z, 0);
                 }
-                result->setVoxel(x, y, z, -4);
+                result->setMaterial(x, y, z, Bark);
             }
         }
     }
     */
     const glm::vec3 treeDimensions(5, 5, 20);
-    VoxelFragment* src = proceduralTree(treeDimensions);
+    VoxelFragment* src = proceduralTree(treeDimensions, rng);
     std::uniform_int_distribution<int> randomTreeX(0, CHUNK_WIDTH_VOXELS - src->sizeX - 1);
     int randomX = randomTreeX(rng);
     int randomY = randomTreeX(rng);
     blitVoxels(dst, src, randomX, randomY, int(grassHeight));
-    delete[] src->voxels;
+    delete[] src->materials;
 }
 
-static int findClosestVoxelSafe(int tx, int ty, int tz, VoxelChunk* chunkIn) {
+/*
+Brute force reference for computeDistances: grows a cube around (tx,ty,tz)
+until it contains a solid voxel. Only used to validate the fast transform.
+*/
+template <typename Grid>
+static int findClosestVoxelSafe(int tx, int ty, int tz, Grid* chunkIn) {
     for (int radius = 1; radius < max_search_radius; radius++) {
         for (int x = tx - radius; x < tx + radius + 1; x++) {
-            if (x < 0 || x >= CHUNK_WIDTH_VOXELS)
+            if (x < 0 || x >= chunkIn->sizeX)
                 continue;
             for (int y = ty - radius; y < ty + radius + 1; y++) {
-                if (y < 0 || y >= CHUNK_WIDTH_VOXELS)
+                if (y < 0 || y >= chunkIn->sizeY)
                     continue;
                 for (int z = tz - radius; z < tz + radius + 1; z++) {
-                    if (z < 0 || z >= CHUNK_WIDTH_VOXELS)
+                    if (z < 0 || z >= chunkIn->sizeZ)
                         continue;
-                    boundsCheck(x, y, z);
-                    if (chunkIn->getVoxel(x, y, z) < 0) {
-                        /*
-                        std::cout << "Found closest voxel for " << tx << ", " << ty << ", " << tz
-                                                      << " at " << x << ", " << y << ", " << z
-                                                      << ". radius = " << radius <<
-                                                      ", value = " << int(chunkIn->voxels[x][y][z]) << std::endl;
-                        */
-                        assert(x == 0 || x == CHUNK_WIDTH_VOXELS-1 || y == 0 || y == CHUNK_WIDTH_VOXELS-1 || z == 0 || z == CHUNK_HEIGHT_VOXELS-1);
+                    if (chunkIn->isSolid(x, y, z)) {
                         return radius - 1;
                     }
                 }
             }
         }
     }
-    std::cout << "No voxel close enough to " << tx << ", " << ty << ", " << tz << std::endl;
     return 0;
 }
 
-/* Fill out all zero voxels with the distances to closest voxel */
-static void computeDistances(VoxelChunk* chunkIn) {
-    std::cout << "Computing distances. Total to compute: " << CHUNK_WIDTH_VOXELS << " ^2 * " << CHUNK_HEIGHT_VOXELS << std::endl;
-    for (int x = 0; x < CHUNK_WIDTH_METERS * VOXELS_PER_METER; x++) {
-        for (int y = 0; y < CHUNK_WIDTH_METERS * VOXELS_PER_METER; y++) {
-            for (int z = 0; z < CHUNK_HEIGHT_METERS * VOXELS_PER_METER; z++) {
-                //boundsCheck(x, y, z);
+template <typename Grid>
+static void computeDistancesBruteForce(Grid* chunkIn) {
+    for (int x = 0; x < chunkIn->sizeX; x++) {
+        for (int y = 0; y < chunkIn->sizeY; y++) {
+            for (int z = 0; z < chunkIn->sizeZ; z++) {
                 if (chunkIn->getVoxel(x, y, z) == 0) {
                     chunkIn->setVoxel(x, y, z, findClosestVoxelSafe(x, y, z, chunkIn));
                 }
             }
         }
-        //std::cout << "\r" << x + 1 << " / " << CHUNK_WIDTH_METERS * VOXELS_PER_METER;
-        //std::cout.flush();
     }
-    //std::cout << std::endl;
+}
+
+/*
+Intermediate distances are clamped to this. Clamping commutes with the
+min/max the transform is built from, so the result is exact up to the cap,
+and the cap only has to be above the largest distance a Voxel can store.
+*/
+constexpr int distance_cap = 255;
+
+/*
+One pass of Meijster et al.'s separable distance transform with the
+chessboard metric. For every u in [0, n) writes min over i of
+max(|u - i|, g[i]) to out[u]. s and t are scratch of size n.
+*/
+static void chebyshevLinePass(const uint8_t* g, uint8_t* out, int n, int* s, int* t) {
+    /* Every voxel is its own closest when they're all the same, common in open air */
+    if (std::all_of(g, g + n, [g](uint8_t v) { return v == g[0]; })) {
+        memcpy(out, g, n);
+        return;
+    }
+    auto f = [g](int u, int i) {
+        return std::max(std::abs(u - i), int(g[i]));
+    };
+    auto sep = [g](int i, int u) {
+        if (g[i] <= g[u]) {
+            return std::max(i + int(g[u]), (i + u) / 2);
+        }
+        return std::min(u - int(g[i]), (i + u) / 2);
+    };
+    int q = 0;
+    s[0] = 0;
+    t[0] = 0;
+    for (int u = 1; u < n; u++) {
+        while (q >= 0 && f(t[q], s[q]) > f(t[q], u)) {
+            q--;
+        }
+        if (q < 0) {
+            q = 0;
+            s[0] = u;
+        } else {
+            int w = 1 + sep(s[q], u);
+            if (w < n) {
+                q++;
+                s[q] = u;
+                t[q] = w;
+            }
+        }
+    }
+    for (int u = n - 1; u >= 0; u--) {
+        out[u] = uint8_t(std::min(f(u, s[q]), distance_cap));
+        if (u == t[q]) {
+            q--;
+        }
+    }
+}
+
+/*
+Each pass of the transform runs along one axis and every line is
+independent of the others, so the grid is cut into slabs across a
+different axis and the slabs shared out between threads. Slabs never need
+data from their neighbours, and a line comes out the same whichever thread
+does it, so the result doesn't depend on the pool.
+*/
+constexpr int distance_slab_width = 16;
+
+static void forEachSlab(ThreadPool* pool, int extent, const std::function<void(int, int)>& slab) {
+    const int count = (extent + distance_slab_width - 1) / distance_slab_width;
+    auto run = [extent, &slab](int i) {
+        slab(i * distance_slab_width, std::min(extent, (i + 1) * distance_slab_width));
+    };
+    if (pool != nullptr) {
+        pool->parallelFor(count, run);
+    } else {
+        for (int i = 0; i < count; i++) {
+            run(i);
+        }
+    }
+}
+
+/*
+Work out the Chebyshev distance from every non-solid voxel to the closest
+solid voxel, minus one (i.e. 0 if there is an adjacent voxel), clamped to
+what a Voxel can hold, and pass it to store(x, y, z, distance). Same values
+as computeDistancesBruteForce, in O(N). Spread over pool if given, with
+identical output either way. store is called for slabs of whole
+distance_slab_width planes along x at a time, each slab on one thread.
+*/
+template <typename Grid, typename Store>
+static void transformDistances(const Grid* chunkIn, ThreadPool* pool, Store store) {
+    const int sx = chunkIn->sizeX;
+    const int sy = chunkIn->sizeY;
+    const int sz = chunkIn->sizeZ;
+    /* Indexed [x][y][z], same as LoadedChunks */
+    std::vector<uint8_t> dist(size_t(sx) * sy * sz);
+    auto idx = [sy, sz](int x, int y, int z) {
+        return (size_t(x) * sy + y) * sz + z;
+    };
+    /* One line along an axis, with its own scratch so slabs can run at the same time */
+    struct LinePass {
+        std::vector<uint8_t> in, out;
+        std::vector<int> s, t;
+        explicit LinePass(int n) : in(n), out(n), s(n), t(n) {}
+        void run(int n) { chebyshevLinePass(in.data(), out.data(), n, s.data(), t.data()); }
+    };
+
+    /* z: distance to the closest solid voxel in the same column */
+    forEachSlab(pool, sx, [&](int x0, int x1) {
+        for (int x = x0; x < x1; x++) {
+            for (int y = 0; y < sy; y++) {
+                int d = distance_cap;
+                for (int z = 0; z < sz; z++) {
+                    d = chunkIn->isSolid(x, y, z) ? 0 : std::min(d + 1, distance_cap);
+                    dist[idx(x, y, z)] = uint8_t(d);
+                }
+                d = distance_cap;
+                for (int z = sz - 1; z >= 0; z--) {
+                    d = dist[idx(x, y, z)] == 0 ? 0 : std::min(d + 1, distance_cap);
+                    dist[idx(x, y, z)] = std::min(dist[idx(x, y, z)], uint8_t(d));
+                }
+            }
+        }
+    });
+    /* y */
+    forEachSlab(pool, sx, [&](int x0, int x1) {
+        LinePass line(sy);
+        for (int x = x0; x < x1; x++) {
+            for (int z = 0; z < sz; z++) {
+                for (int y = 0; y < sy; y++) {
+                    line.in[y] = dist[idx(x, y, z)];
+                }
+                line.run(sy);
+                for (int y = 0; y < sy; y++) {
+                    dist[idx(x, y, z)] = line.out[y];
+                }
+            }
+        }
+    });
+    /* x */
+    forEachSlab(pool, sy, [&](int y0, int y1) {
+        LinePass line(sx);
+        for (int y = y0; y < y1; y++) {
+            for (int z = 0; z < sz; z++) {
+                for (int x = 0; x < sx; x++) {
+                    line.in[x] = dist[idx(x, y, z)];
+                }
+                line.run(sx);
+                for (int x = 0; x < sx; x++) {
+                    dist[idx(x, y, z)] = line.out[x];
+                }
+            }
+        }
+    });
+
+    forEachSlab(pool, sx, [&](int x0, int x1) {
+        for (int x = x0; x < x1; x++) {
+            for (int y = 0; y < sy; y++) {
+                for (int z = 0; z < sz; z++) {
+                    if (!chunkIn->isSolid(x, y, z)) {
+                        store(x, y, z, std::min(int(dist[idx(x, y, z)]) - 1, 127));
+                    }
+                }
+            }
+        }
+    });
+}
+
+/* Fill out all non-solid voxels of a distance grid with their distance */
+template <typename Grid>
+static void computeDistances(Grid* chunkIn, ThreadPool* pool = nullptr) {
+    transformDistances(chunkIn, pool, [chunkIn](int x, int y, int z, int distance) {
+        chunkIn->setVoxel(x, y, z, Voxel(distance));
+    });
+}
+
+static_assert(distance_slab_width % BRICK_SIZE == 0, "A brick has to be in a single slab");
+
+/* Only bricks get a distance in a chunk, the smallest of any voxel in them */
+static void computeBrickDistances(VoxelChunk* chunk, ThreadPool* pool = nullptr) {
+    memset(chunk->brickDistances, 127, sizeof(chunk->brickDistances));
+    transformDistances(chunk, pool, [chunk](int x, int y, int z, int distance) {
+        uint8_t& brick = chunk->brickDistances[x / BRICK_SIZE][y / BRICK_SIZE][z / BRICK_SIZE];
+        brick = std::min(brick, uint8_t(distance));
+    });
+}
+
+WorldGenerator::DistanceValidation WorldGenerator::validateDistances(int numFragments, uint32_t validationSeed, ThreadPool* pool) {
+    std::mt19937 rng(validationSeed);
+    /* Small enough that the brute force search always finds a voxel */
+    std::uniform_int_distribution<int> randomSize(1, 40);
+    std::uniform_real_distribution<float> randomDensity(0.0f, 0.02f);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    DistanceValidation result = {0, false, false};
+    for (int i = 0; i < numFragments; i++) {
+        const int sizeX = randomSize(rng);
+        const int sizeY = randomSize(rng);
+        VoxelColumns fast(sizeX, sizeY, randomSize(rng));
+        const int total = int(fast.voxels.size());
+        const float density = randomDensity(rng);
+        for (int v = 0; v < total; v++) {
+            fast.voxels[v] = unit(rng) < density ? -1 : 0;
+        }
+        fast.voxels[std::uniform_int_distribution<int>(0, total - 1)(rng)] = -1;
+        VoxelColumns reference = fast;
+        VoxelColumns parallel = fast;
+
+        computeDistances(&fast);
+        computeDistancesBruteForce(&reference);
+        computeDistances(&parallel, pool);
+        if (fast.voxels != reference.voxels) {
+            std::cout << "Distance mismatch in fragment " << i << " (" << fast.sizeX << "x"
+                      << fast.sizeY << "x" << fast.sizeZ << ")" << std::endl;
+            result.fragmentMismatches++;
+        } else if (fast.voxels != parallel.voxels) {
+            std::cout << "Parallel distances differ in fragment " << i << " (" << fast.sizeX << "x"
+                      << fast.sizeY << "x" << fast.sizeZ << ")" << std::endl;
+            result.fragmentMismatches++;
+        }
+    }
+
+    /* A whole chunk too, to time the two against each other */
+    if (pool != nullptr) {
+        std::unique_ptr<VoxelChunk> serial(new VoxelChunk);
+        std::unique_ptr<VoxelChunk> parallel(new VoxelChunk);
+        serial->clear();
+        forestTest(serial.get(), rng);
+        *parallel = *serial;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        computeBrickDistances(serial.get());
+        auto mid = std::chrono::high_resolution_clock::now();
+        computeBrickDistances(parallel.get(), pool);
+        auto end = std::chrono::high_resolution_clock::now();
+        const double serialTime = std::chrono::duration<double, std::milli>(mid - start).count();
+        const double parallelTime = std::chrono::duration<double, std::milli>(end - mid).count();
+        std::cout << "Chunk distances: serial " << serialTime << " ms, " << pool->size() << " threads "
+                  << parallelTime << " ms (" << serialTime / parallelTime << "x)" << std::endl;
+        result.chunkChecked = true;
+        result.chunkMatches = memcmp(serial->brickDistances, parallel->brickDistances, sizeof(serial->brickDistances)) == 0;
+        if (!result.chunkMatches) {
+            std::cout << "Parallel distances differ for a whole chunk" << std::endl;
+        }
+    }
+    return result;
 }
 
 /*
@@ -386,12 +762,13 @@ Literally just 1 voxel for the floor
 void generatePavement(VoxelChunk* result, int chunkX, int chunkY) {
     for (int x = 0; x < CHUNK_WIDTH_VOXELS; x++) {
         for (int y = 0; y < CHUNK_WIDTH_VOXELS; y++) {
-            result->setVoxel(x, y, 0, -Stone);
+            result->setMaterial(x, y, 0, Stone);
         }
     }
 }
 
-void generateBuilding(VoxelChunk* result, int chunkX, int chunkY) {
+void generateBuilding(VoxelChunk* result, int chunkX, int chunkY, std::mt19937& rng,
+                      SDFEvaluation evaluation = SDFEvaluation::Octree) {
     double grassHeight = 1;
     //grassTest(result, grassHeight);
     generatePavement(result, chunkX, chunkY);
@@ -404,7 +781,7 @@ void generateBuilding(VoxelChunk* result, int chunkX, int chunkY) {
         }
     }
     */
-    std::vector<Voxel> materials;
+    std::vector<Material> materials;
     // Add building
     std::uniform_int_distribution<int> randomShackOffset(1, CHUNK_WIDTH_VOXELS - 7 * VOXELS_PER_METER);
     const float wallThickness = 0.2f;
@@ -497,25 +874,594 @@ void generateBuilding(VoxelChunk* result, int chunkX, int chunkY) {
 
     VoxelFragment shackFragment(shackWidthX * VOXELS_PER_METER, shackWidthY * VOXELS_PER_METER, shackHeight * VOXELS_PER_METER);
 
-    for (int x = 0; x < shackFragment.sizeX; x++) {
-        for (int y = 0; y < shackFragment.sizeY; y++) {
-            for (int z = 0; z < shackFragment.sizeZ; z++) {
-                glm::vec3 curPoint(float(x) / float(VOXELS_PER_METER) + voxelCenter.x,
-                                   float(y) / float(VOXELS_PER_METER) + voxelCenter.y,
-                                   float(z) / float(VOXELS_PER_METER) + voxelCenter.z);
-                DistResult distSample = buildingChain.minDist(curPoint);
-                if (distSample.distance <= 0.0f) {
-                    shackFragment.setVoxel(x, y, z, -materials[distSample.minIndex]);
+    wallsChain.setCulling(evaluation != SDFEvaluation::Unculled);
+    buildingChain.setCulling(evaluation != SDFEvaluation::Unculled);
+    SDFTape buildingTape(buildingChain);
+    DistResult block[VOXEL_BLOCK_SIZE];
+    auto evaluate = [&](const float* xs, const float* ys, const float* zs, int n) {
+        if (evaluation == SDFEvaluation::TapeBatch || evaluation == SDFEvaluation::Octree) {
+            buildingTape.minDist(xs, ys, zs, block, n);
+        } else {
+            for (int i = 0; i < n; i++) {
+                glm::vec3 curPoint(xs[i], ys[i], zs[i]);
+                block[i] = evaluation == SDFEvaluation::Tape ? buildingTape.minDist(curPoint) : buildingChain.minDist(curPoint);
+            }
+        }
+    };
+    auto store = [&](int x, int y, int z, int i) {
+        if (block[i].distance <= 0.0f) {
+            shackFragment.setMaterial(x, y, z, materials[block[i].minIndex]);
+        } else {
+            shackFragment.setMaterial(x, y, z, 0);
+        }
+    };
+    const glm::ivec3 size(shackFragment.sizeX, shackFragment.sizeY, shackFragment.sizeZ);
+    if (evaluation == SDFEvaluation::Octree) {
+        rasterizeOctree(shackFragment, glm::ivec3(0, 0, 0), size, [&](const SDFBounds& box, float radius, Material& material) {
+            SDFTape::BoxDist cell = buildingTape.boxDist(box);
+            const float margin = cell.lipschitz * radius + RASTER_MARGIN;
+            if (cell.minDistance > margin) {
+                material = 0;
+                return true;
+            }
+            /* Solid, and the same link stays closest everywhere in the cell */
+            if (cell.minDistance < -margin && cell.secondMin - cell.minDistance > 2.0f * margin) {
+                material = materials[cell.minIndex];
+                return true;
+            }
+            return false;
+        }, evaluate, store);
+    } else {
+        voxelizeBlocks(glm::ivec3(0, 0, 0), size, evaluate, store);
+    }
+    blitVoxels(result, &shackFragment, offsetX * VOXELS_PER_METER, offsetY * VOXELS_PER_METER, 0);
+    shackFragment.freeMaterials();
+}
+
+int WorldGenerator::benchmarkSDFTape(int numRuns, uint32_t benchmarkSeed, int& comparisons) {
+    using Clock = std::chrono::high_resolution_clock;
+    const SDFEvaluation evaluations[] = {SDFEvaluation::Unculled, SDFEvaluation::Chain, SDFEvaluation::Tape,
+                                         SDFEvaluation::TapeBatch, SDFEvaluation::Octree};
+    const char* names[] = {"unculled chain", "chain", "tape", "batched tape", "octree"};
+    constexpr int numEvaluations = 5;
+    const glm::vec3 treeDimensions(5, 5, 20);
+    std::unique_ptr<VoxelChunk> reference(new VoxelChunk);
+    std::unique_ptr<VoxelChunk> building(new VoxelChunk);
+    double treeTime[numEvaluations] = {};
+    double buildingTime[numEvaluations] = {};
+    int mismatches = 0;
+    comparisons = 0;
+    for (int i = 0; i < numRuns; i++) {
+        VoxelFragment* referenceTree = nullptr;
+        for (int e = 0; e < numEvaluations; e++) {
+            /* Same seed every time so they all build the same SDFs */
+            std::mt19937 rng(benchmarkSeed + i);
+
+            auto start = Clock::now();
+            VoxelFragment* tree = proceduralTree(treeDimensions, rng, evaluations[e]);
+            treeTime[e] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+            VoxelChunk* dst = e == 0 ? reference.get() : building.get();
+            dst->clear();
+            start = Clock::now();
+            generateBuilding(dst, 0, 0, rng, evaluations[e]);
+            buildingTime[e] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+            if (e == 0) {
+                referenceTree = tree;
+                continue;
+            }
+            comparisons += 2;
+            if (memcmp(referenceTree->materials, tree->materials, tree->sizeX * tree->sizeY * tree->sizeZ) != 0) {
+                std::cout << "Tree " << i << " differs between " << names[0] << " and " << names[e] << std::endl;
+                mismatches++;
+            }
+            if (memcmp(reference->materials, building->materials, sizeof(building->materials)) != 0) {
+                std::cout << "Building " << i << " differs between " << names[0] << " and " << names[e] << std::endl;
+                mismatches++;
+            }
+            tree->freeMaterials();
+            delete tree;
+        }
+        referenceTree->freeMaterials();
+        delete referenceTree;
+    }
+    for (int e = 0; e < numEvaluations; e++) {
+        std::cout << names[e] << ": proceduralTree " << treeTime[e] / numRuns << " ms (" << treeTime[0] / treeTime[e]
+                  << "x), generateBuilding " << buildingTime[e] / numRuns << " ms (" << buildingTime[0] / buildingTime[e]
+                  << "x)" << std::endl;
+    }
+    return mismatches;
+}
+
+/*
+Every chunk gets its own generator seeded from the world seed and its
+coordinates, so chunks can be generated on any thread in any order and
+still come out the same for a given seed.
+*/
+static std::mt19937 chunkRng(uint32_t worldSeed, int chunkX, int chunkY) {
+    std::seed_seq seq{worldSeed, uint32_t(chunkX), uint32_t(chunkY)};
+    return std::mt19937(seq);
+}
+
+void WorldGenerator::generateChunk(VoxelChunk* result, int chunkX, int chunkY, ThreadPool* pool) {
+    PROFILE_FUNCTION();
+    std::mt19937 rng = chunkRng(seed, chunkX, chunkY);
+    result->clear();
+    {
+        PROFILE_ZONE("forestTest");
+        forestTest(result, rng);
+    }
+    {
+        PROFILE_ZONE("computeBrickDistances");
+        computeBrickDistances(result, pool);
+    }
+}
+
+LoadedChunks::LoadedChunks() :
+    brickTable(size_t(TOTAL_CHUNKS_LOADED) * BRICKS_PER_CHUNK, BRICK_UNIFORM),
+    occupancy(size_t(TOTAL_CHUNKS_LOADED) * OCCUPANCY_WORDS_PER_CHUNK, 0),
+    slotChunks(TOTAL_CHUNKS_LOADED),
+    slotFilled(TOTAL_CHUNKS_LOADED, false),
+    slotTableDirty(TOTAL_CHUNKS_LOADED, true),
+    slotOccupancyDirty(TOTAL_CHUNKS_LOADED, true)
+{
+    /* Reserve address space only, pages get touched as bricks are used */
+    bricks.reserve(MAX_BRICKS);
+    brickOccupancy.reserve(MAX_BRICKS);
+    setLowestChunk(0, 0);
+}
+
+const uint32_t* LoadedChunks::slotTable(int chunkX, int chunkY) const {
+    if (!isLoaded(chunkX, chunkY)) {
+        throw std::runtime_error("Chunk is not loaded");
+    }
+    return &brickTable[size_t(slotIndex(chunkX, chunkY)) * BRICKS_PER_CHUNK];
+}
+
+bool LoadedChunks::isLoaded(int chunkX, int chunkY) const {
+    int slot = slotIndex(chunkX, chunkY);
+    return slotFilled[slot] && slotChunks[slot] == glm::ivec2(chunkX, chunkY);
+}
+
+Material LoadedChunks::getMaterial(int chunkX, int chunkY, int x, int y, int z) const {
+    uint32_t entry = slotTable(chunkX, chunkY)[brickIndex(x, y, z)];
+    if (entry & BRICK_UNIFORM) {
+        return (entry & BRICK_SOLID) ? Material(entry & 0xFF) : 0;
+    }
+    return bricks[entry].materials[voxelInBrick(x, y, z)];
+}
+
+bool LoadedChunks::findWorldColumn(int x, int y, int& slot, int& localX, int& localY) const {
+    auto floorDiv = [](int v) {
+        return v >= 0 ? v / CHUNK_WIDTH_VOXELS : -((-v + CHUNK_WIDTH_VOXELS - 1) / CHUNK_WIDTH_VOXELS);
+    };
+    const int chunkX = floorDiv(x);
+    const int chunkY = floorDiv(y);
+    const int relativeX = chunkX - chunkMap.lowestChunkIndex[0];
+    const int relativeY = chunkY - chunkMap.lowestChunkIndex[1];
+    if (relativeX < 0 || relativeY < 0 || relativeX >= LOADED_CHUNKS_AXIS || relativeY >= LOADED_CHUNKS_AXIS) {
+        return false;
+    }
+    slot = chunkMap.chunkSlots[relativeX][relativeY];
+    localX = x - chunkX * CHUNK_WIDTH_VOXELS;
+    localY = y - chunkY * CHUNK_WIDTH_VOXELS;
+    return true;
+}
+
+int LoadedChunks::getWorldVoxel(int x, int y, int z) const {
+    int slot, localX, localY;
+    if (z < 0 || z >= CHUNK_HEIGHT_VOXELS || !findWorldColumn(x, y, slot, localX, localY)) {
+        return OUTSIDE_WORLD;
+    }
+    if (slot < 0) {
+        return 0;
+    }
+    const uint32_t entry = brickTable[size_t(slot) * BRICKS_PER_CHUNK + brickIndex(localX, localY, z)];
+    if (entry & BRICK_UNIFORM) {
+        return (entry & BRICK_SOLID) ? -int(entry & 0xFF) : int(entry & 0xFF);
+    }
+    const int bit = voxelInBrick(localX, localY, z);
+    if (!((brickOccupancy[entry].words[bit / 32] >> (bit % 32)) & 1u)) {
+        return 0;
+    }
+    return -int(bricks[entry].materials[bit]);
+}
+
+static bool testOccupancy(const uint32_t* pyramid, int level, int x, int y, int z) {
+    const int bit = LoadedChunks::occupancyBit(level, x, y, z);
+    return (pyramid[occupancyLevelOffset(level) + bit / 32] >> (bit % 32)) & 1u;
+}
+
+static void setOccupancy(uint32_t* pyramid, int level, int x, int y, int z) {
+    const int bit = LoadedChunks::occupancyBit(level, x, y, z);
+    pyramid[occupancyLevelOffset(level) + bit / 32] |= 1u << (bit % 32);
+}
+
+bool LoadedChunks::isWorldCellOccupied(int level, int x, int y, int z) const {
+    int slot, localX, localY;
+    if (!findWorldColumn(x, y, slot, localX, localY) || slot < 0) {
+        return false;
+    }
+    return testOccupancy(&occupancy[size_t(slot) * OCCUPANCY_WORDS_PER_CHUNK], level, localX, localY, z);
+}
+
+void LoadedChunks::setLowestChunk(int chunkX, int chunkY) {
+    std::lock_guard<std::mutex> lock(bricksMutex);
+    chunkMap.lowestChunkIndex[0] = chunkX;
+    chunkMap.lowestChunkIndex[1] = chunkY;
+    updateChunkMap();
+}
+
+void LoadedChunks::updateChunkMap() {
+    for (int x = 0; x < LOADED_CHUNKS_AXIS; x++) {
+        for (int y = 0; y < LOADED_CHUNKS_AXIS; y++) {
+            int cx = chunkMap.lowestChunkIndex[0] + x;
+            int cy = chunkMap.lowestChunkIndex[1] + y;
+            chunkMap.chunkSlots[x][y] = isLoaded(cx, cy) ? slotIndex(cx, cy) : -1;
+        }
+    }
+    chunkMapDirty = true;
+}
+
+void LoadedChunks::freeSlot(int slot) {
+    uint32_t* table = &brickTable[size_t(slot) * BRICKS_PER_CHUNK];
+    for (int b = 0; b < BRICKS_PER_CHUNK; b++) {
+        if (!(table[b] & BRICK_UNIFORM)) {
+            freeBricks.push_back(table[b]);
+        }
+        table[b] = BRICK_UNIFORM;
+    }
+    std::fill_n(&occupancy[size_t(slot) * OCCUPANCY_WORDS_PER_CHUNK], OCCUPANCY_WORDS_PER_CHUNK, 0u);
+    slotFilled[slot] = false;
+}
+
+void LoadedChunks::compressChunk(int chunkX, int chunkY, const VoxelChunk& chunk, CompressedChunk& result) {
+    result.chunkX = chunkX;
+    result.chunkY = chunkY;
+    result.entries.resize(BRICKS_PER_CHUNK);
+    result.bricks.clear();
+    result.brickOccupancy.clear();
+    result.occupancy.assign(OCCUPANCY_WORDS_PER_CHUNK, 0);
+    static_assert(BRICK_SIZE == 8 && CHUNK_HEIGHT_VOXELS % 32 == 0, "A brick's part of a column has to be a byte of VoxelChunk::solid");
+    for (int bx = 0; bx < CHUNK_WIDTH_BRICKS; bx++) {
+        for (int by = 0; by < CHUNK_WIDTH_BRICKS; by++) {
+            for (int bz = 0; bz < CHUNK_HEIGHT_BRICKS; bz++) {
+                /* The solid bits of each column, so empty bricks never look at their materials */
+                uint8_t columns[BRICK_SIZE][BRICK_SIZE];
+                bool anySolid = false;
+                bool allSolid = true;
+                for (int x = 0; x < BRICK_SIZE; x++) {
+                    for (int y = 0; y < BRICK_SIZE; y++) {
+                        const size_t bit = (size_t(bx * BRICK_SIZE + x) * CHUNK_WIDTH_VOXELS + by * BRICK_SIZE + y) * CHUNK_HEIGHT_VOXELS + bz * BRICK_SIZE;
+                        columns[x][y] = uint8_t(chunk.solid[bit / 32] >> (bit % 32));
+                        anySolid = anySolid || columns[x][y] != 0;
+                        allSolid = allSolid && columns[x][y] == 0xFF;
+                    }
+                }
+                uint32_t& entry = result.entries[brickIndex(bx * BRICK_SIZE, by * BRICK_SIZE, bz * BRICK_SIZE)];
+                if (!anySolid) {
+                    entry = BRICK_UNIFORM | chunk.brickDistances[bx][by][bz];
+                    continue;
+                }
+                Brick cur;
+                BrickOccupancy solid = {};
+                bool allSame = allSolid;
+                const Material first = chunk.materials[bx * BRICK_SIZE][by * BRICK_SIZE][bz * BRICK_SIZE];
+                for (int x = 0; x < BRICK_SIZE; x++) {
+                    for (int y = 0; y < BRICK_SIZE; y++) {
+                        const Material* column = &chunk.materials[bx * BRICK_SIZE + x][by * BRICK_SIZE + y][bz * BRICK_SIZE];
+                        for (int z = 0; z < BRICK_SIZE; z++) {
+                            const int v = voxelInBrick(x, y, z);
+                            cur.materials[v] = column[z];
+                            allSame = allSame && column[z] == first;
+                            if ((columns[x][y] >> z) & 1) {
+                                solid.words[v / 32] |= 1u << (v % 32);
+                                setOccupancy(result.occupancy.data(), 0, bx * BRICK_SIZE + x, by * BRICK_SIZE + y, bz * BRICK_SIZE + z);
+                            }
+                        }
+                    }
+                }
+                if (allSame) {
+                    entry = BRICK_UNIFORM | BRICK_SOLID | first;
                 } else {
-                    shackFragment.setVoxel(x, y, z, 0);
+                    entry = uint32_t(result.bricks.size());
+                    result.bricks.push_back(cur);
+                    result.brickOccupancy.push_back(solid);
                 }
             }
         }
     }
-    blitVoxels(result, &shackFragment, offsetX * VOXELS_PER_METER, offsetY * VOXELS_PER_METER, 0);
-    shackFragment.freeVoxels();
+    /* Each level up is set wherever a cell below it is */
+    for (int level = 1; level < OCCUPANCY_LEVELS; level++) {
+        const int size = occupancyCellSize(level - 1);
+        for (int x = 0; x < CHUNK_WIDTH_VOXELS; x += size) {
+            for (int y = 0; y < CHUNK_WIDTH_VOXELS; y += size) {
+                for (int z = 0; z < CHUNK_HEIGHT_VOXELS; z += size) {
+                    if (testOccupancy(result.occupancy.data(), level - 1, x, y, z)) {
+                        setOccupancy(result.occupancy.data(), level, x, y, z);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void LoadedChunks::storeChunk(int chunkX, int chunkY, const VoxelChunk& chunk) {
+    CompressedChunk compressed;
+    compressChunk(chunkX, chunkY, chunk, compressed);
+    storeChunk(compressed);
+}
+
+void LoadedChunks::storeChunk(const CompressedChunk& chunk) {
+    const int slot = slotIndex(chunk.chunkX, chunk.chunkY);
+    std::lock_guard<std::mutex> lock(bricksMutex);
+    freeSlot(slot);
+    uint32_t* table = &brickTable[size_t(slot) * BRICKS_PER_CHUNK];
+    for (int b = 0; b < BRICKS_PER_CHUNK; b++) {
+        const uint32_t entry = chunk.entries[b];
+        if (entry & BRICK_UNIFORM) {
+            table[b] = entry;
+            continue;
+        }
+        uint32_t poolIndex;
+        if (!freeBricks.empty()) {
+            poolIndex = freeBricks.back();
+            freeBricks.pop_back();
+        } else if (bricks.size() < MAX_BRICKS) {
+            poolIndex = uint32_t(bricks.size());
+            bricks.emplace_back();
+            brickOccupancy.emplace_back();
+        } else {
+            throw std::runtime_error("Out of voxel bricks, increase MAX_BRICKS_PER_CHUNK");
+        }
+        bricks[poolIndex] = chunk.bricks[entry];
+        brickOccupancy[poolIndex] = chunk.brickOccupancy[entry];
+        table[b] = poolIndex;
+        dirtyBricks.push_back(poolIndex);
+    }
+    std::copy(chunk.occupancy.begin(), chunk.occupancy.end(), &occupancy[size_t(slot) * OCCUPANCY_WORDS_PER_CHUNK]);
+    slotChunks[slot] = glm::ivec2(chunk.chunkX, chunk.chunkY);
+    slotFilled[slot] = true;
+    slotTableDirty[slot] = true;
+    slotOccupancyDirty[slot] = true;
+    updateChunkMap();
+}
+
+void LoadedChunks::loadChunk(int chunkX, int chunkY, VoxelChunk& chunk) const {
+    const uint32_t* table = slotTable(chunkX, chunkY);
+    for (int x = 0; x < CHUNK_WIDTH_VOXELS; x++) {
+        for (int y = 0; y < CHUNK_WIDTH_VOXELS; y++) {
+            for (int z = 0; z < CHUNK_HEIGHT_VOXELS; z++) {
+                chunk.setMaterial(x, y, z, getMaterial(chunkX, chunkY, x, y, z));
+            }
+        }
+    }
+    for (int bx = 0; bx < CHUNK_WIDTH_BRICKS; bx++) {
+        for (int by = 0; by < CHUNK_WIDTH_BRICKS; by++) {
+            for (int bz = 0; bz < CHUNK_HEIGHT_BRICKS; bz++) {
+                const uint32_t entry = table[brickIndex(bx * BRICK_SIZE, by * BRICK_SIZE, bz * BRICK_SIZE)];
+                const bool empty = (entry & BRICK_UNIFORM) && !(entry & BRICK_SOLID);
+                chunk.brickDistances[bx][by][bz] = empty ? uint8_t(entry & 0xFF) : 0;
+            }
+        }
+    }
+}
+
+void LoadedChunks::readColumn(int chunkX, int chunkY, int x, int y, Voxel* column) const {
+    const uint32_t* table = slotTable(chunkX, chunkY);
+    for (int z = 0; z < CHUNK_HEIGHT_VOXELS; z += BRICK_SIZE) {
+        const uint32_t entry = table[brickIndex(x, y, z)];
+        if (entry & BRICK_UNIFORM) {
+            memset(column + z, (entry & BRICK_SOLID) ? -1 : 0, BRICK_SIZE);
+        } else {
+            for (int i = 0; i < BRICK_SIZE; i++) {
+                const int bit = voxelInBrick(x, y, z + i);
+                column[z + i] = Voxel(-int((brickOccupancy[entry].words[bit / 32] >> (bit % 32)) & 1u));
+            }
+        }
+    }
+}
+
+void LoadedChunks::lowerColumn(int chunkX, int chunkY, int x, int y, const Voxel* distances) {
+    const int slot = slotIndex(chunkX, chunkY);
+    uint32_t* table = &brickTable[size_t(slot) * BRICKS_PER_CHUNK];
+    for (int z = 0; z < CHUNK_HEIGHT_VOXELS; z += BRICK_SIZE) {
+        uint32_t& entry = table[brickIndex(x, y, z)];
+        if (!(entry & BRICK_UNIFORM) || (entry & BRICK_SOLID)) {
+            continue;
+        }
+        /* Empty bricks hold their smallest distance, so keep it the smallest */
+        const Voxel current = Voxel(entry & 0xFF);
+        const Voxel lowest = *std::min_element(distances + z, distances + z + BRICK_SIZE);
+        if (lowest < current) {
+            entry = BRICK_UNIFORM | uint8_t(lowest);
+            slotTableDirty[slot] = true;
+        }
+    }
+}
+
+void LoadedChunks::capDistancesTowards(int chunkX, int chunkY, int dx, int dy) {
+    /*
+    Nothing in the neighbour is closer than the border, and anything within
+    STITCH_BAND of it has been found exactly, so max(STITCH_BAND, distance
+    to the neighbour) is a lower bound on the true distance.
+    */
+    auto border = [](int d, int v) {
+        return d > 0 ? CHUNK_WIDTH_VOXELS - v : d < 0 ? v + 1 : 0;
+    };
+    auto cap = [](int k) {
+        return Voxel(std::min(std::max(STITCH_BAND, k) - 1, 127));
+    };
+    const int slot = slotIndex(chunkX, chunkY);
+    uint32_t* table = &brickTable[size_t(slot) * BRICKS_PER_CHUNK];
+    for (int x0 = 0; x0 < CHUNK_WIDTH_VOXELS; x0 += BRICK_SIZE) {
+        for (int y0 = 0; y0 < CHUNK_WIDTH_VOXELS; y0 += BRICK_SIZE) {
+            /* Closest any voxel in this column of bricks gets to the neighbour */
+            const Voxel nearest = cap(std::max(std::min(border(dx, x0), border(dx, x0 + BRICK_SIZE - 1)),
+                                               std::min(border(dy, y0), border(dy, y0 + BRICK_SIZE - 1))));
+            if (nearest == 127) {
+                continue;
+            }
+            for (int z0 = 0; z0 < CHUNK_HEIGHT_VOXELS; z0 += BRICK_SIZE) {
+                uint32_t& entry = table[brickIndex(x0, y0, z0)];
+                if ((entry & BRICK_UNIFORM) && !(entry & BRICK_SOLID) && Voxel(entry & 0xFF) > nearest) {
+                    entry = BRICK_UNIFORM | uint8_t(nearest);
+                    slotTableDirty[slot] = true;
+                }
+            }
+        }
+    }
+}
+
+/* Which chunk a column of a stitch box is in, and where. Corner boxes reach into the
+   chunks along both edges too, which might not be loaded. */
+static void locateStitchColumn(const ChunkStitch& stitch, const ChunkStitch::Box& box, int x, int y,
+                               glm::ivec2& chunk, glm::ivec2& local) {
+    const glm::ivec2 v = box.lo + glm::ivec2(x, y);
+    const glm::ivec2 d(v.x < 0 ? -1 : v.x >= CHUNK_WIDTH_VOXELS ? 1 : 0,
+                       v.y < 0 ? -1 : v.y >= CHUNK_WIDTH_VOXELS ? 1 : 0);
+    chunk = glm::ivec2(stitch.chunkX, stitch.chunkY) + d;
+    local = v - d * CHUNK_WIDTH_VOXELS;
+}
+
+void LoadedChunks::stitchChunk(int chunkX, int chunkY, ThreadPool* pool) {
+    ChunkStitch stitch;
+    computeStitch(chunkX, chunkY, stitch, pool);
+    applyStitch(stitch);
+}
+
+void LoadedChunks::computeStitch(int chunkX, int chunkY, ChunkStitch& result, ThreadPool* pool) const {
+    PROFILE_FUNCTION();
+    /*
+    Each loaded neighbour shares a box with this chunk: STITCH_BAND voxels
+    either side of the shared edge or corner, the full length of an edge.
+    Any voxel within STITCH_BAND of a voxel on the other side is in the box
+    along with it, so running the distance transform over just the box
+    finds those distances exactly. Everything only ever gets lowered, so
+    the order boxes are applied in doesn't matter.
+    */
+    result.chunkX = chunkX;
+    result.chunkY = chunkY;
+    result.boxes.clear();
+    {
+        std::lock_guard<std::mutex> lock(bricksMutex);
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                if ((dx == 0 && dy == 0) || !isLoaded(chunkX + dx, chunkY + dy)) {
+                    continue;
+                }
+                auto range = [](int d, int& lo, int& size) {
+                    lo = d < 0 ? -STITCH_BAND : d > 0 ? CHUNK_WIDTH_VOXELS - STITCH_BAND : 0;
+                    size = d == 0 ? CHUNK_WIDTH_VOXELS : 2 * STITCH_BAND;
+                };
+                glm::ivec2 lo, size;
+                range(dx, lo.x, size.x);
+                range(dy, lo.y, size.y);
+                result.boxes.push_back({glm::ivec2(dx, dy), lo, VoxelColumns(size.x, size.y, CHUNK_HEIGHT_VOXELS)});
+            }
+        }
+    }
+
+    auto computeBox = [&](int i) {
+        ChunkStitch::Box& box = result.boxes[i];
+        VoxelColumns& grid = box.distances;
+        for (int x = 0; x < grid.sizeX; x++) {
+            /* A row at a time, so whoever is storing chunks never waits long */
+            std::lock_guard<std::mutex> lock(bricksMutex);
+            for (int y = 0; y < grid.sizeY; y++) {
+                glm::ivec2 chunk, local;
+                locateStitchColumn(result, box, x, y, chunk, local);
+                Voxel* column = grid.column(x, y);
+                if (!isLoaded(chunk.x, chunk.y)) {
+                    continue;
+                }
+                readColumn(chunk.x, chunk.y, local.x, local.y, column);
+            }
+        }
+        computeDistances(&grid, pool);
+    };
+    if (pool != nullptr) {
+        pool->parallelFor(int(result.boxes.size()), computeBox);
+    } else {
+        for (int i = 0; i < int(result.boxes.size()); i++) {
+            computeBox(i);
+        }
+    }
 }
 
-void WorldGenerator::generateChunk(VoxelChunk* result, int chunkX, int chunkY) {
-    forestTest(result);
+void LoadedChunks::applyStitch(const ChunkStitch& stitch) {
+    PROFILE_FUNCTION();
+    std::lock_guard<std::mutex> lock(bricksMutex);
+    for (const ChunkStitch::Box& box : stitch.boxes) {
+        const VoxelColumns& grid = box.distances;
+        for (int x = 0; x < grid.sizeX; x++) {
+            for (int y = 0; y < grid.sizeY; y++) {
+                glm::ivec2 chunk, local;
+                locateStitchColumn(stitch, box, x, y, chunk, local);
+                if (isLoaded(chunk.x, chunk.y)) {
+                    lowerColumn(chunk.x, chunk.y, local.x, local.y, grid.column(x, y));
+                }
+            }
+        }
+        if (isLoaded(stitch.chunkX, stitch.chunkY)) {
+            capDistancesTowards(stitch.chunkX, stitch.chunkY, box.offset.x, box.offset.y);
+        }
+        if (isLoaded(stitch.chunkX + box.offset.x, stitch.chunkY + box.offset.y)) {
+            capDistancesTowards(stitch.chunkX + box.offset.x, stitch.chunkY + box.offset.y, -box.offset.x, -box.offset.y);
+        }
+    }
+}
+
+std::vector<VoxelBufferRegion> LoadedChunks::takeDirtyRegions() {
+    std::lock_guard<std::mutex> lock(bricksMutex);
+    std::vector<VoxelBufferRegion> regions;
+    if (chunkMapDirty) {
+        regions.push_back({0, sizeof(ChunkMap)});
+        chunkMapDirty = false;
+    }
+    constexpr size_t slotTableBytes = sizeof(uint32_t) * BRICKS_PER_CHUNK;
+    for (int slot = 0; slot < TOTAL_CHUNKS_LOADED; slot++) {
+        if (slotTableDirty[slot]) {
+            regions.push_back({BRICK_TABLE_OFFSET + slot * slotTableBytes, slotTableBytes});
+            slotTableDirty[slot] = false;
+        }
+    }
+    constexpr size_t slotOccupancyBytes = sizeof(uint32_t) * OCCUPANCY_WORDS_PER_CHUNK;
+    for (int slot = 0; slot < TOTAL_CHUNKS_LOADED; slot++) {
+        if (slotOccupancyDirty[slot]) {
+            regions.push_back({OCCUPANCY_OFFSET + slot * slotOccupancyBytes, slotOccupancyBytes});
+            slotOccupancyDirty[slot] = false;
+        }
+    }
+    /* Merge runs of consecutive bricks into one region each */
+    std::sort(dirtyBricks.begin(), dirtyBricks.end());
+    dirtyBricks.erase(std::unique(dirtyBricks.begin(), dirtyBricks.end()), dirtyBricks.end());
+    for (size_t i = 0; i < dirtyBricks.size();) {
+        size_t j = i + 1;
+        while (j < dirtyBricks.size() && dirtyBricks[j] == dirtyBricks[j - 1] + 1) {
+            j++;
+        }
+        regions.push_back({BRICK_POOL_OFFSET + dirtyBricks[i] * sizeof(Brick), (j - i) * sizeof(Brick)});
+        regions.push_back({BRICK_OCCUPANCY_OFFSET + dirtyBricks[i] * sizeof(BrickOccupancy), (j - i) * sizeof(BrickOccupancy)});
+        i = j;
+    }
+    dirtyBricks.clear();
+    return regions;
+}
+
+void LoadedChunks::copyRegion(const VoxelBufferRegion& region, void* dst) const {
+    const char* src;
+    if (region.offset < BRICK_TABLE_OFFSET) {
+        src = reinterpret_cast<const char*>(&chunkMap) + region.offset;
+    } else if (region.offset < BRICK_POOL_OFFSET) {
+        src = reinterpret_cast<const char*>(brickTable.data()) + (region.offset - BRICK_TABLE_OFFSET);
+    } else if (region.offset < OCCUPANCY_OFFSET) {
+        src = reinterpret_cast<const char*>(bricks.data()) + (region.offset - BRICK_POOL_OFFSET);
+    } else if (region.offset < BRICK_OCCUPANCY_OFFSET) {
+        src = reinterpret_cast<const char*>(occupancy.data()) + (region.offset - OCCUPANCY_OFFSET);
+    } else {
+        src = reinterpret_cast<const char*>(brickOccupancy.data()) + (region.offset - BRICK_OCCUPANCY_OFFSET);
+    }
+    memcpy(dst, src, region.size);
 }
@@ -2,17 +2,28 @@
 #define WORLDGENERATOR_H
 #include <cstdint>
 #include <algorithm>
+#include <cstring>
+#include <vector>
+#include <mutex>
 #include "perlin.h"
 #include "sdf/sdfchain.h"
 #include "sdf/primitive.h"
 #include "sdf/displacement.h"
 #include "sdf/displacedsdf.h"
+#include "sdf/sdftape.h"
+#include "threadpool.h"
 
 /*
-Structure:
-if < 0, voxel id is value * -1
-if > 0, value is distance to nearest voxel
-if 0, there is no voxel here and no distance information
+What a voxel is made of, 0 if there's nothing there. Whether a voxel is
+solid is kept apart from this, as a bit per voxel, see VoxelChunk and
+BrickOccupancy.
+*/
+typedef uint8_t Material;
+
+/*
+A cell of a distance grid (VoxelColumns):
+if < 0, the voxel is solid
+otherwise, value is distance to nearest solid voxel, 0 if one is adjacent
 */
 typedef int8_t Voxel;
 
@@ -35,63 +46,370 @@ constexpr int VOXELS_PER_METER = 16;
 constexpr int CHUNK_WIDTH_VOXELS = CHUNK_WIDTH_METERS * VOXELS_PER_METER;
 constexpr int CHUNK_HEIGHT_VOXELS = CHUNK_HEIGHT_METERS * VOXELS_PER_METER;
 
-constexpr size_t CHUNK_SIZE_BYTES = sizeof(Voxel) * CHUNK_WIDTH_VOXELS * CHUNK_WIDTH_VOXELS * CHUNK_HEIGHT_VOXELS;
+/* A dense chunk of materials, without the occupancy bits */
+constexpr size_t CHUNK_SIZE_BYTES = sizeof(Material) * CHUNK_WIDTH_VOXELS * CHUNK_WIDTH_VOXELS * CHUNK_HEIGHT_VOXELS;
 
 /* Number of chunks around the player to load */
 const int DRAW_DISTANCE = 1;
 const int LOADED_CHUNKS_AXIS = DRAW_DISTANCE * 2 + 1;
 const int TOTAL_CHUNKS_LOADED = LOADED_CHUNKS_AXIS * LOADED_CHUNKS_AXIS;
 
-struct LoadedChunks {
-    int8_t voxels[LOADED_CHUNKS_AXIS * CHUNK_WIDTH_VOXELS][LOADED_CHUNKS_AXIS * CHUNK_WIDTH_VOXELS][CHUNK_HEIGHT_VOXELS];
-    Voxel getVoxel(int chunkX, int chunkY, int x, int y, int z) {
-        return voxels[chunkX * CHUNK_WIDTH_VOXELS + x][chunkY * CHUNK_WIDTH_VOXELS + y][z];
-    }
-    void setVoxel(int chunkX, int chunkY, int x, int y, int z, Voxel v) {
-        voxels[chunkX * CHUNK_WIDTH_VOXELS + x][chunkY * CHUNK_WIDTH_VOXELS + y][z] = v;
+/*
+Loaded chunks are stored sparsely as 8x8x8 bricks.
+Each chunk slot has a table with one entry per brick. If BRICK_UNIFORM is
+set the whole brick is the same: with BRICK_SOLID too, solid with the
+material in the low 8 bits, otherwise empty with the smallest distance in
+the brick there. Otherwise the entry is the index of the brick in the brick
+pool, which holds a BrickOccupancy and a Brick for it. Distances are only
+kept for empty bricks, walking through the others goes by their bits.
+
+Slots form a ring buffer over the world: world chunk (x, y) always lives in
+slot (x mod LOADED_CHUNKS_AXIS, y mod LOADED_CHUNKS_AXIS), so moving to a
+new chunk only replaces the row or column of slots that fell out of range.
+
+The GPU buffer is the ChunkMap, the brick table for all slots, the brick
+pool, the occupancy pyramids, then the occupancy of every pool brick, see
+VoxelWordsIn in shader.comp.
+*/
+constexpr int BRICK_SIZE = 8;
+constexpr int BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+constexpr int CHUNK_WIDTH_BRICKS = CHUNK_WIDTH_VOXELS / BRICK_SIZE;
+constexpr int CHUNK_HEIGHT_BRICKS = CHUNK_HEIGHT_VOXELS / BRICK_SIZE;
+constexpr int BRICKS_PER_CHUNK = CHUNK_WIDTH_BRICKS * CHUNK_WIDTH_BRICKS * CHUNK_HEIGHT_BRICKS;
+constexpr uint32_t BRICK_UNIFORM = 0x80000000u;
+constexpr uint32_t BRICK_SOLID = 0x40000000u;
+/* Capacity of the brick pool, on average this many bricks per chunk can be non-uniform */
+constexpr int MAX_BRICKS_PER_CHUNK = 4096;
+constexpr int MAX_BRICKS = TOTAL_CHUNKS_LOADED * MAX_BRICKS_PER_CHUNK;
+/* How far into each neighbour stitching looks, distances within this of a border are exact */
+constexpr int STITCH_BAND = 2 * BRICK_SIZE;
+
+/*
+Build with -DMORTON_BRICKS to order the brick table, and the voxels in each
+brick, along a Morton (Z-order) curve instead of [x][y][z]. Neighbours along
+x and y are then about as close in memory as those along z, rather than a
+row or a whole plane of the brick away. That might suit rays that mostly go
+sideways, but it hasn't been shown to help on real hardware yet, so it stays
+off by default. Compare builds with and without it with --ray-bench, see
+CPURenderer::benchmarkDirections. LoadedChunks::brickIndex and voxelInBrick
+are the only places on the CPU that know, the shaders get it as a
+specialization constant.
+*/
+#ifdef MORTON_BRICKS
+constexpr bool MORTON_ORDER = true;
+#else
+constexpr bool MORTON_ORDER = false;
+#endif
+static_assert(!MORTON_ORDER || (CHUNK_WIDTH_BRICKS == CHUNK_HEIGHT_BRICKS && (CHUNK_WIDTH_BRICKS & (CHUNK_WIDTH_BRICKS - 1)) == 0 &&
+                                (BRICK_SIZE & (BRICK_SIZE - 1)) == 0 && CHUNK_WIDTH_BRICKS <= 1024),
+              "Morton order needs a cube of bricks and bricks a power of two wide");
+
+/* Spreads the low 10 bits of v out to every third bit */
+constexpr uint32_t spreadBits(uint32_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/* Bits of x, y and z interleaved, x highest: ...x1 y1 z1 x0 y0 z0 */
+constexpr int mortonIndex(int x, int y, int z) {
+    return int((spreadBits(uint32_t(x)) << 2) | (spreadBits(uint32_t(y)) << 1) | spreadBits(uint32_t(z)));
+}
+
+/* Material of each voxel in a pool brick, 0 for empty ones, indexed with voxelInBrick */
+struct Brick {
+    Material materials[BRICK_VOXELS];
+};
+
+/*
+Which voxels of a pool brick are solid, a bit each, indexed like materials
+in Brick. Rays walk through these and only read the Brick for a voxel they hit.
+*/
+struct BrickOccupancy {
+    uint32_t words[BRICK_VOXELS / 32];
+};
+
+/* Which slot each loaded chunk is in */
+struct ChunkMap {
+    int32_t lowestChunkIndex[2];
+    /* Indexed relative to lowestChunkIndex, -1 if that chunk isn't loaded */
+    int32_t chunkSlots[LOADED_CHUNKS_AXIS][LOADED_CHUNKS_AXIS];
+};
+
+/*
+Occupancy pyramid, one per slot: a bit per cell, set if any voxel in the cell
+is solid (glass included). Level 0 has cells 4 voxels a side, each level up
+is 4 times wider, the top one covering the whole chunk. Bits are indexed
+[x][y][z] within a level, like voxels. Unlike distances it never tops out and
+doesn't depend on the distance pass having run, so rays can leap over large
+empty regions with it.
+*/
+constexpr int OCCUPANCY_LEVELS = 4;
+constexpr int occupancyCellSize(int level) {
+    return 4 << (2 * level);
+}
+constexpr int occupancyCellsAcross(int level) {
+    return CHUNK_WIDTH_VOXELS / occupancyCellSize(level);
+}
+constexpr int occupancyCellsUp(int level) {
+    return CHUNK_HEIGHT_VOXELS / occupancyCellSize(level);
+}
+/* In uint32s from the start of a slot's pyramid */
+constexpr int occupancyLevelOffset(int level) {
+    int offset = 0;
+    for (int l = 0; l < level; l++) {
+        offset += (occupancyCellsAcross(l) * occupancyCellsAcross(l) * occupancyCellsUp(l) + 31) / 32;
     }
+    return offset;
+}
+constexpr int OCCUPANCY_WORDS_PER_CHUNK = occupancyLevelOffset(OCCUPANCY_LEVELS);
+static_assert(CHUNK_WIDTH_VOXELS % occupancyCellSize(OCCUPANCY_LEVELS - 1) == 0 &&
+              CHUNK_HEIGHT_VOXELS % occupancyCellSize(OCCUPANCY_LEVELS - 1) == 0,
+              "Chunks have to split into whole cells on every occupancy level");
+
+constexpr size_t BRICK_TABLE_OFFSET = sizeof(ChunkMap);
+constexpr size_t BRICK_TABLE_SIZE_BYTES = sizeof(uint32_t) * TOTAL_CHUNKS_LOADED * BRICKS_PER_CHUNK;
+constexpr size_t BRICK_POOL_OFFSET = BRICK_TABLE_OFFSET + BRICK_TABLE_SIZE_BYTES;
+/* Bound on its own together with the brick occupancy after it, so aligned for
+   any minStorageBufferOffsetAlignment (at most 256) */
+constexpr size_t OCCUPANCY_OFFSET = (BRICK_POOL_OFFSET + sizeof(Brick) * size_t(MAX_BRICKS) + 255) / 256 * 256;
+constexpr size_t OCCUPANCY_SIZE_BYTES = sizeof(uint32_t) * TOTAL_CHUNKS_LOADED * OCCUPANCY_WORDS_PER_CHUNK;
+/* One BrickOccupancy per brick in the pool, same indices */
+constexpr size_t BRICK_OCCUPANCY_OFFSET = OCCUPANCY_OFFSET + OCCUPANCY_SIZE_BYTES;
+constexpr size_t VOXEL_BUFFER_SIZE_BYTES = BRICK_OCCUPANCY_OFFSET + sizeof(BrickOccupancy) * size_t(MAX_BRICKS);
+
+/* What getWorldVoxel, and getVoxel in shader.comp, give outside the world. Below -Material for any material. */
+constexpr int OUTSIDE_WORLD = -256;
+
+/* A byte range of the GPU voxel buffer */
+struct VoxelBufferRegion {
+    size_t offset;
+    size_t size;
 };
 
+/*
+A single chunk stored densely, indexed [x][y][z]. The generator works on
+one of these and the result is then compressed into LoadedChunks.
+*/
 struct VoxelChunk {
-    LoadedChunks* world;
-    int chunkX;
-    int chunkY;
+    static constexpr int sizeX = CHUNK_WIDTH_VOXELS;
+    static constexpr int sizeY = CHUNK_WIDTH_VOXELS;
+    static constexpr int sizeZ = CHUNK_HEIGHT_VOXELS;
+
+    /* A bit per voxel, set if it's solid, so each column is CHUNK_HEIGHT_VOXELS / 32 words */
+    uint32_t solid[CHUNK_WIDTH_VOXELS * CHUNK_WIDTH_VOXELS * CHUNK_HEIGHT_VOXELS / 32];
+    Material materials[CHUNK_WIDTH_VOXELS][CHUNK_WIDTH_VOXELS][CHUNK_HEIGHT_VOXELS];
+    /* For each brick, the distance from its closest voxel to a solid one
+       outside it. Filled in by the generator's distance pass, and only kept
+       for bricks with nothing solid in them. */
+    uint8_t brickDistances[CHUNK_WIDTH_BRICKS][CHUNK_WIDTH_BRICKS][CHUNK_HEIGHT_BRICKS];
 
-    VoxelChunk(LoadedChunks* _world, int _chunkX, int _chunkY) {
-        world = _world;
-        chunkX = _chunkX;
-        chunkY = _chunkY;
+    void clear() {
+        memset(solid, 0, sizeof(solid));
+        memset(materials, 0, sizeof(materials));
+        memset(brickDistances, 0, sizeof(brickDistances));
+    }
+    bool isSolid(int x, int y, int z) const {
+        const size_t bit = (size_t(x) * CHUNK_WIDTH_VOXELS + y) * CHUNK_HEIGHT_VOXELS + z;
+        return (solid[bit / 32] >> (bit % 32)) & 1u;
+    }
+    Material getMaterial(int x, int y, int z) const {
+        return materials[x][y][z];
     }
+    /* Material 0 clears the voxel */
+    void setMaterial(int x, int y, int z, Material m) {
+        const size_t bit = (size_t(x) * CHUNK_WIDTH_VOXELS + y) * CHUNK_HEIGHT_VOXELS + z;
+        materials[x][y][z] = m;
+        solid[bit / 32] = (solid[bit / 32] & ~(1u << (bit % 32))) | (uint32_t(m != 0) << (bit % 32));
+    }
+};
+
+/* Indexed [x][y][z] like VoxelChunk, so a column of a box is contiguous */
+struct VoxelColumns {
+    std::vector<Voxel> voxels;
+    int sizeX;
+    int sizeY;
+    int sizeZ;
 
-    Voxel getVoxel(int x, int y, int z) {
-        return world->getVoxel(chunkX, chunkY, x, y, z);
+    VoxelColumns(int sx, int sy, int sz) : voxels(size_t(sx) * sy * sz), sizeX(sx), sizeY(sy), sizeZ(sz) {}
+    Voxel* column(int x, int y) {
+        return &voxels[(size_t(x) * sizeY + y) * sizeZ];
+    }
+    const Voxel* column(int x, int y) const {
+        return &voxels[(size_t(x) * sizeY + y) * sizeZ];
+    }
+    Voxel getVoxel(int x, int y, int z) const {
+        return voxels[(size_t(x) * sizeY + y) * sizeZ + z];
     }
     void setVoxel(int x, int y, int z, const Voxel& v) {
-        world->setVoxel(chunkX, chunkY, x, y, z, v);
+        voxels[(size_t(x) * sizeY + y) * sizeZ + z] = v;
+    }
+    bool isSolid(int x, int y, int z) const {
+        return getVoxel(x, y, z) < 0;
+    }
+};
+
+/*
+Distances across the borders of a chunk with its loaded neighbours, worked
+out by LoadedChunks::computeStitch but not yet applied to anything
+*/
+struct ChunkStitch {
+    struct Box {
+        /* Towards the neighbour */
+        glm::ivec2 offset;
+        /* In voxels, relative to the chunk */
+        glm::ivec2 lo;
+        /* Whole columns, from the solid voxels in and around the box when it was read */
+        VoxelColumns distances;
+    };
+    int chunkX;
+    int chunkY;
+    std::vector<Box> boxes;
+};
+
+/* A chunk compressed into bricks, but not yet placed in LoadedChunks' brick pool */
+struct CompressedChunk {
+    int chunkX;
+    int chunkY;
+    /* A uniform entry as in the brick table, or an index into bricks */
+    std::vector<uint32_t> entries;
+    std::vector<Brick> bricks;
+    /* One per brick */
+    std::vector<BrickOccupancy> brickOccupancy;
+    /* OCCUPANCY_WORDS_PER_CHUNK words */
+    std::vector<uint32_t> occupancy;
+};
+
+class LoadedChunks
+{
+public:
+    LoadedChunks();
+
+    /* Coordinates are in world chunks. Throws if the chunk isn't loaded. */
+    Material getMaterial(int chunkX, int chunkY, int x, int y, int z) const;
+    /* Same as getVoxel in shader.comp: in world voxels, -material for solid ones, otherwise
+       the distance of their brick if it's empty and 0 if not. OUTSIDE_WORLD outside the
+       loaded window and above or below the world, 0 in chunks that haven't been stored yet. */
+    int getWorldVoxel(int x, int y, int z) const;
+    /* Same as isOccupied in shader.comp: whether the occupancy cell at level holding
+       world voxel (x, y, z) has anything solid in it. Only call where getWorldVoxel isn't OUTSIDE_WORLD. */
+    bool isWorldCellOccupied(int level, int x, int y, int z) const;
+    void loadChunk(int chunkX, int chunkY, VoxelChunk& chunk) const;
+    bool isLoaded(int chunkX, int chunkY) const;
+
+    /* Does the expensive part of storeChunk, touches no shared state so can run on any thread */
+    static void compressChunk(int chunkX, int chunkY, const VoxelChunk& chunk, CompressedChunk& result);
+    /* Replace whatever is in the chunk's slot. Safe to call from several threads for different slots. */
+    void storeChunk(const CompressedChunk& chunk);
+    void storeChunk(int chunkX, int chunkY, const VoxelChunk& chunk);
+    /* Chunks are generated on their own, so distances near a border don't know about
+       voxels just across it. Once a chunk is stored, this lowers the distances of empty
+       bricks along its borders with every loaded neighbour, on both sides. Same as computeStitch followed
+       by applyStitch. */
+    void stitchChunk(int chunkX, int chunkY, ThreadPool* pool = nullptr);
+    /* The expensive part of stitchChunk, spread over pool. Changes nothing, and only holds
+       the lock while reading a row of columns, so it can run on any thread while chunks
+       are being stored and uploaded. */
+    void computeStitch(int chunkX, int chunkY, ChunkStitch& result, ThreadPool* pool = nullptr) const;
+    /* Lower distances of empty bricks to those in stitch. Columns in chunks that have
+       been replaced since it was computed are skipped. */
+    void applyStitch(const ChunkStitch& stitch);
+
+    /* Move the window of loaded chunks. Chunks that fall out of it stay in their
+       slot until something else is stored there, but are no longer visible. */
+    void setLowestChunk(int chunkX, int chunkY);
+    const ChunkMap& getChunkMap() const { return chunkMap; }
+
+    /* Parts of the GPU buffer changed since the last call. Regions never span
+       more than one of the map, table, pool, occupancy and brick occupancy. */
+    std::vector<VoxelBufferRegion> takeDirtyRegions();
+    void copyRegion(const VoxelBufferRegion& region, void* dst) const;
+
+    /* Bricks past this index have never been used */
+    size_t getBrickCount() const { return bricks.size(); }
+    size_t getFreeBrickCount() const { return freeBricks.size(); }
+
+    /* Coordinates are within the chunk, see MORTON_ORDER */
+    static int brickIndex(int x, int y, int z) {
+        if (MORTON_ORDER) {
+            return mortonIndex(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE);
+        }
+        return ((x / BRICK_SIZE) * CHUNK_WIDTH_BRICKS + y / BRICK_SIZE) * CHUNK_HEIGHT_BRICKS + z / BRICK_SIZE;
+    }
+    static int voxelInBrick(int x, int y, int z) {
+        if (MORTON_ORDER) {
+            return mortonIndex(x % BRICK_SIZE, y % BRICK_SIZE, z % BRICK_SIZE);
+        }
+        return ((x % BRICK_SIZE) * BRICK_SIZE + y % BRICK_SIZE) * BRICK_SIZE + z % BRICK_SIZE;
+    }
+    static int occupancyBit(int level, int x, int y, int z) {
+        const int size = occupancyCellSize(level);
+        return (x / size * occupancyCellsAcross(level) + y / size) * occupancyCellsUp(level) + z / size;
+    }
+    static int slotIndex(int chunkX, int chunkY) {
+        auto wrap = [](int c) {
+            return ((c % LOADED_CHUNKS_AXIS) + LOADED_CHUNKS_AXIS) % LOADED_CHUNKS_AXIS;
+        };
+        return wrap(chunkX) * LOADED_CHUNKS_AXIS + wrap(chunkY);
     }
+
+private:
+    void freeSlot(int slot);
+    void updateChunkMap();
+    /* A whole column of CHUNK_HEIGHT_VOXELS voxels, -1 where they're solid and 0 elsewhere */
+    void readColumn(int chunkX, int chunkY, int x, int y, Voxel* column) const;
+    /* Lower the distances of empty bricks the column passes through to the smallest given for
+       them in distances */
+    void lowerColumn(int chunkX, int chunkY, int x, int y, const Voxel* distances);
+    /* Cap distances of empty bricks in a chunk to how far they are from the neighbour at (dx, dy) */
+    void capDistancesTowards(int chunkX, int chunkY, int dx, int dy);
+    const uint32_t* slotTable(int chunkX, int chunkY) const;
+    /* Which slot holds world voxel column (x, y) and where in the chunk, false outside the
+       loaded window. slot is -1 if that chunk hasn't been stored yet. */
+    bool findWorldColumn(int x, int y, int& slot, int& localX, int& localY) const;
+
+    ChunkMap chunkMap;
+    std::vector<uint32_t> brickTable;
+    std::vector<Brick> bricks;
+    std::vector<BrickOccupancy> brickOccupancy;
+    std::vector<uint32_t> freeBricks;
+    std::vector<uint32_t> occupancy;
+    /* World chunk held by each slot */
+    std::vector<glm::ivec2> slotChunks;
+    std::vector<bool> slotFilled;
+
+    bool chunkMapDirty = true;
+    std::vector<bool> slotTableDirty;
+    std::vector<bool> slotOccupancyDirty;
+    std::vector<uint32_t> dirtyBricks;
+    mutable std::mutex bricksMutex;
 };
 
+/* Materials of a small piece of the world, blitted into a VoxelChunk by the generator */
 struct VoxelFragment {
-    Voxel* voxels;
+    Material* materials;
     int sizeX;
     int sizeY;
     int sizeZ;
 
     VoxelFragment(int sx, int sy, int sz) {
-        voxels = new Voxel[sx*sy*sz];
+        materials = new Material[sx*sy*sz];
         sizeX = sx;
         sizeY = sy;
         sizeZ = sz;
     }
     ~VoxelFragment() {
-        //delete[] voxels;
+        //delete[] materials;
     }
-    void freeVoxels() { delete[] voxels; }
-    Voxel getVoxel(int x, int y, int z) {
-        return voxels[x + y * sizeX + z * sizeX * sizeY];
+    void freeMaterials() { delete[] materials; }
+    Material getMaterial(int x, int y, int z) {
+        return materials[x + y * sizeX + z * sizeX * sizeY];
     }
-    void setVoxel(int x, int y, int z, const Voxel& v) {
-        voxels[x + y * sizeX + z * sizeX * sizeY] = v;
+    void setMaterial(int x, int y, int z, Material m) {
+        materials[x + y * sizeX + z * sizeX * sizeY] = m;
     }
 };
 
@@ -100,9 +418,33 @@ class WorldGenerator
 public:
     WorldGenerator() {}
 
-    static void generateChunk(VoxelChunk* result, int chunkX, int chunkY);
+    /* Thread safe as long as no two calls write to the same chunk. The distance
+       pass is split between pool's threads, the calling thread may be one of them. */
+    static void generateChunk(VoxelChunk* result, int chunkX, int chunkY, ThreadPool* pool = nullptr);
+
+    struct DistanceValidation {
+        /* Random fragments that differ from the brute force search, or in parallel from serial */
+        int fragmentMismatches;
+        /* The whole chunk is only checked with a pool */
+        bool chunkChecked;
+        bool chunkMatches;
+    };
+
+    /* Compare the distance transform against a brute force search on random
+       fragments, and with a pool, against itself run in parallel on those
+       fragments and on a whole chunk, which is also timed. */
+    static DistanceValidation validateDistances(int numFragments, uint32_t validationSeed, ThreadPool* pool = nullptr);
+
+    /* Time voxelizing trees and buildings through SDFChain without and with culling,
+       SDFTape, batched SDFTape and the octree rasterizer, and check all give the same
+       voxels. Returns the number that differ out of comparisons. */
+    static int benchmarkSDFTape(int numRuns, uint32_t benchmarkSeed, int& comparisons);
+
+    static void setSeed(uint32_t s) { seed = s; }
+    static uint32_t getSeed() { return seed; }
 
 private:
+    static uint32_t seed;
 };
 
 #endif // WORLDGENERATOR_H